@@ -32,10 +32,15 @@
 #define __BETA_BINOM_H__
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/hts.h>
 
 typedef struct _beta_binom_t beta_binom_t;
+typedef struct _beta_binom_table_t beta_binom_table_t;
+typedef struct _beta_binom_cache_t beta_binom_cache_t;
 
 struct _beta_binom_t {
     double p;
@@ -48,6 +53,30 @@ struct _beta_binom_t {
     int m_log_gamma_alpha;
     int m_log_gamma_beta;
     int m_log_gamma_alpha_beta;
+    beta_binom_cache_t *cache; // if set, the tables are borrowed from the cache
+    beta_binom_table_t *table;
+    beta_binom_t *probe; // private tables for parameters not worth caching, see beta_binom_update_probe()
+};
+
+// tables for one (p, rho) pair, never modified once inserted in the cache
+struct _beta_binom_table_t {
+    double p;
+    double rho;
+    int n1;
+    int n2;
+    double *log_gamma_alpha;
+    double *log_gamma_beta;
+    double *log_gamma_alpha_beta;
+    int ref;       // references from the cache and from the beta_binom_t objects using the table
+    uint64_t used; // last time the table was requested, for eviction
+};
+
+// least recently used tables, shared by the beta_binom_t objects of different threads
+struct _beta_binom_cache_t {
+    beta_binom_table_t **a;
+    int n, m;
+    uint64_t clock;
+    pthread_mutex_t lock;
 };
 
 beta_binom_t *beta_binom_init() {
@@ -60,10 +89,21 @@ beta_binom_t *beta_binom_init() {
     return self;
 }
 
+void beta_binom_table_release(beta_binom_table_t *table);
+
 void beta_binom_destroy(beta_binom_t *self) {
-    free(self->log_gamma_alpha);
-    free(self->log_gamma_beta);
-    free(self->log_gamma_alpha_beta);
+    if (self->cache) {
+        if (self->table) {
+            pthread_mutex_lock(&self->cache->lock);
+            beta_binom_table_release(self->table);
+            pthread_mutex_unlock(&self->cache->lock);
+        }
+    } else {
+        free(self->log_gamma_alpha);
+        free(self->log_gamma_beta);
+        free(self->log_gamma_alpha_beta);
+    }
+    if (self->probe) beta_binom_destroy(self->probe);
     free(self);
 }
 
@@ -83,7 +123,34 @@ void beta_binom_destroy(beta_binom_t *self) {
 // p is the probability of success
 // rho is the "intra class" or "intra cluster" correlation
 // in Artieri et al. 2017, overdispersion is exactly "(1 - rho) / rho"
+beta_binom_table_t *beta_binom_cache_get(beta_binom_cache_t *self, double p, double rho, int n1, int n2);
+void beta_binom_update_probe(beta_binom_t *self, double p, double rho, int n1, int n2);
+
 void beta_binom_update(beta_binom_t *self, double p, double rho, int n1, int n2) {
+    if (self->cache) {
+        if (self->table && self->p == p && self->rho == rho && self->n1 >= n1 && self->n2 >= n2) return;
+        // larger tables for the parameters of the last probe are computed privately as well
+        if (!self->table && self->probe && self->p == p && self->rho == rho) {
+            beta_binom_update_probe(self, p, rho, n1, n2);
+            return;
+        }
+        beta_binom_table_t *table = beta_binom_cache_get(self->cache, p, rho, n1, n2);
+        if (self->table) {
+            pthread_mutex_lock(&self->cache->lock);
+            beta_binom_table_release(self->table);
+            pthread_mutex_unlock(&self->cache->lock);
+        }
+        self->table = table;
+        self->p = table->p;
+        self->rho = table->rho;
+        self->n1 = table->n1;
+        self->n2 = table->n2;
+        self->log_gamma_alpha = table->log_gamma_alpha;
+        self->log_gamma_beta = table->log_gamma_beta;
+        self->log_gamma_alpha_beta = table->log_gamma_alpha_beta;
+        return;
+    }
+
     if (self->p != p || self->rho != rho) {
         self->p = p;
         self->rho = rho;
@@ -132,6 +199,33 @@ void beta_binom_update(beta_binom_t *self, double p, double rho, int n1, int n2)
     }
 }
 
+/**
+ *  beta_binom_update_probe() - same as beta_binom_update() but the tables are never taken from or inserted in the cache
+ *  Meant for the parameters probed by a minimizer, which are never requested twice, so that they neither contend the
+ *  cache lock nor evict the tables of the parameters that are reused
+ */
+void beta_binom_update_probe(beta_binom_t *self, double p, double rho, int n1, int n2) {
+    if (!self->cache) {
+        beta_binom_update(self, p, rho, n1, n2);
+        return;
+    }
+    if (self->table) {
+        pthread_mutex_lock(&self->cache->lock);
+        beta_binom_table_release(self->table);
+        pthread_mutex_unlock(&self->cache->lock);
+        self->table = NULL;
+    }
+    if (!self->probe) self->probe = beta_binom_init();
+    beta_binom_update(self->probe, p, rho, n1, n2);
+    self->p = self->probe->p;
+    self->rho = self->probe->rho;
+    self->n1 = self->probe->n1;
+    self->n2 = self->probe->n2;
+    self->log_gamma_alpha = self->probe->log_gamma_alpha;
+    self->log_gamma_beta = self->probe->log_gamma_beta;
+    self->log_gamma_alpha_beta = self->probe->log_gamma_alpha_beta;
+}
+
 /**
  *  beta_binom_log_unsafe() - density function of the beta binomial distribution
  *  Returns the equivalent of dbeta_binom(a, a+b, p, (1 - rho) / rho, log=TRUE) from R package
@@ -151,4 +245,163 @@ inline double beta_binom_log(beta_binom_t *self, int a, int b) {
     return beta_binom_log_unsafe(self, a, b);
 }
 
+/**
+ *  beta_binom_log_batch() - density function of the beta binomial distribution for arrays of counts
+ *  @a: first counts
+ *  @b: second counts
+ *  @imap: optional map of the entries of a and b to use
+ *  @n: number of entries
+ *  @log_lkl: output densities, set to 0 when either count is negative (missing)
+ *  The tables must have been updated for the largest counts, as with beta_binom_log_unsafe()
+ */
+void beta_binom_log_batch(const beta_binom_t *self, const int16_t *a, const int16_t *b, const int *imap, int n,
+                          float *log_lkl) {
+    const double *log_gamma_alpha = self->log_gamma_alpha;
+    const double *log_gamma_beta = self->log_gamma_beta;
+    const double *log_gamma_alpha_beta = self->log_gamma_alpha_beta;
+    for (int i = 0; i < n; i++) {
+        int x = imap ? a[imap[i]] : a[i];
+        int y = imap ? b[imap[i]] : b[i];
+        log_lkl[i] = x < 0 || y < 0 ? 0.0f
+                                    : (float)(log_gamma_alpha[x] + log_gamma_beta[y] - log_gamma_alpha_beta[x + y]);
+    }
+}
+
+/**
+ *  beta_binom_cache_init() - shared cache of beta binomial tables
+ *  @size: maximum number of (p, rho) pairs kept in the cache
+ *  beta_binom_t objects attached to the cache with beta_binom_use_cache() borrow their tables from it, tables are never
+ *  modified once computed so they can be used by several threads, and when larger tables are needed they are computed
+ *  from the existing ones and replace them in the cache
+ */
+beta_binom_cache_t *beta_binom_cache_init(int size) {
+    beta_binom_cache_t *self = (beta_binom_cache_t *)calloc(1, sizeof(beta_binom_cache_t));
+    self->m = size > 0 ? size : 1;
+    self->a = (beta_binom_table_t **)calloc(self->m, sizeof(beta_binom_table_t *));
+    pthread_mutex_init(&self->lock, NULL);
+    return self;
+}
+
+// must be called with the cache lock held
+void beta_binom_table_release(beta_binom_table_t *table) {
+    if (--table->ref > 0) return;
+    free(table->log_gamma_alpha);
+    free(table->log_gamma_beta);
+    free(table->log_gamma_alpha_beta);
+    free(table);
+}
+
+void beta_binom_cache_destroy(beta_binom_cache_t *self) {
+    for (int i = 0; i < self->n; i++) beta_binom_table_release(self->a[i]);
+    free(self->a);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
+
+// the tables of the object are dropped and borrowed from the cache from now on
+void beta_binom_use_cache(beta_binom_t *self, beta_binom_cache_t *cache) {
+    free(self->log_gamma_alpha);
+    free(self->log_gamma_beta);
+    free(self->log_gamma_alpha_beta);
+    self->log_gamma_alpha = NULL;
+    self->log_gamma_beta = NULL;
+    self->log_gamma_alpha_beta = NULL;
+    self->m_log_gamma_alpha = 0;
+    self->m_log_gamma_beta = 0;
+    self->m_log_gamma_alpha_beta = 0;
+    self->p = NAN;
+    self->rho = NAN;
+    self->n1 = 0;
+    self->n2 = 0;
+    self->cache = cache;
+    self->table = NULL;
+}
+
+// computes the tables for (p, rho), extending the tables of a smaller one if available
+beta_binom_table_t *beta_binom_table_init(double p, double rho, int n1, int n2, const beta_binom_table_t *prev) {
+    beta_binom_t tmp = {0};
+    tmp.p = p;
+    tmp.rho = rho;
+    hts_expand0(double, 1, tmp.m_log_gamma_alpha, tmp.log_gamma_alpha);
+    hts_expand0(double, 1, tmp.m_log_gamma_beta, tmp.log_gamma_beta);
+    hts_expand0(double, 1, tmp.m_log_gamma_alpha_beta, tmp.log_gamma_alpha_beta);
+    if (prev) {
+        hts_expand(double, prev->n1 + 1, tmp.m_log_gamma_alpha, tmp.log_gamma_alpha);
+        hts_expand(double, prev->n1 + 1, tmp.m_log_gamma_beta, tmp.log_gamma_beta);
+        hts_expand(double, prev->n2 + 1, tmp.m_log_gamma_alpha_beta, tmp.log_gamma_alpha_beta);
+        memcpy(tmp.log_gamma_alpha, prev->log_gamma_alpha, (prev->n1 + 1) * sizeof(double));
+        memcpy(tmp.log_gamma_beta, prev->log_gamma_beta, (prev->n1 + 1) * sizeof(double));
+        memcpy(tmp.log_gamma_alpha_beta, prev->log_gamma_alpha_beta, (prev->n2 + 1) * sizeof(double));
+        tmp.n1 = prev->n1;
+        tmp.n2 = prev->n2;
+    }
+    if (n1 < tmp.n1) n1 = tmp.n1;
+    if (n2 < tmp.n2) n2 = tmp.n2;
+    beta_binom_update(&tmp, p, rho, n1, n2);
+
+    beta_binom_table_t *table = (beta_binom_table_t *)calloc(1, sizeof(beta_binom_table_t));
+    table->p = p;
+    table->rho = rho;
+    table->n1 = tmp.n1;
+    table->n2 = tmp.n2;
+    table->log_gamma_alpha = tmp.log_gamma_alpha;
+    table->log_gamma_beta = tmp.log_gamma_beta;
+    table->log_gamma_alpha_beta = tmp.log_gamma_alpha_beta;
+    return table;
+}
+
+/**
+ *  beta_binom_cache_get() - returns tables for (p, rho) at least as large as n1 and n2
+ *  The returned table holds a reference that must be released with beta_binom_table_release() under the cache lock
+ */
+beta_binom_table_t *beta_binom_cache_get(beta_binom_cache_t *self, double p, double rho, int n1, int n2) {
+    pthread_mutex_lock(&self->lock);
+    int i;
+    for (i = 0; i < self->n; i++)
+        if (self->a[i]->p == p && self->a[i]->rho == rho) break;
+    beta_binom_table_t *prev = i < self->n ? self->a[i] : NULL;
+    if (prev && prev->n1 >= n1 && prev->n2 >= n2) {
+        prev->ref++;
+        prev->used = ++self->clock;
+        pthread_mutex_unlock(&self->lock);
+        return prev;
+    }
+    if (prev) prev->ref++;
+    pthread_mutex_unlock(&self->lock);
+
+    // the tables are computed without holding the lock
+    beta_binom_table_t *table = beta_binom_table_init(p, rho, n1, n2, prev);
+
+    pthread_mutex_lock(&self->lock);
+    if (prev) beta_binom_table_release(prev);
+    for (i = 0; i < self->n; i++)
+        if (self->a[i]->p == p && self->a[i]->rho == rho) break;
+    if (i < self->n) {
+        // another thread might have inserted larger tables in the meantime
+        if (self->a[i]->n1 >= table->n1 && self->a[i]->n2 >= table->n2) {
+            table->ref = 1;
+            beta_binom_table_release(table);
+            table = self->a[i];
+        } else {
+            beta_binom_table_release(self->a[i]);
+            self->a[i] = table;
+            table->ref = 1;
+        }
+    } else {
+        if (self->n == self->m) {
+            int k = 0;
+            for (int j = 1; j < self->n; j++)
+                if (self->a[j]->used < self->a[k]->used) k = j;
+            beta_binom_table_release(self->a[k]);
+            self->a[k] = self->a[--self->n];
+        }
+        self->a[self->n++] = table;
+        table->ref = 1;
+    }
+    table->ref++;
+    table->used = ++self->clock;
+    pthread_mutex_unlock(&self->lock);
+    return table;
+}
+
 #endif
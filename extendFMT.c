@@ -48,6 +48,12 @@ typedef struct {
     int *dist;    // distances to closest predetermined value
 } data_t;
 
+// queue of the records with a predetermined value for a sample that have not been flushed yet
+typedef struct {
+    int64_t *a; // record numbers
+    int head, n, m;
+} queue_t;
+
 typedef struct {
     int win;
     int nsmpl; // number of samples
@@ -57,6 +63,12 @@ typedef struct {
     int8_t *phase_arr;
     data_t *data;
     rbuf_t rbuf;
+    int64_t n_seq;     // number of records pushed
+    int64_t epoch;     // number of the first record of the current contig
+    int64_t *last_seq; // number of the last record with a predetermined value for each sample
+    hts_pos_t *last_pos;
+    void *last_vals;
+    queue_t *next; // records with a predetermined value for each sample, to propagate backwards
 } auxbuf_t;
 
 static auxbuf_t *auxbuf_init(int win, int nsmpl, int type, int fmt_id, int gt_id) {
@@ -77,6 +89,11 @@ static auxbuf_t *auxbuf_init(int win, int nsmpl, int type, int fmt_id, int gt_id
     buf->fmt_id = fmt_id;
     buf->gt_id = gt_id;
     buf->phase_arr = (int8_t *)malloc(buf->nsmpl * sizeof(int8_t));
+    buf->last_seq = (int64_t *)malloc(buf->nsmpl * sizeof(int64_t));
+    for (int k = 0; k < buf->nsmpl; k++) buf->last_seq[k] = -1;
+    buf->last_pos = (hts_pos_t *)malloc(buf->nsmpl * sizeof(hts_pos_t));
+    buf->last_vals = malloc(buf->nsmpl * buf->size);
+    buf->next = (queue_t *)calloc(buf->nsmpl, sizeof(queue_t));
     rbuf_init(&buf->rbuf, 0);
     return buf;
 }
@@ -87,25 +104,43 @@ static void auxbuf_destroy(auxbuf_t *buf) {
         if (buf->data[i].vals) free(buf->data[i].vals);
         if (buf->data[i].dist) free(buf->data[i].dist);
     }
+    for (int k = 0; k < buf->nsmpl; k++) free(buf->next[k].a);
     free(buf->data);
     free(buf->phase_arr);
+    free(buf->last_seq);
+    free(buf->last_pos);
+    free(buf->last_vals);
+    free(buf->next);
     free(buf);
 }
 
+static inline void queue_push(queue_t *q, int64_t seq) {
+    if (q->head > 0 && q->n == q->m) {
+        memmove(q->a, q->a + q->head, (q->n - q->head) * sizeof(int64_t));
+        q->n -= q->head;
+        q->head = 0;
+    }
+    q->n++;
+    hts_expand(int64_t, q->n, q->m, q->a);
+    q->a[q->n - 1] = seq;
+}
+
 // push a new record into the buffer
 static void auxbuf_push(auxbuf_t *buf, bcf1_t *line) {
+    // values are not extended across contigs
+    if (buf->rbuf.n == 0) buf->epoch = buf->n_seq;
     rbuf_expand0(&buf->rbuf, data_t, buf->rbuf.n + 1, buf->data);
     int curr = rbuf_append(&buf->rbuf);
+    int64_t seq = buf->n_seq++;
 
-    // if a record is already present in the buffer, destroy it
-    if (buf->data[curr].line) bcf_destroy(buf->data[curr].line);
-    buf->data[curr].line = bcf_dup(line);
+    // copy the record into the slot, reusing the memory of the record previously in the slot
+    if (!buf->data[curr].line) buf->data[curr].line = bcf_init();
+    bcf_copy(buf->data[curr].line, line);
     // allocate auxiliary arrays if they have not been previously allocated (this minimizes
     // necessary allocations)
     if (!buf->data[curr].vals) buf->data[curr].vals = malloc(buf->nsmpl * buf->size);
     if (!buf->data[curr].dist) buf->data[curr].dist = (int *)malloc(buf->nsmpl * sizeof(int));
     memset(buf->data[curr].dist, 0, buf->nsmpl * sizeof(int));
-
     int phase =
         (buf->gt_id < 0) ? 0 : bcf_get_genotype_phase(bcf_get_fmt_id(line, buf->gt_id), buf->phase_arr, buf->nsmpl);
 
@@ -144,31 +179,22 @@ static void auxbuf_push(auxbuf_t *buf, bcf1_t *line) {
         memset(buf->data[curr].vals, 0, buf->nsmpl * buf->size);
     }
 
-    int prev = curr;
-    rbuf_prev(&buf->rbuf, &prev);
-    int prev_dist = buf->data[curr].line->pos - buf->data[prev].line->pos;
-
-// propagate information backwards
+    // propagate information forwards from the last predetermined value, while the records with a predetermined
+    // value are queued to propagate information backwards when the records preceding them are flushed
+    hts_pos_t pos = line->pos;
 #define BRANCH(ht_type_t)                                                                                              \
     {                                                                                                                  \
+        ht_type_t *curr_vals = (ht_type_t *)buf->data[curr].vals;                                                      \
+        ht_type_t *last_vals = (ht_type_t *)buf->last_vals;                                                            \
         for (int k = 0; k < buf->nsmpl; k++) {                                                                         \
-            ht_type_t *curr_vals = (ht_type_t *)buf->data[curr].vals;                                                  \
             if (curr_vals[k]) {                                                                                        \
-                int i = curr;                                                                                          \
-                while (rbuf_prev(&buf->rbuf, &i)) {                                                                    \
-                    ht_type_t *vals = (ht_type_t *)buf->data[i].vals;                                                  \
-                    int i_dist = buf->data[curr].dist[k] + buf->data[curr].line->pos - buf->data[i].line->pos;         \
-                    if (i_dist <= buf->win && (vals[k] == (ht_type_t)0 || i_dist < buf->data[i].dist[k])) {            \
-                        vals[k] = curr_vals[k];                                                                        \
-                        buf->data[i].dist[k] = i_dist;                                                                 \
-                    }                                                                                                  \
-                }                                                                                                      \
-            } else if (prev != curr) {                                                                                 \
-                ht_type_t *prev_vals = (ht_type_t *)buf->data[prev].vals;                                              \
-                if (prev_vals[k] && buf->data[prev].dist[k] + prev_dist <= buf->win) {                                 \
-                    curr_vals[k] = prev_vals[k];                                                                       \
-                    buf->data[curr].dist[k] = buf->data[prev].dist[k] + prev_dist;                                     \
-                }                                                                                                      \
+                buf->last_seq[k] = seq;                                                                                \
+                buf->last_pos[k] = pos;                                                                                \
+                last_vals[k] = curr_vals[k];                                                                           \
+                queue_push(&buf->next[k], seq);                                                                        \
+            } else if (buf->last_seq[k] >= buf->epoch && pos - buf->last_pos[k] <= buf->win) {                         \
+                curr_vals[k] = last_vals[k];                                                                           \
+                buf->data[curr].dist[k] = (int)(pos - buf->last_pos[k]);                                               \
             }                                                                                                          \
         }                                                                                                              \
     }
@@ -188,8 +214,38 @@ static data_t *auxbuf_flush(auxbuf_t *buf, int flush_all) {
     int last = rbuf_last(&buf->rbuf);
     if (!flush_all && buf->data[last].line->pos - buf->data[first].line->pos <= buf->win) return NULL;
 
+    int64_t seq = buf->n_seq - buf->rbuf.n;
     int i = rbuf_shift(&buf->rbuf);
     bcf1_t *line = buf->data[i].line;
+
+    // propagate information backwards from the first following record with a predetermined value, if closer
+#define BRANCH(type_t)                                                                                                 \
+    {                                                                                                                  \
+        type_t *vals = (type_t *)buf->data[i].vals;                                                                    \
+        for (int k = 0; k < buf->nsmpl; k++) {                                                                         \
+            queue_t *q = &buf->next[k];                                                                                \
+            while (q->head < q->n && q->a[q->head] <= seq) q->head++;                                                  \
+            if (q->head == q->n) {                                                                                     \
+                q->head = q->n = 0;                                                                                    \
+                continue;                                                                                              \
+            }                                                                                                          \
+            const data_t *next = &buf->data[rbuf_kth(&buf->rbuf, (int)(q->a[q->head] - seq - 1))];                     \
+            hts_pos_t next_dist = next->line->pos - line->pos;                                                         \
+            if (next_dist <= buf->win && (vals[k] == (type_t)0 || next_dist < buf->data[i].dist[k])) {                 \
+                vals[k] = ((type_t *)next->vals)[k];                                                                   \
+                buf->data[i].dist[k] = (int)next_dist;                                                                 \
+            }                                                                                                          \
+        }                                                                                                              \
+    }
+    if (buf->type == BCF_HT_INT) {
+        BRANCH(int32_t);
+    } else if (buf->type == BCF_HT_REAL) {
+        BRANCH(float);
+    } else {
+        error("Unexpected type %d\n", buf->type);
+    }
+#undef BRANCH
+
     int phase =
         (buf->gt_id < 0) ? 0 : bcf_get_genotype_phase(bcf_get_fmt_id(line, buf->gt_id), buf->phase_arr, buf->nsmpl);
 
@@ -30,10 +30,18 @@
 #include <errno.h>
 #include <ctype.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
 #include <htslib/kseq.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/tbx.h>
 #include <htslib/ksort.h>
+#include <htslib/thread_pool.h>
 #include "regidx.h"
 #include "kmin.h"
 #include "mocha.h"
@@ -67,6 +75,7 @@
 #define LRR_BIAS_DFLT "0.2"
 // https://www.illumina.com/documents/products/technotes/technote_cnv_algorithms.pdf
 #define LRR_HAP2DIP_DFLT "0.45"
+#define RECALL_TOLERANCE_DFLT "0.01"
 
 #define FLT_INCLUDE (1 << 0)
 #define FLT_EXCLUDE (1 << 1)
@@ -87,6 +96,10 @@
 #define LRR_BAF 0
 #define BAF_PHASE 1
 
+#define VITERBI_MAX_PTR (1 << 22)
+#define VITERBI_MARGIN 1000
+#define VITERBI_CHECK 128 // steps between the checkpoints where the windows are compared
+
 #define GENDER_UNKNOWN 0
 #define GENDER_MALE 1
 #define GENDER_FEMALE 2
@@ -108,17 +121,48 @@
 #define GT_AB 2
 #define GT_BB 3
 
+#define BENCH_INGEST 0
+#define BENCH_STATS 1
+#define BENCH_EMISSION 2
+#define BENCH_VITERBI 3
+#define BENCH_LOD 4
+#define BENCH_CALLS 5
+#define BENCH_OUTPUT 6
+#define BENCH_N 7
+
 /****************************************
  * DATA STRUCTURES                      *
  ****************************************/
 
+// region classes of a site, computed once from the genome rules when the contig is read
+#define REGION_SHORT_ARM 1 // before the centromere of an acrocentric chromosome
+#define REGION_CEN 2       // within the centromere
+#define REGION_NONPAR 4    // within the nonPAR region of chromosome X or Y
+#define REGION_XTR 8       // within the X-transposed region of chromosome X or Y
+#define REGION_NO_BAF 16   // on chromosome Y or MT, where BAF is not used
+
 typedef struct {
     int pos;
     int allele_a;
     int allele_b;
-    float adjust[3][3]; // shift
+    int region; // REGION_* flags of the site
 } locus_t;
 
+// cohort-wide adjustments of each contig exported by a previous run with --export-adjust
+typedef struct {
+    int n;
+    int *pos;
+    int m_pos;
+    float *coeffs; // 3x3 shifts of each site
+    int m_coeffs;
+} adjust_contig_t;
+
+typedef struct {
+    int n_ctg;
+    adjust_contig_t *a;
+    float lrr_cutoff;
+} adjust_table_t;
+
 typedef struct {
     float xy_log_prb;
     float err_log_prb;
@@ -136,18 +180,27 @@ typedef struct {
     int adj_baf_lrr;
     int regress_baf_lrr;
     int lrr_gc_order;
+    int viterbi_windows;
     int flags;
     genome_rules_t *genome_rules;
     regidx_t *cnp_idx;
-    regitr_t *cnp_itr;
 
     int rid;
     int n;
+    int n_locus; // number of records in the contig, including those skipped
     locus_t *locus_arr;
     int m_locus;
+    float *adjust_arr; // 3x3 shifts of each locus, only for array data
+    int m_adjust;
     float *gc_arr;
     int m_gc;
     int n_flipped;
+    int block_beg, block_end; // samples whose sites are read
+    int64_t n_bytes;          // size of the records decoded for the contig
+    adjust_table_t *adjust_table; // adjustments used instead of those computed from the samples
+    adjust_table_t *prev_adjust_table; // adjustments of a previous run the shifts of the samples are compared with
+    htsFile *adjust_fh;           // sites-only file the adjustments are exported to
+    bcf_hdr_t *adjust_hdr;
 } model_t;
 
 typedef struct {
@@ -205,6 +258,8 @@ typedef struct {
     float x_nonpar_lrr_median;
     float y_nonpar_lrr_median;
     float mt_lrr_median;
+    float adjust_change; // largest change of the shifts applied to the sample from those of a previous run
+    int keep_calls;      // whether the calls of a previous run are kept rather than made again
     stats_t stats;
     stats_t *stats_arr;
     int m_stats, n_stats;
@@ -216,8 +271,64 @@ typedef struct {
     int m_data[2];
     int8_t *phase_arr;
     int m_phase;
+    const char *packed; // sites still encoded as in the contig cache, decoded by the worker processing the sample
 } sample_t;
 
+// scratch memory handed out by bumping an offset and released in stack order, requests that do not fit are served by
+// malloc until the buffer is grown to the peak usage at the next reset
+typedef struct {
+    char *buf;
+    size_t size; // size of the buffer
+    size_t used; // bytes handed out, including those served by malloc
+    size_t peak;
+    void **extra; // blocks served by malloc
+    size_t *extra_off;
+    int n_extra, m_extra, m_extra_off;
+    int64_t n_alloc, n_malloc; // requests handed out and those served by malloc
+} arena_t;
+
+// wall and CPU time spent in each stage and the work done, for the whole run or for a contig
+typedef struct {
+    double wall[BENCH_N];
+    double cpu[BENCH_N];
+    int64_t n_sites;         // sites read for the calls
+    int64_t n_site_samples;  // sites read for the calls summed across samples
+    int64_t n_brent_eval;    // evaluations of the objective functions minimized by kmin_brent
+    int64_t n_viterbi_sites; // sites processed by the Viterbi algorithm
+    int64_t n_bytes;         // size of the records decoded
+} stage_times_t;
+
+typedef struct _pool_t pool_t;
+typedef struct _viterbi_team_t viterbi_team_t;
+
+// the records of the contig with beg <= pos < end for a CNP region, resolved once per contig
+typedef struct {
+    int rec_beg, rec_end;
+    int type;
+} cnp_region_t;
+
+// scratch state owned by a single worker thread
+typedef struct {
+    pool_t *pool;
+    beta_binom_t *beta_binom_null;
+    beta_binom_t *beta_binom_alt;
+    float *logf_arr;
+    int n_logf, m_logf;
+    const cnp_region_t *cnp_arr; // CNP regions of the contig being processed, shared by the workers
+    int n_cnp;
+    viterbi_team_t *viterbi_team; // threads running the windows of the Viterbi forward pass, if split
+    arena_t arena;                // reset between samples
+    float *hs_arr;
+    int m_hs;
+    int *median_hist; // MEDIAN_HIST_SIZE zeroed counts for get_median_int16_buf()
+    int *beg, m_beg, *end, m_end;
+    mocha_table_t mocha_table; // calls from the samples processed by this worker
+    stage_times_t times; // time spent by this worker since the last pool_run()
+    sample_t sites;      // arrays lent to the sample being processed when its sites are encoded
+    uint8_t *bitmap;
+    int m_bitmap;
+} worker_t;
+
 /****************************************
  * INLINE FUNCTIONS AND CONSTANTS       *
  ****************************************/
@@ -226,6 +337,75 @@ typedef struct {
 // void ks_introsort_int(size_t n, int a[]);
 KSORT_INIT_GENERIC(int)
 
+static void *arena_alloc(arena_t *self, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    void *ptr;
+    if (self->used + size <= self->size) {
+        ptr = self->buf + self->used;
+    } else {
+        self->n_extra++;
+        hts_expand(void *, self->n_extra, self->m_extra, self->extra);
+        hts_expand(size_t, self->n_extra, self->m_extra_off, self->extra_off);
+        ptr = malloc(size);
+        self->extra[self->n_extra - 1] = ptr;
+        self->extra_off[self->n_extra - 1] = self->used;
+        self->n_malloc++;
+    }
+    self->n_alloc++;
+    self->used += size;
+    if (self->peak < self->used) self->peak = self->used;
+    return ptr;
+}
+
+static inline void *arena_calloc(arena_t *self, size_t size) { return memset(arena_alloc(self, size), 0, size); }
+
+// releases everything handed out after the mark was taken
+static inline size_t arena_mark(const arena_t *self) { return self->used; }
+
+static void arena_release(arena_t *self, size_t mark) {
+    while (self->n_extra > 0 && self->extra_off[self->n_extra - 1] >= mark) free(self->extra[--self->n_extra]);
+    self->used = mark;
+}
+
+static void arena_reset(arena_t *self) {
+    arena_release(self, 0);
+    if (self->peak > self->size) {
+        free(self->buf);
+        self->size = self->peak;
+        self->buf = (char *)malloc(self->size);
+    }
+}
+
+static void arena_destroy(arena_t *self) {
+    arena_release(self, 0);
+    free(self->buf);
+    free(self->extra);
+    free(self->extra_off);
+}
+
+// whether --stage-times or --benchmark collect the stage times, set before the workers start, as reading the clocks
+// and updating the per-thread counters around every HMM call and every objective evaluation is otherwise wasted
+static int stage_times_on;
+
+// wall clock time in seconds, 0 when the stage times are not collected
+static inline double bench_clock(void) {
+    if (!stage_times_on) return 0.0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// CPU time of the calling thread, or of the whole process, in seconds, 0 when the stage times are not collected
+static inline double bench_cpu_clock(int process) {
+    if (!stage_times_on) return 0.0;
+    struct timespec ts;
+    clock_gettime(process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// work done by the calling thread, the workers add it to their stage times after each sample
+static __thread int64_t thread_n_brent_eval, thread_n_viterbi_sites;
+
 static inline float sqf(float x) { return x * x; }
 static inline double sq(double x) { return x * x; }
 // the x == y is necessary in case x == -INFINITY
@@ -233,7 +413,6 @@ static inline float log_mean_expf(float x, float y) {
     return x == y ? x : (x > y ? x + logf(1.0f + expf(y - x)) : y + logf(1.0f + expf(x - y))) - (float)M_LN2;
 }
 
-static beta_binom_t *beta_binom_null, *beta_binom_alt;
 static inline float beta_binom_log_lkl(const beta_binom_t *self, int16_t ad0, int16_t ad1) {
     return ad0 == bcf_int16_missing || ad1 == bcf_int16_missing ? 0.0f : beta_binom_log_unsafe(self, ad0, ad1);
 }
@@ -250,6 +429,45 @@ static inline int16_t float_to_int16(float in) {
 
 static inline float int16_to_float(int16_t in) { return in == bcf_int16_missing ? NAN : ((float)in) / INT16_SCALE; }
 
+#define MEDIAN_HIST_SIZE 65536 // number of distinct int16_t values
+
+// compute the median of int16_t values as get_median_buf() would for their float conversions, by counting the values
+// in a histogram of MEDIAN_HIST_SIZE zeroed counts, which are zeroed again before returning, when the range of the
+// values is small compared to their number, and falling back to selection on a buffer of at least n floats otherwise
+static float get_median_int16_buf(const int16_t *v, int n, const int *imap, int *hist, float *w) {
+    int j = 0, min = INT16_MAX, max = INT16_MIN;
+    for (int i = 0; i < n; i++) {
+        int16_t tmp = imap ? v[imap[i]] : v[i];
+        if (tmp == bcf_int16_missing) continue;
+        if (tmp < min) min = tmp;
+        if (tmp > max) max = tmp;
+        j++;
+    }
+    if (j == 0) return NAN;
+    if (max - min >= j) {
+        for (int i = 0; i < n; i++) w[i] = int16_to_float(imap ? v[imap[i]] : v[i]);
+        return get_median_buf(w, n, NULL, w);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int16_t tmp = imap ? v[imap[i]] : v[i];
+        if (tmp != bcf_int16_missing) hist[tmp - min]++;
+    }
+    int lower = min, upper = min, k = 0;
+    for (int x = min; x <= max; x++) {
+        int c = hist[x - min];
+        if (k <= (j - 1) / 2 && (j - 1) / 2 < k + c) lower = x;
+        if (k <= j / 2 && j / 2 < k + c) {
+            upper = x;
+            break;
+        }
+        k += c;
+    }
+    memset(hist, 0, (size_t)(max - min + 1) * sizeof(int));
+    if (j % 2) return int16_to_float((int16_t)upper);
+    return (int16_to_float((int16_t)upper) + int16_to_float((int16_t)lower)) * 0.5f;
+}
+
 /******************************************
  * LRR AND COVERAGE POLYNOMIAL REGRESSION *
  ******************************************/
@@ -339,15 +557,8 @@ static int polyfit(const float *lrr, const float *gc, int n, const int *imap, in
     return 0;
 }
 
-static void ad_to_lrr_baf(const int16_t *ad0, const int16_t *ad1, float *lrr, float *baf, int n) {
-    // this function keeps a list of logarithms of integers to minimize log calls
-    static float *logf_arr = NULL;
-    static int n_logf = 0, m_logf = 0;
-    if (ad0 == NULL && ad1 == NULL && n == 0) {
-        free(logf_arr);
-        return;
-    }
-
+// the worker keeps a list of logarithms of integers to minimize log calls
+static void ad_to_lrr_baf(const int16_t *ad0, const int16_t *ad1, float *lrr, float *baf, int n, worker_t *worker) {
     for (int i = 0; i < n; i++) {
         if (ad0[i] == bcf_int16_missing && ad1[i] == bcf_int16_missing) {
             lrr[i] = NAN;
@@ -359,12 +570,12 @@ static void ad_to_lrr_baf(const int16_t *ad0, const int16_t *ad1, float *lrr, fl
             lrr[i] = 0;
             baf[i] = NAN;
         } else {
-            if (cov > n_logf) {
-                hts_expand(float, cov, m_logf, logf_arr);
-                for (int j = n_logf; j < cov; j++) logf_arr[j] = logf(j + 1);
-                n_logf = cov;
+            if (cov > worker->n_logf) {
+                hts_expand(float, cov, worker->m_logf, worker->logf_arr);
+                for (int j = worker->n_logf; j < cov; j++) worker->logf_arr[j] = logf(j + 1);
+                worker->n_logf = cov;
             }
-            lrr[i] = logf_arr[cov - 1];
+            lrr[i] = worker->logf_arr[cov - 1];
             baf[i] = (ad0[i] == bcf_int16_missing || ad1[i] == bcf_int16_missing) ? NAN : (float)ad1[i] / (float)cov;
         }
     }
@@ -406,22 +617,6 @@ static float get_tss(const float *v, int n) {
  * HMM AND OPTIMIZATION METHODS  *
  *********************************/
 
-// compute Viterbi path from probabilities
-static int8_t *retrace_viterbi(int T, int N, const float *log_prb, const int8_t *ptr) {
-    int i, t;
-    int8_t *path = (int8_t *)malloc(T * sizeof(int8_t));
-
-    // initialize last path state
-    path[T - 1] = 0;
-    for (i = 1; i < N; i++)
-        if (log_prb[(int)path[T - 1]] < log_prb[i]) path[T - 1] = (int8_t)i;
-
-    // compute best path by tracing back the Markov chain
-    for (t = T - 1; t > 0; t--) path[t - 1] = ptr[(t - 1) * N + (int)path[t]];
-
-    return path;
-}
-
 // rescale Viterbi log probabilities to avoid underflow issues
 static inline void rescale_log_prb(float *log_prb, int n) {
     float max = -INFINITY;
@@ -432,18 +627,308 @@ static inline void rescale_log_prb(float *log_prb, int n) {
 // compute the Viterbi path from BAF
 // n is the length of the hidden Markov model
 // m is the number of possible BAF deviations
+// the Viterbi step is compiled for AVX2 as well, and the function used is chosen at load time by CPU feature
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define VITERBI_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VITERBI_TARGET_CLONES
+#endif
+
+// computes one step of the Viterbi recursion, the transitions are either from and to the null state, to any
+// non-null state of one phase or between the two phases of a non-null state, so each step is a few passes over the
+// states written without branches, the emissions are added and the result is rescaled in two more passes
+VITERBI_TARGET_CLONES
+static void log_viterbi_step(float *restrict log_prb, float *restrict new_log_prb, int8_t *restrict ptr,
+                             int8_t *restrict null_ptr, const float *restrict emis_log_lkl, int N, int m, int phased,
+                             float exit_log_prb, float enter_log_prb, float change_log_prb, float flip_log_prb) {
+    int i, j;
+
+    // compute whether a state switch should be considered for null state, a state entered from the null state
+    // points to the state the null state was best entered from among the states up to itself
+    float max = log_prb[0];
+    int8_t idx = 0;
+    for (i = 1; i < N; i++) {
+        float x = log_prb[i] + exit_log_prb;
+        if (max < x) {
+            max = x;
+            idx = (int8_t)i;
+        }
+        null_ptr[i] = idx;
+    }
+    new_log_prb[0] = max;
+    ptr[0] = idx;
+    float enter = log_prb[0] + enter_log_prb;
+    for (i = 1; i < N; i++) {
+        int c = log_prb[i] < enter;
+        new_log_prb[i] = c ? enter : log_prb[i];
+        ptr[i] = c ? null_ptr[i] : (int8_t)i;
+    }
+
+    // compute whether a state switch should be considered for each other state
+    // it will run twice if and only if phasing is used
+    for (j = 0; j < (phased ? 2 * m : m); j += m) {
+        float change = enter;
+        int changeidx = 0;
+        for (i = 1 + j; i < 1 + j + m; i++) {
+            float x = log_prb[i] + change_log_prb;
+            if (change < x) {
+                change = x;
+                changeidx = i;
+            }
+        }
+        int8_t change_ptr = ptr[changeidx];
+        for (i = 1 + j; i < 1 + j + m; i++) {
+            int c = new_log_prb[i] < change;
+            new_log_prb[i] = c ? change : new_log_prb[i];
+            ptr[i] = c ? change_ptr : ptr[i];
+        }
+    }
+
+    // compute whether a phase flip should be considered for non-null states
+    if (phased) {
+        for (i = 1; i < 1 + m; i++) {
+            float x = new_log_prb[m + i] + flip_log_prb;
+            int c = new_log_prb[i] < x;
+            new_log_prb[i] = c ? x : new_log_prb[i];
+            ptr[i] = c ? ptr[m + i] : ptr[i];
+            x = new_log_prb[i] + flip_log_prb;
+            c = new_log_prb[m + i] < x;
+            new_log_prb[m + i] = c ? x : new_log_prb[m + i];
+            ptr[m + i] = c ? ptr[i] : ptr[m + i];
+        }
+    }
+
+    // update and rescale the current state
+    max = -INFINITY;
+    for (i = 0; i < N; i++) {
+        new_log_prb[i] += emis_log_lkl[i];
+        max = max > new_log_prb[i] ? max : new_log_prb[i];
+    }
+    for (i = 0; i < N; i++) log_prb[i] = new_log_prb[i] - max;
+}
+
+// runs the Viterbi steps from t_beg to t_end - 1, storing the backpointers of each step in its own row of ptr if rows
+// is set, or always in the first row otherwise
+static void log_viterbi_steps(float *log_prb, float *new_log_prb, int8_t *ptr, int rows, int8_t *null_ptr,
+                              const float *emis_log_lkl, int t_beg, int t_end, int N, int m, float xy_log_prb,
+                              float flip_log_prb, float cen_log_prb, int last_p, int first_q) {
+    for (int t = t_beg; t < t_end; t++) {
+        // this causes a penalty for mosaic chromosomal calls across the centromeres
+        float exit_log_prb = t > last_p ? xy_log_prb + cen_log_prb * 0.5 : xy_log_prb - cen_log_prb * 0.5;
+        float enter_log_prb = t < first_q ? xy_log_prb + cen_log_prb * 0.5 : xy_log_prb - cen_log_prb * 0.5;
+        log_viterbi_step(log_prb, new_log_prb, rows ? ptr + (t - t_beg) * N : ptr, null_ptr, emis_log_lkl + t * N, N,
+                         m, !isnan(flip_log_prb), exit_log_prb, enter_log_prb, xy_log_prb * 1.5f, flip_log_prb);
+    }
+}
+
+// a window of the forward pass, started VITERBI_MARGIN steps before its first step from the emissions alone
+typedef struct {
+    const float *emis_log_lkl;
+    int warm; // whether the window starts before its first step
+    int t_beg, t_end;
+    int N, m;
+    float xy_log_prb, flip_log_prb, cen_log_prb;
+    int last_p, first_q;
+    float *log_prb, *new_log_prb;
+    float *warm_log_prb;  // probabilities reached before the first step
+    float *check_log_prb; // probabilities every VITERBI_CHECK steps, if the window starts before its first step
+    float *fix_log_prb;
+    int8_t *ptr, *null_ptr, *warm_ptr;
+} viterbi_window_t;
+
+static void *viterbi_window_run(void *arg) {
+    viterbi_window_t *self = (viterbi_window_t *)arg;
+    int N = self->N;
+    if (self->warm) {
+        int t_warm = self->t_beg > VITERBI_MARGIN ? self->t_beg - VITERBI_MARGIN : 1;
+        memcpy(self->log_prb, self->emis_log_lkl + (t_warm - 1) * N, N * sizeof(float));
+        rescale_log_prb(self->log_prb, N);
+        log_viterbi_steps(self->log_prb, self->new_log_prb, self->warm_ptr, 0, self->null_ptr, self->emis_log_lkl,
+                          t_warm, self->t_beg, N, self->m, self->xy_log_prb, self->flip_log_prb, self->cen_log_prb,
+                          self->last_p, self->first_q);
+        memcpy(self->warm_log_prb, self->log_prb, N * sizeof(float));
+    }
+    for (int t = self->t_beg, k = 0; t < self->t_end; t += VITERBI_CHECK, k++) {
+        int t_end = t + VITERBI_CHECK < self->t_end ? t + VITERBI_CHECK : self->t_end;
+        log_viterbi_steps(self->log_prb, self->new_log_prb, self->ptr + (t - self->t_beg) * N, 1, self->null_ptr,
+                          self->emis_log_lkl, t, t_end, N, self->m, self->xy_log_prb, self->flip_log_prb,
+                          self->cen_log_prb, self->last_p, self->first_q);
+        if (self->warm) memcpy(self->check_log_prb + k * N, self->log_prb, N * sizeof(float));
+    }
+    return NULL;
+}
+
+// the probabilities are rescaled at each step, so two runs of the same steps usually end up with the same rescaled
+// probabilities, and only when these are equal bit for bit are all the following backpointers the same
+static inline int log_prb_converged(const float *log_prb, const float *ref_log_prb, int n) {
+    return memcmp(log_prb, ref_log_prb, n * sizeof(float)) == 0;
+}
+
+// runs a window started from the emissions again from the probabilities where the previous window ended, only until
+// they converge to those of the first run at a checkpoint, as from there on the first run has the same backpointers
+static void viterbi_window_fix(viterbi_window_t *self, const float *log_prb) {
+    int N = self->N;
+    if (log_prb_converged(self->warm_log_prb, log_prb, N)) return;
+    memcpy(self->fix_log_prb, log_prb, N * sizeof(float));
+    for (int t = self->t_beg, k = 0; t < self->t_end; t += VITERBI_CHECK, k++) {
+        int t_end = t + VITERBI_CHECK < self->t_end ? t + VITERBI_CHECK : self->t_end;
+        log_viterbi_steps(self->fix_log_prb, self->new_log_prb, self->ptr + (t - self->t_beg) * N, 1, self->null_ptr,
+                          self->emis_log_lkl, t, t_end, N, self->m, self->xy_log_prb, self->flip_log_prb,
+                          self->cen_log_prb, self->last_p, self->first_q);
+        if (log_prb_converged(self->fix_log_prb, self->check_log_prb + k * N, N)) return;
+    }
+    memcpy(self->log_prb, self->fix_log_prb, N * sizeof(float));
+}
+
+// helper threads kept by a worker for the whole run to take windows of the forward pass, so that no thread is created
+// for each call, the windows handed out are claimed one at a time by the helpers and by the calling thread
+struct _viterbi_team_t {
+    int n; // number of helper threads
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    viterbi_window_t *windows; // windows of the forward pass being run
+    int n_windows;
+    int next;   // index of the next window to be claimed
+    int round;  // incremented each time windows are handed out
+    int n_busy; // helpers that have not finished the current round
+    int quit;
+};
+
+static void viterbi_team_claim(viterbi_team_t *self) {
+    int w;
+    while ((w = __sync_fetch_and_add(&self->next, 1)) < self->n_windows) viterbi_window_run(&self->windows[w]);
+}
+
+static void *viterbi_team_helper(void *arg) {
+    viterbi_team_t *self = (viterbi_team_t *)arg;
+    int round = 0;
+    pthread_mutex_lock(&self->lock);
+    while (1) {
+        while (!self->quit && self->round == round) pthread_cond_wait(&self->start, &self->lock);
+        if (self->quit) break;
+        round = self->round;
+        pthread_mutex_unlock(&self->lock);
+        viterbi_team_claim(self);
+        pthread_mutex_lock(&self->lock);
+        if (--self->n_busy == 0) pthread_cond_signal(&self->done);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+static viterbi_team_t *viterbi_team_init(int n) {
+    viterbi_team_t *self = (viterbi_team_t *)calloc(1, sizeof(viterbi_team_t));
+    self->n = n;
+    self->threads = (pthread_t *)calloc(n, sizeof(pthread_t));
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->start, NULL);
+    pthread_cond_init(&self->done, NULL);
+    for (int i = 0; i < n; i++)
+        if (pthread_create(&self->threads[i], NULL, viterbi_team_helper, self))
+            error("Error: failed to create the Viterbi threads\n");
+    return self;
+}
+
+static void viterbi_team_destroy(viterbi_team_t *self) {
+    pthread_mutex_lock(&self->lock);
+    self->quit = 1;
+    pthread_cond_broadcast(&self->start);
+    pthread_mutex_unlock(&self->lock);
+    for (int i = 0; i < self->n; i++) pthread_join(self->threads[i], NULL);
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->start);
+    pthread_cond_destroy(&self->done);
+    free(self->threads);
+    free(self);
+}
+
+// runs the windows with the helpers and returns once all of them are done
+static void viterbi_team_run(viterbi_team_t *self, viterbi_window_t *windows, int n_windows) {
+    pthread_mutex_lock(&self->lock);
+    self->windows = windows;
+    self->n_windows = n_windows;
+    self->next = 0;
+    self->n_busy = self->n;
+    self->round++;
+    pthread_cond_broadcast(&self->start);
+    pthread_mutex_unlock(&self->lock);
+    viterbi_team_claim(self);
+    pthread_mutex_lock(&self->lock);
+    while (self->n_busy > 0) pthread_cond_wait(&self->done, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+}
+
+// runs the forward pass split in windows, taken by the threads of the team, the probabilities of a window started
+// from the emissions usually converge to those of the previous window within the margin, and when they do not the
+// window is run again from where the previous window ended until it converges to its first run, so the backpointers
+// are the same as those of a single pass
+static void log_viterbi_windows(float *log_prb, int8_t *ptr, const float *emis_log_lkl, int T, int N, int m,
+                                float xy_log_prb, float flip_log_prb, float cen_log_prb, int last_p, int first_q,
+                                int n_windows, viterbi_team_t *team, arena_t *arena) {
+    size_t mark = arena_mark(arena);
+    viterbi_window_t *windows = (viterbi_window_t *)arena_alloc(arena, n_windows * sizeof(viterbi_window_t));
+    for (int w = 0; w < n_windows; w++) {
+        viterbi_window_t *window = &windows[w];
+        window->emis_log_lkl = emis_log_lkl;
+        window->warm = w > 0;
+        window->t_beg = 1 + (int)((int64_t)w * (T - 1) / n_windows);
+        window->t_end = 1 + (int)((int64_t)(w + 1) * (T - 1) / n_windows);
+        window->N = N;
+        window->m = m;
+        window->xy_log_prb = xy_log_prb;
+        window->flip_log_prb = flip_log_prb;
+        window->cen_log_prb = cen_log_prb;
+        window->last_p = last_p;
+        window->first_q = first_q;
+        window->log_prb = (float *)arena_alloc(arena, 4 * N * sizeof(float));
+        window->new_log_prb = window->log_prb + N;
+        window->warm_log_prb = window->log_prb + 2 * N;
+        window->fix_log_prb = window->log_prb + 3 * N;
+        int n_check = (window->t_end - window->t_beg + VITERBI_CHECK - 1) / VITERBI_CHECK;
+        window->check_log_prb = w > 0 ? (float *)arena_alloc(arena, n_check * N * sizeof(float)) : NULL;
+        window->ptr = ptr + (window->t_beg - 1) * N;
+        window->null_ptr = (int8_t *)arena_alloc(arena, 2 * N * sizeof(int8_t));
+        window->warm_ptr = window->null_ptr + N;
+    }
+    memcpy(windows[0].log_prb, log_prb, N * sizeof(float));
+
+    viterbi_team_run(team, windows, n_windows);
+
+    for (int w = 1; w < n_windows; w++) viterbi_window_fix(&windows[w], windows[w - 1].log_prb);
+    memcpy(log_prb, windows[n_windows - 1].log_prb, N * sizeof(float));
+    arena_release(arena, mark);
+}
+
+// when the backpointers would take more than VITERBI_MAX_PTR bytes, only the probabilities every sqrt(T) steps are
+// kept in the forward pass and the backpointers of each block of steps are computed again during the traceback,
+// unless the forward pass is split in windows
 static int8_t *log_viterbi_run(const float *emis_log_lkl, int T, int m, float xy_log_prb, float flip_log_prb,
-                               float tel_log_prb, float cen_log_prb, int last_p, int first_q) {
-    int t, i, j, changeidx;
+                               float tel_log_prb, float cen_log_prb, int last_p, int first_q,
+                               viterbi_team_t *team, arena_t *arena) {
+    int t, i, b;
+    if (stage_times_on) thread_n_viterbi_sites += T;
 
     // determine the number of hidden states based on whether phase information is used
     int N = 1 + m + (isnan(flip_log_prb) ? 0 : m);
 
-    // allocate memory necessary for running the algorithm
-    float *log_prb = (float *)malloc(N * sizeof(float));
-    float *new_log_prb = (float *)malloc(N * sizeof(float));
-    int8_t *ptr = (int8_t *)malloc(N * (T - 1) * sizeof(int8_t));
-    int8_t *path;
+    // windows spend about two margins to converge to the previous window, so shorter windows would gain little
+    int n_windows = team ? team->n + 1 : 1;
+    if (n_windows > (T - 1) / (8 * VITERBI_MARGIN)) n_windows = (T - 1) / (8 * VITERBI_MARGIN);
+
+    // determine the number of steps in each block of backpointers
+    int K = T > 1 ? T - 1 : 1;
+    if (n_windows <= 1 && (size_t)N * (size_t)(T - 1) > VITERBI_MAX_PTR) K = (int)ceil(sqrt((double)(T - 1)));
+    int n_blocks = (T - 1 + K - 1) / K;
+
+    // allocate memory necessary for running the algorithm, the path is left in the arena for the caller
+    int8_t *path = (int8_t *)arena_alloc(arena, T * sizeof(int8_t));
+    size_t mark = arena_mark(arena);
+    float *log_prb = (float *)arena_alloc(arena, N * sizeof(float));
+    float *new_log_prb = (float *)arena_alloc(arena, N * sizeof(float));
+    float *checkpoints = n_blocks > 1 ? (float *)arena_alloc(arena, n_blocks * N * sizeof(float)) : NULL;
+    int8_t *null_ptr = (int8_t *)arena_alloc(arena, N * sizeof(int8_t));
+    int8_t *ptr = (int8_t *)arena_alloc(arena, N * K * sizeof(int8_t));
 
     // initialize and rescale the first state
     log_prb[0] = emis_log_lkl[0];
@@ -452,81 +937,44 @@ static int8_t *log_viterbi_run(const float *emis_log_lkl, int T, int m, float xy
     rescale_log_prb(log_prb, N);
 
     // compute best probabilities at each position
-    for (t = 1; t < T; t++) {
-        // this causes a penalty for mosaic chromosomal calls across the centromeres
-        float exit_log_prb = t > last_p ? xy_log_prb + cen_log_prb * 0.5 : xy_log_prb - cen_log_prb * 0.5;
-        float enter_log_prb = t < first_q ? xy_log_prb + cen_log_prb * 0.5 : xy_log_prb - cen_log_prb * 0.5;
-
-        for (i = 0; i < N; i++) {
-            new_log_prb[i] = log_prb[i];
-            ptr[(t - 1) * N + i] = (int8_t)i;
-        }
-
-        // compute whether a state switch should be considered for null state
-        for (i = 1; i < N; i++) {
-            if (new_log_prb[0] < log_prb[i] + exit_log_prb) {
-                new_log_prb[0] = log_prb[i] + exit_log_prb;
-                ptr[(t - 1) * N] = ptr[(t - 1) * N + i];
-            }
-            if (new_log_prb[i] < log_prb[0] + enter_log_prb) {
-                new_log_prb[i] = log_prb[0] + enter_log_prb;
-                ptr[(t - 1) * N + i] = ptr[(t - 1) * N];
-            }
-        }
-
-        // compute whether a state switch should be considered for each other state
-        // it will run twice if and only if phasing is used
-        for (j = 0; j == 0 || (!isnan(flip_log_prb) && j == m); j += m) {
-            float change_log_prb = log_prb[0] + enter_log_prb;
-            changeidx = 0;
-            for (i = 0; i < m; i++) {
-                if (change_log_prb < log_prb[1 + j + i] + xy_log_prb * 1.5f) {
-                    change_log_prb = log_prb[1 + j + i] + xy_log_prb * 1.5f;
-                    changeidx = 1 + j + i;
-                }
-            }
-            for (i = 0; i < m; i++) {
-                if (new_log_prb[1 + j + i] < change_log_prb) {
-                    new_log_prb[1 + j + i] = change_log_prb;
-                    ptr[(t - 1) * N + 1 + j + i] = ptr[(t - 1) * N + changeidx];
-                }
-            }
-        }
-
-        // compute whether a phase flip should be considered for non-null states
-        if (!isnan(flip_log_prb)) {
-            for (i = 0; i < m; i++) {
-                if (new_log_prb[1 + i] < new_log_prb[1 + m + i] + flip_log_prb) {
-                    new_log_prb[1 + i] = new_log_prb[1 + m + i] + flip_log_prb;
-                    ptr[(t - 1) * N + 1 + i] = ptr[(t - 1) * N + 1 + m + i];
-                }
-                if (new_log_prb[1 + m + i] < new_log_prb[1 + i] + flip_log_prb) {
-                    new_log_prb[1 + m + i] = new_log_prb[1 + i] + flip_log_prb;
-                    ptr[(t - 1) * N + 1 + m + i] = ptr[(t - 1) * N + 1 + i];
-                }
-            }
-        }
-
-        // update and rescale the current state
-        new_log_prb[0] += emis_log_lkl[t * N];
-        for (i = 0; i < m; i++) {
-            new_log_prb[1 + i] += emis_log_lkl[t * N + 1 + i];
-            if (!isnan(flip_log_prb)) new_log_prb[1 + m + i] += emis_log_lkl[t * N + 1 + m + i];
+    if (checkpoints) {
+        for (b = 0; b < n_blocks; b++) {
+            memcpy(checkpoints + b * N, log_prb, N * sizeof(float));
+            log_viterbi_steps(log_prb, new_log_prb, ptr, 0, null_ptr, emis_log_lkl, 1 + b * K,
+                              1 + b * K + K < T ? 1 + b * K + K : T, N, m, xy_log_prb, flip_log_prb, cen_log_prb,
+                              last_p, first_q);
         }
-        for (i = 0; i < N; i++) log_prb[i] = new_log_prb[i];
-        rescale_log_prb(log_prb, N);
+    } else if (n_windows > 1) {
+        log_viterbi_windows(log_prb, ptr, emis_log_lkl, T, N, m, xy_log_prb, flip_log_prb, cen_log_prb, last_p,
+                            first_q, n_windows, team, arena);
+    } else {
+        log_viterbi_steps(log_prb, new_log_prb, ptr, 1, null_ptr, emis_log_lkl, 1, T, N, m, xy_log_prb, flip_log_prb,
+                          cen_log_prb, last_p, first_q);
     }
 
     // add closing cost to the last state
     for (i = 1; i < N; i++) log_prb[i] += xy_log_prb - (first_q == T ? cen_log_prb * 0.5 : tel_log_prb);
     rescale_log_prb(log_prb, N);
 
-    path = retrace_viterbi(T, N, log_prb, ptr);
+    // initialize last path state
+    path[T - 1] = 0;
+    for (i = 1; i < N; i++)
+        if (log_prb[(int)path[T - 1]] < log_prb[i]) path[T - 1] = (int8_t)i;
+
+    // compute best path by tracing back the Markov chain one block at a time
+    for (b = n_blocks - 1; b >= 0; b--) {
+        int t_beg = 1 + b * K;
+        int t_end = t_beg + K < T ? t_beg + K : T;
+        if (checkpoints) {
+            memcpy(log_prb, checkpoints + b * N, N * sizeof(float));
+            log_viterbi_steps(log_prb, new_log_prb, ptr, 1, null_ptr, emis_log_lkl, t_beg, t_end, N, m, xy_log_prb,
+                              flip_log_prb, cen_log_prb, last_p, first_q);
+        }
+        for (t = t_end - 1; t >= t_beg; t--) path[t - 1] = ptr[(t - t_beg) * N + (int)path[t]];
+    }
 
     // free memory
-    free(log_prb);
-    free(new_log_prb);
-    free(ptr);
+    arena_release(arena, mark);
 
     // symmetrize the path
     if (!isnan(flip_log_prb))
@@ -536,6 +984,109 @@ static int8_t *log_viterbi_run(const float *emis_log_lkl, int T, int m, float xy
     return path;
 }
 
+/*********************************
+ * SEGMENT LIKELIHOODS           *
+ *********************************/
+
+// a segment passed to the objective functions minimized by kmin_brent, the BAF values or the allelic depths of the
+// segment are collected with their multiplicities so that each evaluation loops over the distinct values only
+typedef struct {
+    const float *lrr;
+    const float *baf;
+    const int16_t *ad0;
+    const int16_t *ad1;
+    const int8_t *gt_phase;   // NULL if the phase is not used
+    const int8_t *bdev_phase; // notice bdev_phase has no imap
+    const int *imap;
+    int n;
+    int n_hist;     // number of distinct values, or -1 if the BAF values are not quantized
+    int n1, n2;     // maximum allelic depth and maximum sum of allelic depths
+    int16_t *hist0; // quantized BAF values or AD0 values
+    int16_t *hist1; // AD1 values
+    int8_t *hist_phase;
+    int *hist_cnt;
+    float err_log_prb;
+    float lrr_bias;
+    float lrr_hap2dip;
+    float lrr_sd;
+    float baf_sd; // either sd(BAF) or rho(AD0, AD1) for WGS model
+    beta_binom_t *beta_binom_null;
+    beta_binom_t *beta_binom_alt;
+} segment_t;
+
+// this macro from ksort.h defines the function
+// void ks_introsort_uint64_t(size_t n, uint64_t a[]);
+KSORT_INIT_GENERIC(uint64_t)
+
+static void segment_init(segment_t *self, const float *lrr, const float *baf, const int16_t *ad0, const int16_t *ad1,
+                         const int8_t *gt_phase, const int8_t *bdev_phase, int n, const int *imap) {
+    memset(self, 0, sizeof(segment_t));
+    self->lrr = lrr;
+    self->baf = baf;
+    self->ad0 = ad0;
+    self->ad1 = ad1;
+    self->gt_phase = gt_phase;
+    self->bdev_phase = bdev_phase;
+    self->n = n;
+    self->imap = imap;
+    self->n_hist = -1;
+}
+
+// collects the distinct (BAF, phase) or (AD0, AD1, phase) values of the segment, sites with missing values are skipped
+// as they do not contribute to the likelihoods
+static void segment_hist(segment_t *self, arena_t *arena) {
+    uint64_t *keys = (uint64_t *)arena_alloc(arena, self->n * sizeof(uint64_t));
+    int n_keys = 0;
+    for (int i = 0; i < self->n; i++) {
+        int j = self->imap ? self->imap[i] : i;
+        int16_t a, b = 0;
+        if (self->ad0) {
+            a = self->ad0[j];
+            b = self->ad1[j];
+            if (a == bcf_int16_missing || b == bcf_int16_missing) continue;
+        } else {
+            float baf = self->baf[j];
+            if (isnan(baf)) continue;
+            float k = roundf(baf * INT16_SCALE);
+            if (!(k > INT16_MIN && k <= INT16_MAX) || ((float)(int16_t)k) / INT16_SCALE != baf) return;
+            a = (int16_t)k;
+        }
+        int8_t p = 0;
+        if (self->gt_phase) {
+            p = self->gt_phase[j];
+            if (self->bdev_phase) p *= (int8_t)SIGN(self->bdev_phase[i]);
+        }
+        keys[n_keys++] = (uint64_t)(uint16_t)a << 32 | (uint64_t)(uint16_t)b << 16 | (uint64_t)(SIGN(p) + 1);
+    }
+    ks_introsort_uint64_t((size_t)n_keys, keys);
+
+    self->hist0 = (int16_t *)arena_alloc(arena, n_keys * sizeof(int16_t));
+    self->hist1 = (int16_t *)arena_alloc(arena, n_keys * sizeof(int16_t));
+    self->hist_phase = (int8_t *)arena_alloc(arena, n_keys * sizeof(int8_t));
+    self->hist_cnt = (int *)arena_alloc(arena, n_keys * sizeof(int));
+    self->n_hist = 0;
+    self->n1 = 0;
+    self->n2 = 0;
+    for (int k = 0; k < n_keys; k++) {
+        if (k > 0 && keys[k] == keys[k - 1]) {
+            self->hist_cnt[self->n_hist - 1]++;
+            continue;
+        }
+        int16_t a = (int16_t)(uint16_t)(keys[k] >> 32);
+        int16_t b = (int16_t)(uint16_t)(keys[k] >> 16);
+        self->hist0[self->n_hist] = a;
+        self->hist1[self->n_hist] = b;
+        self->hist_phase[self->n_hist] = (int8_t)(keys[k] & 0xFFFF) - 1;
+        self->hist_cnt[self->n_hist] = 1;
+        self->n_hist++;
+        if (self->ad0) {
+            if (a > self->n1) self->n1 = a;
+            if (b > self->n1) self->n1 = b;
+            if (a + b > self->n2) self->n2 = a + b;
+        }
+    }
+}
+
 /*********************************
  * LRR AND BAF LIKELIHOODS       *
  *********************************/
@@ -555,11 +1106,14 @@ static inline float norm_log_lkl(float x, float m, float s, float w) {
     return isnan(x) ? 0.0f : -0.5f * sqf((x - m) / s) * w;
 }
 
+static inline float baf_log_lkl(float baf, float bdev, float baf_sd) {
+    return log_mean_expf(norm_log_lkl(baf - 0.5f, bdev, baf_sd, 1.0f), norm_log_lkl(baf - 0.5f, -bdev, baf_sd, 1.0f));
+}
+
 // lrr_bias is used in a different way from what done by Petr Danecek in bcftools/vcfcnv.c
 static inline float lrr_baf_log_lkl(float lrr, float baf, float ldev, float bdev, float lrr_sd, float baf_sd,
                                     float lrr_bias) {
-    return norm_log_lkl(lrr, ldev, lrr_sd, lrr_bias)
-           + log_mean_expf(norm_log_lkl(baf - 0.5f, bdev, baf_sd, 1.0f), norm_log_lkl(baf - 0.5f, -bdev, baf_sd, 1.0f));
+    return norm_log_lkl(lrr, ldev, lrr_sd, lrr_bias) + baf_log_lkl(baf, bdev, baf_sd);
 }
 
 static inline float baf_phase_log_lkl(float baf, int8_t phase, float bdev, float baf_sd) {
@@ -568,53 +1122,129 @@ static inline float baf_phase_log_lkl(float baf, int8_t phase, float bdev, float
                       : norm_log_lkl(baf - 0.5f, (float)SIGN(phase) * bdev, baf_sd, 1.0f);
 }
 
+// BAF values from arrays are stored as int16 so they only take a few distinct values and the BAF component of the
+// emission probabilities can be tabulated once per value rather than computed for every site, returns the number of
+// values to tabulate, with baf_idx set to the row of each site or -1 for missing values, or 0 if the values are not
+// all quantized or if there are more values than sites
+static int baf_table_index(const float *baf, int T, const int *imap, int *baf_idx, int *beg) {
+    int min = INT_MAX, max = INT_MIN;
+    for (int t = 0; t < T; t++) {
+        float y = imap ? baf[imap[t]] : baf[t];
+        if (isnan(y)) {
+            baf_idx[t] = INT_MIN;
+            continue;
+        }
+        float k = roundf(y * INT16_SCALE);
+        if (!(k > INT16_MIN && k <= INT16_MAX) || ((float)(int16_t)k) / INT16_SCALE != y) return 0;
+        baf_idx[t] = (int)k;
+        if (min > baf_idx[t]) min = baf_idx[t];
+        if (max < baf_idx[t]) max = baf_idx[t];
+    }
+    if (min > max || max - min + 1 >= T) return 0;
+    for (int t = 0; t < T; t++) baf_idx[t] = baf_idx[t] == INT_MIN ? -1 : baf_idx[t] - min;
+    *beg = min;
+    return max - min + 1;
+}
+
 // precomupute emission probabilities
 static float *lrr_baf_emis_log_lkl(const float *lrr, const float *baf, int T, const int *imap, float err_log_prb,
                                    float lrr_bias, float lrr_hap2dip, float lrr_sd, float baf_sd,
-                                   const float *bdev_lrr_baf_arr, int m) {
-    float *ldev = (float *)malloc(m * sizeof(float));
-    for (int i = 0; i < m; i++) ldev[i] = -logf(1.0f - 2.0f * bdev_lrr_baf_arr[i]) / (float)M_LN2 * lrr_hap2dip;
+                                   const float *bdev_lrr_baf_arr, int m, arena_t *arena) {
     int N = 1 + 2 * m;
-    float *emis_log_lkl = (float *)malloc(N * T * sizeof(float));
+    float *emis_log_lkl = (float *)arena_alloc(arena, N * T * sizeof(float));
+    size_t mark = arena_mark(arena);
+    float *ldev = (float *)arena_alloc(arena, m * sizeof(float));
+    for (int i = 0; i < m; i++) ldev[i] = -logf(1.0f - 2.0f * bdev_lrr_baf_arr[i]) / (float)M_LN2 * lrr_hap2dip;
+
+    // BAF component for no deviation and for each BAF deviation
+    float *baf_row = (float *)arena_alloc(arena, (1 + m) * sizeof(float));
+    int *baf_idx = (int *)arena_alloc(arena, T * sizeof(int));
+    int baf_beg = 0, n_baf = baf_table_index(baf, T, imap, baf_idx, &baf_beg);
+    float *baf_table = (float *)arena_alloc(arena, n_baf * (1 + m) * sizeof(float));
+    for (int k = 0; k < n_baf; k++) {
+        float y = ((float)(baf_beg + k)) / INT16_SCALE;
+        baf_table[k * (1 + m)] = baf_log_lkl(y, 0.0f, baf_sd);
+        for (int i = 0; i < m; i++) baf_table[k * (1 + m) + 1 + i] = baf_log_lkl(y, bdev_lrr_baf_arr[i], baf_sd);
+    }
+
     for (int t = 0; t < T; t++) {
         float x = imap ? lrr[imap[t]] : lrr[t];
         float y = imap ? baf[imap[t]] : baf[t];
-        emis_log_lkl[t * N] = lrr_baf_log_lkl(x, y, 0.0f, 0.0f, lrr_sd, baf_sd, lrr_bias);
-        for (int i = 0; i < m; i++) {
-            emis_log_lkl[t * N + 1 + i] = lrr_baf_log_lkl(x, y, ldev[i], bdev_lrr_baf_arr[i], lrr_sd, baf_sd, lrr_bias);
+        const float *b;
+        if (n_baf > 0 && baf_idx[t] >= 0) {
+            b = baf_table + baf_idx[t] * (1 + m);
+        } else {
+            baf_row[0] = baf_log_lkl(y, 0.0f, baf_sd);
+            for (int i = 0; i < m; i++) baf_row[1 + i] = baf_log_lkl(y, bdev_lrr_baf_arr[i], baf_sd);
+            b = baf_row;
         }
+        emis_log_lkl[t * N] = norm_log_lkl(x, 0.0f, lrr_sd, lrr_bias) + b[0];
+        for (int i = 0; i < m; i++) emis_log_lkl[t * N + 1 + i] = norm_log_lkl(x, ldev[i], lrr_sd, lrr_bias) + b[1 + i];
         // add states to distinguish LRR waves from true mosaic gains/losses
         for (int i = 0; i < m; i++) {
             if (bdev_lrr_baf_arr[i] < -1.0f / 6.0f || bdev_lrr_baf_arr[i] >= 1.0f / 6.0f)
                 emis_log_lkl[t * N + 1 + m + i] = emis_log_lkl[t * N] + err_log_prb;
             else
-                emis_log_lkl[t * N + 1 + m + i] =
-                    lrr_baf_log_lkl(x, y, bdev_lrr_baf_arr[i], 0.0f, lrr_sd, baf_sd, lrr_bias);
+                emis_log_lkl[t * N + 1 + m + i] = norm_log_lkl(x, bdev_lrr_baf_arr[i], lrr_sd, lrr_bias) + b[0];
         }
         rescale_emis_log_lkl(&emis_log_lkl[t * N], N, err_log_prb);
     }
-    free(ldev);
+    arena_release(arena, mark);
     return emis_log_lkl;
 }
 
 // precomupute emission probabilities
 static float *baf_phase_emis_log_lkl(const float *baf, const int8_t *gt_phase, int T, const int *imap,
-                                     float err_log_prb, float baf_sd, const float *bdev, int m) {
+                                     float err_log_prb, float baf_sd, const float *bdev, int m, arena_t *arena) {
     int N = 1 + 2 * m;
-    float *emis_log_lkl = (float *)malloc(N * T * sizeof(float));
+    float *emis_log_lkl = (float *)arena_alloc(arena, N * T * sizeof(float));
+    size_t mark = arena_mark(arena);
+
+    // BAF component for no deviation and for each BAF deviation when unphased, in phase, and out of phase
+    int W = 1 + 3 * m;
+    float *baf_row = (float *)arena_alloc(arena, W * sizeof(float));
+    int *baf_idx = (int *)arena_alloc(arena, T * sizeof(int));
+    int baf_beg = 0, n_baf = baf_table_index(baf, T, imap, baf_idx, &baf_beg);
+    float *baf_table = (float *)arena_alloc(arena, n_baf * W * sizeof(float));
+    for (int k = 0; k < n_baf; k++) {
+        float y = ((float)(baf_beg + k)) / INT16_SCALE;
+        float *row = baf_table + k * W;
+        row[0] = baf_phase_log_lkl(y, (int8_t)1, 0.0f, baf_sd);
+        for (int i = 0; i < m; i++) {
+            row[1 + i] = baf_phase_log_lkl(y, (int8_t)0, bdev[i], baf_sd);
+            row[1 + m + i] = baf_phase_log_lkl(y, (int8_t)1, bdev[i], baf_sd);
+            row[1 + 2 * m + i] = baf_phase_log_lkl(y, (int8_t)-1, bdev[i], baf_sd);
+        }
+    }
+
     for (int t = 0; t < T; t++) {
         float x = imap ? baf[imap[t]] : baf[t];
         int8_t p = imap ? gt_phase[imap[t]] : gt_phase[t];
-        emis_log_lkl[t * N] = baf_phase_log_lkl(x, (int8_t)1, 0.0f, baf_sd);
+        const float *row;
+        if (n_baf > 0 && baf_idx[t] >= 0) {
+            row = baf_table + baf_idx[t] * W;
+        } else {
+            baf_row[0] = baf_phase_log_lkl(x, (int8_t)1, 0.0f, baf_sd);
+            for (int i = 0; i < m; i++) {
+                baf_row[1 + i] = baf_phase_log_lkl(x, (int8_t)0, bdev[i], baf_sd);
+                baf_row[1 + m + i] = baf_phase_log_lkl(x, (int8_t)1, bdev[i], baf_sd);
+                baf_row[1 + 2 * m + i] = baf_phase_log_lkl(x, (int8_t)-1, bdev[i], baf_sd);
+            }
+            row = baf_row;
+        }
+        emis_log_lkl[t * N] = row[0];
         for (int i = 0; i < m; i++) {
-            emis_log_lkl[t * N + 1 + i] = baf_phase_log_lkl(x, p, bdev[i], baf_sd);
-            if (p == 0)
-                emis_log_lkl[t * N + 1 + m + i] = emis_log_lkl[t * N + 1 + i];
-            else
-                emis_log_lkl[t * N + 1 + m + i] = baf_phase_log_lkl(x, p, -bdev[i], baf_sd);
+            if (p == 0) {
+                emis_log_lkl[t * N + 1 + i] = row[1 + i];
+                emis_log_lkl[t * N + 1 + m + i] = row[1 + i];
+            } else {
+                emis_log_lkl[t * N + 1 + i] = row[p > 0 ? 1 + m + i : 1 + 2 * m + i];
+                emis_log_lkl[t * N + 1 + m + i] = row[p > 0 ? 1 + 2 * m + i : 1 + m + i];
+            }
         }
         rescale_emis_log_lkl(&emis_log_lkl[t * N], N, err_log_prb);
     }
+    arena_release(arena, mark);
     return emis_log_lkl;
 }
 
@@ -713,21 +1343,86 @@ static double baf_phase_lod(const float *baf_arr, const int8_t *gt_phase, int n,
     return (double)ret * M_LOG10E;
 }
 
+// return the LOD likelihood for a segment from its distinct BAF values, summed in double as the products of the counts
+// are large and are not added in the order of the sites
+static double baf_hist_lod(const segment_t *seg, double bdev) {
+    if (seg->n == 0 || bdev < 0.0 || bdev > 0.5) return -INFINITY; // kmin_brent does not handle NAN
+
+    double ret = 0.0;
+    for (int k = 0; k < seg->n_hist; k++) {
+        float baf = int16_to_float(seg->hist0[k]);
+        float log_lkl = baf_phase_log_lkl(baf, seg->hist_phase[k], (float)bdev, seg->baf_sd)
+                        - baf_phase_log_lkl(baf, 0, 0.0f, seg->baf_sd);
+        if (log_lkl < seg->err_log_prb)
+            log_lkl = seg->err_log_prb;
+        else if (log_lkl > -seg->err_log_prb)
+            log_lkl = -seg->err_log_prb;
+        ret += (double)seg->hist_cnt[k] * (double)log_lkl;
+    }
+    return ret * M_LOG10E;
+}
+
+// objective functions for kmin_brent
+static double baf_lod_f(double x, void *data) {
+    const segment_t *seg = (const segment_t *)data;
+    if (seg->n_hist >= 0) return -baf_hist_lod(seg, x);
+    if (seg->gt_phase)
+        return -baf_phase_lod(seg->baf, seg->gt_phase, seg->n, seg->imap, seg->bdev_phase, seg->err_log_prb,
+                              seg->baf_sd, x);
+    return -baf_lod(seg->baf, seg->n, seg->imap, seg->err_log_prb, seg->baf_sd, x);
+}
+
+static double lrr_baf_lod_f(double x, void *data) {
+    const segment_t *seg = (const segment_t *)data;
+    return -lrr_baf_lod(seg->lrr, seg->baf, seg->n, seg->imap, seg->err_log_prb, seg->lrr_bias, seg->lrr_hap2dip,
+                        seg->lrr_sd, seg->baf_sd, x);
+}
+
+// minimizes an objective function with kmin_brent counting its evaluations
+typedef struct {
+    kmin1_f func;
+    void *data;
+} brent_call_t;
+
+static double brent_f(double x, void *data) {
+    const brent_call_t *call = (const brent_call_t *)data;
+    if (stage_times_on) thread_n_brent_eval++;
+    return call->func(x, call->data);
+}
+
+static inline double brent_min(kmin1_f func, double a, double b, void *data, double *x) {
+    brent_call_t call = {func, data};
+    return kmin_brent(brent_f, a, b, &call, KMIN_EPS, x);
+}
+
+// maximizes the BAF LOD for a segment, NULL gt_phase for the unphased model
+static double baf_lod_max(const float *baf, const int8_t *gt_phase, const int8_t *bdev_phase, int n, const int *imap,
+                          float err_log_prb, float baf_sd, double a, double b, double *x, arena_t *arena) {
+    size_t mark = arena_mark(arena);
+    segment_t seg;
+    segment_init(&seg, NULL, baf, NULL, NULL, gt_phase, bdev_phase, n, imap);
+    seg.err_log_prb = err_log_prb;
+    seg.baf_sd = baf_sd;
+    segment_hist(&seg, arena);
+    double fx = brent_min(baf_lod_f, a, b, &seg, x);
+    arena_release(arena, mark);
+    return fx;
+}
+
 // TODO find a better title for this function
 static float compare_models(const float *baf, const int8_t *gt_phase, int n, const int *imap, float xy_log_prb,
                             float err_log_prb, float flip_log_prb, float tel_log_prb, float baf_sd, const float *bdev,
-                            int m) {
+                            int m, arena_t *arena) {
     if (n == 0) return NAN;
-    float *emis_log_lkl = baf_phase_emis_log_lkl(baf, gt_phase, n, imap, err_log_prb, baf_sd, bdev, m);
-    int8_t *path = log_viterbi_run(emis_log_lkl, n, m, xy_log_prb, flip_log_prb, tel_log_prb, 0.0f, 0,
-                                   0); // TODO can I not pass these values instead of 0 0?
-    free(emis_log_lkl);
+    size_t mark = arena_mark(arena);
+    float *emis_log_lkl = baf_phase_emis_log_lkl(baf, gt_phase, n, imap, err_log_prb, baf_sd, bdev, m, arena);
+    int8_t *path = log_viterbi_run(emis_log_lkl, n, m, xy_log_prb, flip_log_prb, tel_log_prb, 0.0f, 0, 0, NULL,
+                                   arena); // TODO can I not pass these values instead of 0 0?
     int n_flips = 0;
     for (int i = 1; i < n; i++)
         if (path[i - 1] && path[i] && path[i - 1] != path[i]) n_flips++;
-    double f(double x, void *data) { return -baf_phase_lod(baf, gt_phase, n, imap, path, err_log_prb, baf_sd, x); }
-    double x, fx = kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x);
-    free(path);
+    double x, fx = baf_lod_max(baf, gt_phase, path, n, imap, err_log_prb, baf_sd, 0.1, 0.2, &x, arena);
+    arena_release(arena, mark);
     return -(float)fx + (float)n_flips * flip_log_prb * (float)M_LOG10E;
 }
 
@@ -763,22 +1458,29 @@ static inline float ad_phase_log_lkl(int16_t ad0, int16_t ad1, int8_t phase, con
 
 static float *lrr_ad_emis_log_lkl(const float *lrr, const int16_t *ad0, const int16_t *ad1, int T, const int *imap,
                                   float err_log_prb, float lrr_bias, float lrr_hap2dip, float lrr_sd, float ad_rho,
-                                  const float *bdev_lrr_baf_arr, int m) {
+                                  const float *bdev_lrr_baf_arr, int m, beta_binom_t *beta_binom_null,
+                                  beta_binom_t *beta_binom_alt, arena_t *arena) {
     int N = 1 + 2 * m;
     int n1, n2;
     get_max_sum(ad0, ad1, T, NULL, &n1, &n2);
-    float *emis_log_lkl = (float *)malloc(N * T * sizeof(float));
+    float *emis_log_lkl = (float *)arena_alloc(arena, N * T * sizeof(float));
+    size_t mark = arena_mark(arena);
+    // beta binomial likelihoods for (AD0, AD1) and (AD1, AD0) under no allelic imbalance and under each deviation
+    float *null_log_lkl = (float *)arena_alloc(arena, 2 * T * sizeof(float));
+    float *alt_log_lkl = (float *)arena_alloc(arena, 2 * T * sizeof(float));
     for (int i = 0; i < 1 + m; i++) {
         float ldev = i == 0 ? 0.0f : -logf(1.0f - 2.0f * bdev_lrr_baf_arr[i - 1]) / (float)M_LN2 * lrr_hap2dip;
         float bdev = i == 0 ? 0.0f : fabsf(bdev_lrr_baf_arr[i - 1]);
         beta_binom_t *beta_binom = i == 0 ? beta_binom_null : beta_binom_alt;
+        float *log_lkl = i == 0 ? null_log_lkl : alt_log_lkl;
         beta_binom_update(beta_binom, 0.5f + bdev, ad_rho, n1, n2);
+        beta_binom_log_batch(beta_binom, ad0, ad1, imap, T, log_lkl);
+        beta_binom_log_batch(beta_binom, ad1, ad0, imap, T, log_lkl + T);
 
         for (int t = 0; t < T; t++) {
             float x = imap ? lrr[imap[t]] : lrr[t];
-            int16_t a = imap ? ad0[imap[t]] : ad0[t];
-            int16_t b = imap ? ad1[imap[t]] : ad1[t];
-            emis_log_lkl[t * N + i] = lrr_ad_log_lkl(x, a, b, ldev, lrr_sd, lrr_bias, beta_binom);
+            emis_log_lkl[t * N + i] =
+                norm_log_lkl(x, ldev, lrr_sd, lrr_bias) + log_mean_expf(log_lkl[t], log_lkl[T + t]);
         }
     }
     // generate states that should attract LRR waves with no BAF signal
@@ -790,43 +1492,49 @@ static float *lrr_ad_emis_log_lkl(const float *lrr, const int16_t *ad0, const in
             float ldev = -logf(1.0f - 2.0f * bdev_lrr_baf_arr[i]) / (float)M_LN2 * lrr_hap2dip;
             for (int t = 0; t < T; t++) {
                 float x = imap ? lrr[imap[t]] : lrr[t];
-                int16_t a = imap ? ad0[imap[t]] : ad0[t];
-                int16_t b = imap ? ad1[imap[t]] : ad1[t];
-                emis_log_lkl[t * N + 1 + m + i] = lrr_ad_log_lkl(x, a, b, ldev, lrr_sd, lrr_bias, beta_binom_null);
+                emis_log_lkl[t * N + 1 + m + i] =
+                    norm_log_lkl(x, ldev, lrr_sd, lrr_bias) + log_mean_expf(null_log_lkl[t], null_log_lkl[T + t]);
             }
         }
     }
     for (int t = 0; t < T; t++) rescale_emis_log_lkl(&emis_log_lkl[t * N], N, err_log_prb);
+    arena_release(arena, mark);
     return emis_log_lkl;
 }
 
 static float *ad_phase_emis_log_lkl(const int16_t *ad0, const int16_t *ad1, const int8_t *gt_phase, int T,
-                                    const int *imap, float err_log_prb, float ad_rho, const float *bdev_arr, int m) {
+                                    const int *imap, float err_log_prb, float ad_rho, const float *bdev_arr, int m,
+                                    beta_binom_t *beta_binom_null, beta_binom_t *beta_binom_alt, arena_t *arena) {
     int N = 1 + 2 * m;
-    float *emis_log_lkl = (float *)malloc(N * T * sizeof(float));
+    float *emis_log_lkl = (float *)arena_alloc(arena, N * T * sizeof(float));
+    size_t mark = arena_mark(arena);
+    // beta binomial likelihoods for (AD0, AD1) and (AD1, AD0)
+    float *log_lkl = (float *)arena_alloc(arena, 2 * T * sizeof(float));
+    int n1, n2;
+    get_max_sum(ad0, ad1, T, imap, &n1, &n2);
     for (int i = 0; i < 1 + m; i++) {
         float bdev = i == 0 ? 0.0f : bdev_arr[i - 1];
-        // TODO this function should come out of the loop
-        int n1, n2;
-        get_max_sum(ad0, ad1, T, imap, &n1, &n2);
         beta_binom_t *beta_binom = i == 0 ? beta_binom_null : beta_binom_alt;
         beta_binom_update(beta_binom, 0.5f + bdev, ad_rho, n1, n2);
+        beta_binom_log_batch(beta_binom, ad0, ad1, imap, T, log_lkl);
+        beta_binom_log_batch(beta_binom, ad1, ad0, imap, T, log_lkl + T);
 
         for (int t = 0; t < T; t++) {
-            int16_t a = imap ? ad0[imap[t]] : ad0[t];
-            int16_t b = imap ? ad1[imap[t]] : ad1[t];
             int8_t p = imap ? gt_phase[imap[t]] : gt_phase[t];
-            emis_log_lkl[t * N + i] = ad_phase_log_lkl(a, b, p, beta_binom);
-            if (i > 0) emis_log_lkl[t * N + m + i] = ad_phase_log_lkl(b, a, p, beta_binom);
+            float ab = log_lkl[t], ba = log_lkl[T + t];
+            emis_log_lkl[t * N + i] = p == 0 ? log_mean_expf(ab, ba) : (p > 0 ? ab : ba);
+            if (i > 0) emis_log_lkl[t * N + m + i] = p == 0 ? log_mean_expf(ba, ab) : (p > 0 ? ba : ab);
         }
     }
     for (int t = 0; t < T; t++) rescale_emis_log_lkl(&emis_log_lkl[t * N], N, err_log_prb);
+    arena_release(arena, mark);
     return emis_log_lkl;
 }
 
 static int cnp_edge_is_not_cn2_lrr_ad(const float *lrr, int16_t *ad0, int16_t *ad1, int n, int a, int b,
                                       float xy_log_prb, float err_log_prb, float lrr_bias, float lrr_hap2dip,
-                                      float lrr_sd, float ad_rho, float ldev, float bdev) {
+                                      float lrr_sd, float ad_rho, float ldev, float bdev, beta_binom_t *beta_binom_null,
+                                      beta_binom_t *beta_binom_alt) {
     int n1, n2;
     get_max_sum(ad0, ad1, n, NULL, &n1, &n2);
     beta_binom_update(beta_binom_null, 0.5f, ad_rho, n1, n2);
@@ -867,14 +1575,14 @@ static int cnp_edge_is_not_cn2_lrr_ad(const float *lrr, int16_t *ad0, int16_t *a
 // return the LOD likelihood for a segment
 static double lrr_ad_lod(const float *lrr_arr, const int16_t *ad0_arr, const int16_t *ad1_arr, int n, const int *imap,
                          float err_log_prb, float lrr_bias, float lrr_hap2dip, float lrr_sd, float ad_rho,
-                         double bdev_lrr_baf) {
+                         double bdev_lrr_baf, beta_binom_t *beta_binom_null, beta_binom_t *beta_binom_alt) {
     if (n == 0 || bdev_lrr_baf < -0.5 || bdev_lrr_baf > 0.25) return -INFINITY; // kmin_brent does not handle NAN
 
     float ldev = -logf(1.0f - 2.0f * (float)bdev_lrr_baf) / (float)M_LN2 * lrr_hap2dip;
     int n1, n2;
     get_max_sum(ad0_arr, ad1_arr, n, imap, &n1, &n2);
     beta_binom_update(beta_binom_null, 0.5f, ad_rho, n1, n2);
-    beta_binom_update(beta_binom_alt, 0.5f + (float)bdev_lrr_baf, ad_rho, n1, n2);
+    beta_binom_update_probe(beta_binom_alt, 0.5f + (float)bdev_lrr_baf, ad_rho, n1, n2);
     float ret = 0.0f;
     for (int i = 0; i < n; i++) {
         float lrr = imap ? lrr_arr[imap[i]] : lrr_arr[i];
@@ -891,88 +1599,100 @@ static double lrr_ad_lod(const float *lrr_arr, const int16_t *ad0_arr, const int
     return (double)ret * M_LOG10E;
 }
 
-// return the LOD likelihood for a segment
-static double ad_lod(const int16_t *ad0_arr, const int16_t *ad1_arr, int n, const int *imap, float err_log_prb,
-                     float ad_rho, double bdev) {
-    if (n == 0 || bdev < 0.0 || bdev > 0.5) return -INFINITY; // kmin_brent does not handle NAN
-
-    int n1, n2;
-    get_max_sum(ad0_arr, ad1_arr, n, imap, &n1, &n2);
-    beta_binom_update(beta_binom_null, 0.5f, ad_rho, n1, n2);
-    beta_binom_update(beta_binom_alt, 0.5f + (float)bdev, ad_rho, n1, n2);
-    float ret = 0.0f;
-    for (int i = 0; i < n; i++) {
-        int16_t ad0 = imap ? ad0_arr[imap[i]] : ad0_arr[i];
-        int16_t ad1 = imap ? ad1_arr[imap[i]] : ad1_arr[i];
-        float log_lkl =
-            log_mean_expf(beta_binom_log_lkl(beta_binom_alt, ad0, ad1), beta_binom_log_lkl(beta_binom_alt, ad1, ad0))
-            - beta_binom_log_lkl(beta_binom_null, ad0, ad1);
-        if (log_lkl < err_log_prb)
-            log_lkl = err_log_prb;
-        else if (log_lkl > -err_log_prb)
-            log_lkl = -err_log_prb;
-        ret += log_lkl;
+// return the LOD likelihood for a segment from its distinct allelic depths, summed in double as in baf_hist_lod()
+static double ad_hist_lod(const segment_t *seg, double bdev) {
+    if (seg->n == 0 || bdev < 0.0 || bdev > 0.5) return -INFINITY; // kmin_brent does not handle NAN
+
+    beta_binom_update(seg->beta_binom_null, 0.5f, seg->baf_sd, seg->n1, seg->n2);
+    beta_binom_update_probe(seg->beta_binom_alt, 0.5f + (float)bdev, seg->baf_sd, seg->n1, seg->n2);
+    double ret = 0.0;
+    for (int k = 0; k < seg->n_hist; k++) {
+        int16_t ad0 = seg->hist0[k];
+        int16_t ad1 = seg->hist1[k];
+        float log_lkl = seg->gt_phase ? ad_phase_log_lkl(ad0, ad1, seg->hist_phase[k], seg->beta_binom_alt)
+                                            - ad_phase_log_lkl(ad0, ad1, 0, seg->beta_binom_null)
+                                      : log_mean_expf(beta_binom_log_lkl(seg->beta_binom_alt, ad0, ad1),
+                                                      beta_binom_log_lkl(seg->beta_binom_alt, ad1, ad0))
+                                            - beta_binom_log_lkl(seg->beta_binom_null, ad0, ad1);
+        if (log_lkl < seg->err_log_prb)
+            log_lkl = seg->err_log_prb;
+        else if (log_lkl > -seg->err_log_prb)
+            log_lkl = -seg->err_log_prb;
+        ret += (double)seg->hist_cnt[k] * (double)log_lkl;
     }
-    return (double)ret * M_LOG10E;
+    return ret * M_LOG10E;
 }
 
-// return the LOD likelihood for a segment
-static double ad_phase_lod(const int16_t *ad0_arr, const int16_t *ad1_arr, const int8_t *gt_phase, int n,
-                           const int *imap, const int8_t *bdev_phase, float err_log_prb, float ad_rho, double bdev) {
-    if (n == 0 || bdev < 0.0 || bdev > 0.5) return -INFINITY; // kmin_brent does not handle NAN
+// objective functions for kmin_brent
+static double ad_lod_f(double x, void *data) { return -ad_hist_lod((const segment_t *)data, x); }
 
-    int n1, n2;
-    get_max_sum(ad0_arr, ad1_arr, n, imap, &n1, &n2);
-    beta_binom_update(beta_binom_null, 0.5f, ad_rho, n1, n2);
-    beta_binom_update(beta_binom_alt, 0.5f + (float)bdev, ad_rho, n1, n2);
-    float ret = 0.0f;
-    for (int i = 0; i < n; i++) {
-        int16_t ad0 = imap ? ad0_arr[imap[i]] : ad0_arr[i];
-        int16_t ad1 = imap ? ad1_arr[imap[i]] : ad1_arr[i];
-        int8_t p = imap ? gt_phase[imap[i]] : gt_phase[i];
-        if (bdev_phase) p *= (int8_t)SIGN(bdev_phase[i]); // notice bdev_phase has no imap
-        float log_lkl = ad_phase_log_lkl(ad0, ad1, p, beta_binom_alt) - ad_phase_log_lkl(ad0, ad1, 0, beta_binom_null);
-        if (log_lkl < err_log_prb)
-            log_lkl = err_log_prb;
-        else if (log_lkl > -err_log_prb)
-            log_lkl = -err_log_prb;
-        ret += log_lkl;
-    }
-    return (double)ret * M_LOG10E;
+static double lrr_ad_lod_f(double x, void *data) {
+    const segment_t *seg = (const segment_t *)data;
+    return -lrr_ad_lod(seg->lrr, seg->ad0, seg->ad1, seg->n, seg->imap, seg->err_log_prb, seg->lrr_bias,
+                       seg->lrr_hap2dip, seg->lrr_sd, seg->baf_sd, x, seg->beta_binom_null, seg->beta_binom_alt);
+}
+
+// maximizes the AD LOD for a segment, NULL gt_phase for the unphased model
+static double ad_lod_max(const int16_t *ad0, const int16_t *ad1, const int8_t *gt_phase, const int8_t *bdev_phase,
+                         int n, const int *imap, float err_log_prb, float ad_rho, beta_binom_t *beta_binom_null,
+                         beta_binom_t *beta_binom_alt, double a, double b, double *x, arena_t *arena) {
+    size_t mark = arena_mark(arena);
+    segment_t seg;
+    segment_init(&seg, NULL, NULL, ad0, ad1, gt_phase, bdev_phase, n, imap);
+    seg.err_log_prb = err_log_prb;
+    seg.baf_sd = ad_rho;
+    seg.beta_binom_null = beta_binom_null;
+    seg.beta_binom_alt = beta_binom_alt;
+    segment_hist(&seg, arena);
+    double fx = brent_min(ad_lod_f, a, b, &seg, x);
+    arena_release(arena, mark);
+    return fx;
 }
 
 // TODO find a better title for this function
 static float compare_wgs_models(const int16_t *ad0, const int16_t *ad1, const int8_t *gt_phase, int n, const int *imap,
                                 float xy_log_prb, float err_log_prb, float flip_log_prb, float tel_log_prb,
-                                float ad_rho, const float *bdev, int m) {
+                                float ad_rho, const float *bdev, int m, beta_binom_t *beta_binom_null,
+                                beta_binom_t *beta_binom_alt, arena_t *arena) {
     if (n == 0) return NAN;
-    float *emis_log_lkl = ad_phase_emis_log_lkl(ad0, ad1, gt_phase, n, imap, err_log_prb, ad_rho, bdev, m);
-    int8_t *path = log_viterbi_run(emis_log_lkl, n, m, xy_log_prb, flip_log_prb, tel_log_prb, 0.0f, 0,
-                                   0); // TODO can I not pass these values instead of 0 0?
-    free(emis_log_lkl);
+    size_t mark = arena_mark(arena);
+    float *emis_log_lkl = ad_phase_emis_log_lkl(ad0, ad1, gt_phase, n, imap, err_log_prb, ad_rho, bdev, m,
+                                                beta_binom_null, beta_binom_alt, arena);
+    int8_t *path = log_viterbi_run(emis_log_lkl, n, m, xy_log_prb, flip_log_prb, tel_log_prb, 0.0f, 0, 0, NULL,
+                                   arena); // TODO can I not pass these values instead of 0 0?
     int n_flips = 0;
     for (int i = 1; i < n; i++)
         if (path[i - 1] && path[i] && path[i - 1] != path[i]) n_flips++;
-    double f(double x, void *data) { return -ad_phase_lod(ad0, ad1, gt_phase, n, imap, path, err_log_prb, ad_rho, x); }
-    double x, fx = kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x);
-    free(path);
+    double x, fx = ad_lod_max(ad0, ad1, gt_phase, path, n, imap, err_log_prb, ad_rho, beta_binom_null, beta_binom_alt,
+                              0.1, 0.2, &x, arena);
+    arena_release(arena, mark);
     return -(float)fx + (float)n_flips * flip_log_prb * (float)M_LOG10E;
 }
 
-// TODO change this or integrate with ad_lod
-static double lod_lkl_beta_binomial(const int16_t *ad0_arr, const int16_t *ad1_arr, int n, const int *imap,
-                                    double ad_rho) {
-    if (n == 0 || ad_rho <= 0.0 || ad_rho >= 1.0) return -INFINITY;
-    float ret = 0.0f;
-    int n1, n2;
-    get_max_sum(ad0_arr, ad1_arr, n, imap, &n1, &n2);
-    beta_binom_update(beta_binom_null, 0.5f, ad_rho, n1, n2);
-    for (int i = 0; i < n; i++) {
-        int16_t ad0 = imap ? ad0_arr[imap[i]] : ad0_arr[i];
-        int16_t ad1 = imap ? ad1_arr[imap[i]] : ad1_arr[i];
-        ret += beta_binom_log_lkl(beta_binom_null, ad0, ad1);
-    }
-    return (double)ret * M_LOG10E;
+// objective function for kmin_brent, the log likelihood of the distinct allelic depths under no allelic imbalance
+static double ad_dispersion_f(double x, void *data) {
+    const segment_t *seg = (const segment_t *)data;
+    if (seg->n == 0 || x <= 0.0 || x >= 1.0) return INFINITY;
+    beta_binom_update_probe(seg->beta_binom_null, 0.5f, x, seg->n1, seg->n2);
+    double ret = 0.0;
+    for (int k = 0; k < seg->n_hist; k++)
+        ret += (double)seg->hist_cnt[k]
+               * (double)beta_binom_log_lkl(seg->beta_binom_null, seg->hist0[k], seg->hist1[k]);
+    return -ret * M_LOG10E;
+}
+
+// estimates the dispersion rho(AD0, AD1) of the allelic depths
+static float get_ad_dispersion(const int16_t *ad0, const int16_t *ad1, int n, const int *imap,
+                               beta_binom_t *beta_binom_null, arena_t *arena) {
+    size_t mark = arena_mark(arena);
+    segment_t seg;
+    segment_init(&seg, NULL, NULL, ad0, ad1, NULL, NULL, n, imap);
+    seg.beta_binom_null = beta_binom_null;
+    segment_hist(&seg, arena);
+    double x;
+    brent_min(ad_dispersion_f, 0.1, 0.2, &seg, &x); // dispersions above 0.5 are not allowed
+    arena_release(arena, mark);
+    return (float)x;
 }
 
 /*********************************
@@ -1062,11 +1782,12 @@ static float get_lrr_auto_corr(const float *lrr, int n, const int *imap) {
 }
 
 // compute the n50 of a vector
-static int get_n50(const int *v, int n, const int *imap) {
+static int get_n50(const int *v, int n, const int *imap, arena_t *arena) {
     if (n <= 1) return -1;
     int i;
     int sum, sum2;
-    int *w = (int *)malloc((n - 1) * sizeof(int));
+    size_t mark = arena_mark(arena);
+    int *w = (int *)arena_alloc(arena, (n - 1) * sizeof(int));
 
     for (i = 0, sum = 0; i < n - 1; i++) {
         w[i] = imap ? v[imap[i + 1]] - v[imap[i]] : v[i + 1] - v[i];
@@ -1078,7 +1799,7 @@ static int get_n50(const int *v, int n, const int *imap) {
 
     for (i = 0, sum2 = 0; sum2 < sum && i < n - 1; i++) sum2 += w[i];
     int n50 = w[i - 1];
-    free(w);
+    arena_release(arena, mark);
     return n50;
 }
 
@@ -1253,38 +1974,196 @@ static void mocha_print_calls(FILE *restrict stream, const mocha_t *mocha, int n
     if (stream != stdout && stream != stderr) fclose(stream);
 }
 
-// this function returns two values (a, b) such that:
-// (i) a <= b (ii) pos[a-1] < beg (iii) beg <= pos[a] < end (iv) beg <= pos[b] < end (v)
-// pos[b+1] >= end
-static int get_cnp_edges(const int *pos, int n, int beg, int end, int *a, int *b) {
-    if (pos[0] >= end || pos[n - 1] < beg) return -1;
-
-    int i = 0, j = n - 1, k;
-    while (j - i > 1) {
-        k = (i + j) / 2;
-        if (pos[k] < beg)
-            i = k;
-        else
-            j = k;
+// returns the first index i such that v[i] >= x, or n if there is none
+static inline int lower_bound_int(const int *v, int n, int x) {
+    int i = 0;
+    while (n > 0) {
+        int half = n / 2;
+        if (v[i + half] < x) {
+            i += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
     }
-    if (pos[j] >= end) return -1;
-
-    *a = j;
+    return i;
+}
 
-    i = j;
-    j = n - 1;
-    while (j - i > 1) {
-        k = (i + j) / 2;
-        if (pos[k] < end)
-            i = k;
-        else
-            j = k;
+// collects the CNP regions overlapping the records of the contig in the order the index returns them
+static int get_cnp_regions(regidx_t *cnp_idx, const char *chr, const model_t *model, cnp_region_t **cnp_arr,
+                           int *m_cnp) {
+    int n_cnp = 0;
+    int n_locus = model->n_locus;
+    if (n_locus == 0) return 0;
+    int *pos = (int *)malloc(n_locus * sizeof(int));
+    for (int i = 0; i < n_locus; i++) pos[i] = model->locus_arr[i].pos;
+    regitr_t *itr = regitr_init(cnp_idx);
+    if (regidx_overlap(cnp_idx, chr, 0, model->genome_rules->length[model->rid], itr)) {
+        while (regitr_overlap(itr)) {
+            int rec_beg = lower_bound_int(pos, n_locus, (int)itr->beg);
+            int rec_end = lower_bound_int(pos + rec_beg, n_locus - rec_beg, (int)itr->end) + rec_beg;
+            if (rec_beg == rec_end) continue;
+            hts_expand(cnp_region_t, n_cnp + 1, *m_cnp, *cnp_arr);
+            (*cnp_arr)[n_cnp].rec_beg = rec_beg;
+            (*cnp_arr)[n_cnp].rec_end = rec_end;
+            (*cnp_arr)[n_cnp].type = regitr_payload(itr, int);
+            n_cnp++;
+        }
     }
+    regitr_destroy(itr);
+    free(pos);
+    return n_cnp;
+}
 
-    *b = i;
+// this function returns two values (a, b) such that a <= b and the sites a to b of the sample are the sites whose
+// records fall within the CNP region, as the sites are sorted by record this only requires two binary searches
+// unlike the bisection this replaces, the first and last sites of the sample are included when the region covers them
+static int get_cnp_edges(const cnp_region_t *cnp, const int *vcf_imap_arr, int n, int *a, int *b) {
+    int i = lower_bound_int(vcf_imap_arr, n, cnp->rec_beg);
+    if (i == n || vcf_imap_arr[i] >= cnp->rec_end) return -1;
+    *a = i;
+    *b = lower_bound_int(vcf_imap_arr + i, n - i, cnp->rec_end) + i - 1;
     return 0;
 }
 
+// exchanges the per-contig arrays of two samples
+static void sample_swap_sites(sample_t *a, sample_t *b) {
+    sample_t tmp = *a;
+    a->vcf_imap_arr = b->vcf_imap_arr;
+    a->m_vcf_imap = b->m_vcf_imap;
+    a->phase_arr = b->phase_arr;
+    a->m_phase = b->m_phase;
+    b->vcf_imap_arr = tmp.vcf_imap_arr;
+    b->m_vcf_imap = tmp.m_vcf_imap;
+    b->phase_arr = tmp.phase_arr;
+    b->m_phase = tmp.m_phase;
+    for (int k = 0; k < 2; k++) {
+        a->data_arr[k] = b->data_arr[k];
+        a->m_data[k] = b->m_data[k];
+        b->data_arr[k] = tmp.data_arr[k];
+        b->m_data[k] = tmp.m_data[k];
+    }
+}
+
+static void sample_free_sites(sample_t *self) {
+    free(self->vcf_imap_arr);
+    free(self->phase_arr);
+    free(self->data_arr[0]);
+    free(self->data_arr[1]);
+    self->vcf_imap_arr = NULL;
+    self->phase_arr = NULL;
+    self->data_arr[0] = self->data_arr[1] = NULL;
+    self->m_vcf_imap = self->m_phase = self->m_data[0] = self->m_data[1] = 0;
+    self->n = 0;
+}
+
+/****************************************
+ * RUNNING MEDIAN                       *
+ ****************************************/
+
+// medians of the values of an array within windows that overlap each other, computed from the ranks of the values
+// and a binary indexed tree counting the ranks within the current window
+typedef struct {
+    const float *v;
+    int n, n_rank;
+    int64_t n_work;    // values visited by get_median_buf() before the ranks were computed
+    float *sorted;     // values sorted by rank
+    int *rank;         // rank of each value, -1 if missing
+    int *tree;         // binary indexed tree of the counts of the ranks within the window
+    int beg, end, cnt; // window [beg, end) and number of values within it that are not missing
+} running_median_t;
+
+static void running_median_init(running_median_t *self, const float *v, int n) {
+    memset(self, 0, sizeof(running_median_t));
+    self->v = v;
+    self->n = n;
+}
+
+// the index is allocated outside of the arena as it has to outlive the marks released between the HMM passes
+static void running_median_index(running_median_t *self) {
+    int n = self->n;
+    uint64_t *keys = (uint64_t *)malloc(n * sizeof(uint64_t));
+    int n_keys = 0;
+    for (int i = 0; i < n; i++) {
+        if (isnan(self->v[i])) continue;
+        union {
+            float f;
+            uint32_t u;
+        } x = {self->v[i]};
+        uint32_t key = x.u & 0x80000000 ? ~x.u : x.u | 0x80000000; // unsigned keys sort as the floats do
+        keys[n_keys++] = (uint64_t)key << 32 | (uint64_t)i;
+    }
+    ks_introsort_uint64_t((size_t)n_keys, keys);
+    self->n_rank = n_keys;
+    self->sorted = (float *)malloc(n_keys * sizeof(float));
+    self->rank = (int *)malloc(n * sizeof(int));
+    self->tree = (int *)calloc(n_keys + 1, sizeof(int));
+    for (int i = 0; i < n; i++) self->rank[i] = -1;
+    for (int k = 0; k < n_keys; k++) {
+        int i = (int)(uint32_t)keys[k];
+        self->rank[i] = k;
+        self->sorted[k] = self->v[i];
+    }
+    free(keys);
+}
+
+static void running_median_destroy(running_median_t *self) {
+    free(self->sorted);
+    free(self->rank);
+    free(self->tree);
+}
+
+static inline void running_median_update(running_median_t *self, int i, int d) {
+    int r = self->rank[i];
+    if (r < 0) return;
+    self->cnt += d;
+    for (r++; r <= self->n_rank; r += r & -r) self->tree[r] += d;
+}
+
+// returns the value of rank k among the values within the window
+static inline float running_median_kth(const running_median_t *self, int k) {
+    int r = 0, step = 1;
+    while (step * 2 <= self->n_rank) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (r + step <= self->n_rank && self->tree[r + step] <= k) {
+            r += step;
+            k -= self->tree[r];
+        }
+    }
+    return self->sorted[r];
+}
+
+// compute the median of v[beg..end-1] as get_median_buf() would, moving to the ranks once the windows visited amount
+// to more than twice the values in the array
+static float running_median_get(running_median_t *self, int beg, int end, float *w) {
+    if (!self->tree) {
+        self->n_work += end - beg;
+        if (self->n_work <= 2 * (int64_t)self->n) return get_median_buf(self->v + beg, end - beg, NULL, w);
+        running_median_index(self);
+    }
+    if (beg >= self->end || end <= self->beg) {
+        for (int i = self->beg; i < self->end; i++) running_median_update(self, i, -1);
+        self->beg = self->end = beg;
+    }
+    while (self->beg > beg) running_median_update(self, --self->beg, 1);
+    while (self->end < end) running_median_update(self, self->end++, 1);
+    while (self->beg < beg) running_median_update(self, self->beg++, -1);
+    while (self->end > end) running_median_update(self, --self->end, -1);
+    if (self->cnt == 0) return NAN;
+    float ret = running_median_kth(self, self->cnt / 2);
+    if (self->cnt % 2 == 0) ret = (ret + running_median_kth(self, self->cnt / 2 - 1)) * 0.5f;
+    return ret;
+}
+
+// values v[beg..end-1] have been set to missing
+static void running_median_mask(running_median_t *self, int beg, int end) {
+    if (!self->tree) return;
+    for (int i = beg; i < end; i++) {
+        if (i >= self->beg && i < self->end) running_median_update(self, i, -1);
+        self->rank[i] = -1;
+    }
+}
+
 // classify mosaic chromosomal alteration type based on LRR and BAF
 // LDEV = -log2( 1 - 2 x BDEV ) * LRR-hap2dip for gains
 // LDEV = -log2( 1 + 2 x BDEV ) * LRR-hap2dip for losses
@@ -1359,7 +2238,8 @@ static float mocha_cell_fraction(float ldev, float ldev_se, float bdev, int n_he
 }
 
 static void get_mocha_stats(const int *pos, const float *lrr, const float *baf, const int8_t *gt_phase, int n, int a,
-                            int b, int cen_beg, int cen_end, int length, float baf_conc, mocha_t *mocha) {
+                            int b, int cen_beg, int cen_end, int length, float baf_conc, mocha_t *mocha,
+                            arena_t *arena) {
     mocha->n_sites = b + 1 - a;
 
     if (a == 0)
@@ -1404,7 +2284,7 @@ static void get_mocha_stats(const int *pos, const float *lrr, const float *baf,
     mocha->lod_baf_conc = ((mocha->baf_conc > 0 ? (float)conc * logf(mocha->baf_conc / baf_conc) : 0)
                            + (mocha->baf_conc < 1 ? (float)disc * logf((1 - mocha->baf_conc) / (1 - baf_conc)) : 0))
                           * (float)M_LOG10E;
-    mocha->n50_hets = get_n50(pos + a, b + 1 - a, NULL);
+    mocha->n50_hets = get_n50(pos + a, b + 1 - a, NULL, arena);
     mocha->n_flips = -1;
     mocha->bdev = NAN;
     mocha->bdev_se = NAN;
@@ -1450,7 +2330,7 @@ static float get_path_segs(const int8_t *path, const float *hs_arr, int n, int h
 }
 
 // process one contig for one sample
-static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t *model) {
+static void sample_run(sample_t *self, worker_t *worker, const model_t *model) {
     // do nothing if chromosome Y or MT are being tested
     if (model->rid == model->genome_rules->y_rid || model->rid == model->genome_rules->mt_rid) {
         memset(self->data_arr[LDEV], 0, self->n * sizeof(int16_t));
@@ -1459,6 +2339,10 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
         return;
     }
 
+    mocha_table_t *mocha_table = &worker->mocha_table;
+    beta_binom_t *beta_binom_null = worker->beta_binom_null;
+    beta_binom_t *beta_binom_alt = worker->beta_binom_alt;
+    arena_t *arena = &worker->arena;
     mocha_t mocha;
     mocha.sample_idx = self->idx;
     mocha.computed_gender = self->computed_gender;
@@ -1476,10 +2360,13 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
     int8_t *gt_phase = self->phase_arr;
     int16_t *ad0 = self->data_arr[AD0];
     int16_t *ad1 = self->data_arr[AD1];
-    float *lrr = (float *)malloc(n * sizeof(float));
-    float *baf = (float *)malloc(n * sizeof(float));
+    float *lrr = (float *)arena_alloc(arena, n * sizeof(float));
+    float *baf = (float *)arena_alloc(arena, n * sizeof(float));
+    float *median_buf = (float *)arena_alloc(arena, n * sizeof(float));
+    running_median_t lrr_median;
+    running_median_init(&lrr_median, lrr, n);
     if (model->flags & WGS_DATA) {
-        ad_to_lrr_baf(ad0, ad1, lrr, baf, n);
+        ad_to_lrr_baf(ad0, ad1, lrr, baf, n, worker);
     } else {
         for (int i = 0; i < n; i++) {
             lrr[i] = int16_to_float(self->data_arr[LRR][i]);
@@ -1492,110 +2379,109 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
     else if (model->lrr_gc_order != -1)
         adjust_lrr(lrr, model->gc_arr, n, self->vcf_imap_arr, self->stats.coeffs, 0);
 
-    int8_t *bdev_phase = (int8_t *)calloc(n, sizeof(int8_t));
-    int *pos = (int *)malloc(n * sizeof(int));
+    int8_t *bdev_phase = (int8_t *)arena_calloc(arena, n * sizeof(int8_t));
+    int *pos = (int *)arena_alloc(arena, n * sizeof(int));
     for (int i = 0; i < n; i++) pos[i] = model->locus_arr[self->vcf_imap_arr[i]].pos;
-    int *imap_arr = (int *)malloc(n * sizeof(int));
-    int *hets_imap_arr = (int *)malloc(n * sizeof(int));
-    float *pbaf_arr = (float *)malloc(n * sizeof(float));
+    int *imap_arr = (int *)arena_alloc(arena, n * sizeof(int));
+    int *hets_imap_arr = (int *)arena_alloc(arena, n * sizeof(int));
+    float *pbaf_arr = (float *)arena_alloc(arena, n * sizeof(float));
 
-    int16_t *ldev = (int16_t *)calloc(n, sizeof(int16_t));
-    int16_t *bdev = (int16_t *)calloc(n, sizeof(int16_t));
+    int16_t *ldev = (int16_t *)arena_calloc(arena, n * sizeof(int16_t));
+    int16_t *bdev = (int16_t *)arena_calloc(arena, n * sizeof(int16_t));
 
     if (model->rid == model->genome_rules->x_rid && self->computed_gender == GENDER_MALE) {
         for (int i = 0; i < n; i++) {
-            if (pos[i] > model->genome_rules->x_nonpar_beg && pos[i] < model->genome_rules->x_nonpar_end) {
+            if (model->locus_arr[self->vcf_imap_arr[i]].region & REGION_NONPAR) {
                 lrr[i] = NAN;
                 baf[i] = NAN;
             }
         }
     }
 
-    if (model->cnp_itr) {
-        while (regitr_overlap(model->cnp_itr)) {
-            int a, b;
-            if (get_cnp_edges(pos, n, model->cnp_itr->beg, model->cnp_itr->end, &a, &b) == 0) {
-                int cnp_type = regitr_payload(model->cnp_itr, int);
-                float exp_ldev = NAN;
-                float exp_bdev = NAN;
-                mocha.type = MOCHA_UNDET;
-                mocha.ldev = get_median(lrr + a, b + 1 - a, NULL);
-                if (mocha.ldev > 0 && (cnp_type == MOCHA_CNP_GAIN || cnp_type == MOCHA_CNP_CNV)) {
-                    if (model->flags & WGS_DATA)
-                        mocha.lod_lrr_baf =
-                            lrr_ad_lod(lrr + a, ad0 + a, ad1 + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
-                                       model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, 1.0f / 6.0f);
-                    else
-                        mocha.lod_lrr_baf =
-                            lrr_baf_lod(lrr + a, baf + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
-                                        model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, 1.0f / 6.0f);
-                    if (mocha.lod_lrr_baf > -model->xy_log_prb * (float)M_LOG10E) {
-                        mocha.type = MOCHA_CNP_GAIN;
-                        mocha.cf = NAN;
-                        exp_ldev = log2f(1.5f) * model->lrr_hap2dip;
-                        exp_bdev = 1.0f / 6.0f;
-                    }
-                } else if (mocha.ldev <= 0 && (cnp_type == MOCHA_CNP_LOSS || cnp_type == MOCHA_CNP_CNV)) {
+    for (int k = 0; k < worker->n_cnp; k++) {
+        int a, b;
+        if (get_cnp_edges(&worker->cnp_arr[k], self->vcf_imap_arr, n, &a, &b) == 0) {
+            int cnp_type = worker->cnp_arr[k].type;
+            float exp_ldev = NAN;
+            float exp_bdev = NAN;
+            mocha.type = MOCHA_UNDET;
+            mocha.ldev = running_median_get(&lrr_median, a, b + 1, median_buf);
+            if (mocha.ldev > 0 && (cnp_type == MOCHA_CNP_GAIN || cnp_type == MOCHA_CNP_CNV)) {
+                if (model->flags & WGS_DATA)
+                    mocha.lod_lrr_baf =
+                        lrr_ad_lod(lrr + a, ad0 + a, ad1 + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
+                                   model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, 1.0f / 6.0f,
+                                   beta_binom_null, beta_binom_alt);
+                else
+                    mocha.lod_lrr_baf =
+                        lrr_baf_lod(lrr + a, baf + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
+                                    model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, 1.0f / 6.0f);
+                if (mocha.lod_lrr_baf > -model->xy_log_prb * (float)M_LOG10E) {
+                    mocha.type = MOCHA_CNP_GAIN;
+                    mocha.cf = NAN;
+                    exp_ldev = log2f(1.5f) * model->lrr_hap2dip;
+                    exp_bdev = 1.0f / 6.0f;
+                }
+            } else if (mocha.ldev <= 0 && (cnp_type == MOCHA_CNP_LOSS || cnp_type == MOCHA_CNP_CNV)) {
+                if (model->flags & WGS_DATA)
+                    mocha.lod_lrr_baf =
+                        lrr_ad_lod(lrr + a, ad0 + a, ad1 + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
+                                   model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, -0.5f,
+                                   beta_binom_null, beta_binom_alt);
+                else
+                    mocha.lod_lrr_baf =
+                        lrr_baf_lod(lrr + a, baf + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
+                                    model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, -0.5f);
+                if (mocha.lod_lrr_baf > -model->xy_log_prb * (float)M_LOG10E) {
+                    mocha.type = MOCHA_CNP_LOSS;
+                    mocha.cf = NAN;
+                    exp_ldev = -model->lrr_hap2dip;
+                    exp_bdev = 0.5f;
+                }
+            }
+            if (mocha.type == MOCHA_CNP_GAIN || mocha.type == MOCHA_CNP_LOSS) {
+                if (model->flags & WGS_DATA) {
+                    if (cnp_edge_is_not_cn2_lrr_ad(lrr, ad0, ad1, n, a, b, model->xy_log_prb, model->err_log_prb,
+                                                   model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd,
+                                                   self->stats.dispersion, exp_ldev, exp_bdev, beta_binom_null,
+                                                   beta_binom_alt))
+                        continue;
+                } else {
+                    if (cnp_edge_is_not_cn2_lrr_baf(lrr, baf, n, a, b, model->xy_log_prb, model->err_log_prb,
+                                                    model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd,
+                                                    self->stats.dispersion, exp_ldev, exp_bdev))
+                        continue;
+                }
+                get_mocha_stats(pos, lrr, baf, gt_phase, n, a, b, cen_beg, cen_end, length, self->stats.baf_conc,
+                                &mocha, arena);
+                // compute bdev, if possible
+                if (mocha.n_hets > 0) {
+                    double x;
                     if (model->flags & WGS_DATA)
-                        mocha.lod_lrr_baf =
-                            lrr_ad_lod(lrr + a, ad0 + a, ad1 + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
-                                       model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, -0.5f);
+                        ad_lod_max(ad0 + a, ad1 + a, NULL, NULL, b + 1 - a, NULL, model->err_log_prb,
+                                   self->stats.dispersion, beta_binom_null, beta_binom_alt, 0.1, 0.2, &x, arena);
                     else
-                        mocha.lod_lrr_baf =
-                            lrr_baf_lod(lrr + a, baf + a, b + 1 - a, NULL, model->err_log_prb, model->lrr_bias,
-                                        model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, -0.5f);
-                    if (mocha.lod_lrr_baf > -model->xy_log_prb * (float)M_LOG10E) {
-                        mocha.type = MOCHA_CNP_LOSS;
-                        mocha.cf = NAN;
-                        exp_ldev = -model->lrr_hap2dip;
-                        exp_bdev = 0.5f;
-                    }
-                }
-                if (mocha.type == MOCHA_CNP_GAIN || mocha.type == MOCHA_CNP_LOSS) {
-                    if (model->flags & WGS_DATA) {
-                        if (cnp_edge_is_not_cn2_lrr_ad(lrr, ad0, ad1, n, a, b, model->xy_log_prb, model->err_log_prb,
-                                                       model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd,
-                                                       self->stats.dispersion, exp_ldev, exp_bdev))
-                            continue;
-                    } else {
-                        if (cnp_edge_is_not_cn2_lrr_baf(lrr, baf, n, a, b, model->xy_log_prb, model->err_log_prb,
-                                                        model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd,
-                                                        self->stats.dispersion, exp_ldev, exp_bdev))
-                            continue;
-                    }
-                    get_mocha_stats(pos, lrr, baf, gt_phase, n, a, b, cen_beg, cen_end, length, self->stats.baf_conc,
-                                    &mocha);
-                    // compute bdev, if possible
-                    if (mocha.n_hets > 0) {
-                        double f(double x, void *data) {
-                            if (model->flags & WGS_DATA)
-                                return -ad_lod(ad0 + a, ad1 + a, b + 1 - a, NULL, model->err_log_prb,
-                                               self->stats.dispersion, x);
-                            else
-                                return -baf_lod(baf + a, b + 1 - a, NULL, model->err_log_prb, self->stats.dispersion,
-                                                x);
-                        }
-                        double x;
-                        kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x);
-                        mocha.bdev = fabsf((float)x);
-                    } else
-                        mocha.bdev = NAN;
-                    mocha_table->n++;
-                    hts_expand(mocha_t, mocha_table->n, mocha_table->m, mocha_table->a);
-                    mocha_table->a[mocha_table->n - 1] = mocha;
-                    for (int j = a; j <= b; j++) {
-                        // TODO add other stuff here, like setting ldev
-                        // and bdev
-                        lrr[j] = NAN; // do not use the data again
-                        baf[j] = NAN; // do not use the data again
-                    }
+                        baf_lod_max(baf + a, NULL, NULL, b + 1 - a, NULL, model->err_log_prb,
+                                    self->stats.dispersion, 0.1, 0.2, &x, arena);
+                    mocha.bdev = fabsf((float)x);
+                } else
+                    mocha.bdev = NAN;
+                mocha_table->n++;
+                hts_expand(mocha_t, mocha_table->n, mocha_table->m, mocha_table->a);
+                mocha_table->a[mocha_table->n - 1] = mocha;
+                for (int j = a; j <= b; j++) {
+                    // TODO add other stuff here, like setting ldev
+                    // and bdev
+                    lrr[j] = NAN; // do not use the data again
+                    baf[j] = NAN; // do not use the data again
                 }
+                running_median_mask(&lrr_median, a, b + 1);
             }
         }
     }
 
-    float *hs_arr = NULL;
-    int n_hs = 0, m_hs = 0;
+    float *hs_arr = worker->hs_arr;
+    int n_hs = 0, m_hs = worker->m_hs;
     for (int hmm_model = 0; hmm_model < 2; hmm_model++) {
         // select data to use from the contig, depending on which HMM model is being
         // used
@@ -1627,30 +2513,39 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
         }
         int8_t *path;
         float ret;
-        int *beg = NULL, m_beg = 0, *end = NULL, m_end = 0, nseg;
+        int *beg = worker->beg, m_beg = worker->m_beg, *end = worker->end, m_end = worker->m_end, nseg;
+        size_t mark = arena_mark(arena);
         do {
             if (n_hs + (hmm_model == LRR_BAF ? n_hs : 0) > 50) error("Too many states being tested for the HMM\n");
 
+            double t0 = bench_clock(), c0 = bench_cpu_clock(0);
             float *emis_log_lkl;
             if (model->flags & WGS_DATA) {
                 emis_log_lkl =
                     hmm_model == LRR_BAF
                         ? lrr_ad_emis_log_lkl(lrr, ad0, ad1, n_imap, imap_arr, model->err_log_prb, model->lrr_bias,
-                                              model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, hs_arr, n_hs)
+                                              model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, hs_arr, n_hs,
+                                              beta_binom_null, beta_binom_alt, arena)
                         : ad_phase_emis_log_lkl(ad0, ad1, gt_phase, n_imap, imap_arr, model->err_log_prb,
-                                                self->stats.dispersion, hs_arr, n_hs);
+                                                self->stats.dispersion, hs_arr, n_hs, beta_binom_null, beta_binom_alt,
+                                                arena);
             } else {
                 emis_log_lkl = hmm_model == LRR_BAF
                                    ? lrr_baf_emis_log_lkl(lrr, baf, n_imap, imap_arr, model->err_log_prb,
                                                           model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd,
-                                                          self->stats.dispersion, hs_arr, n_hs)
+                                                          self->stats.dispersion, hs_arr, n_hs, arena)
                                    : baf_phase_emis_log_lkl(baf, gt_phase, n_imap, imap_arr, model->err_log_prb,
-                                                            self->stats.dispersion, hs_arr, n_hs);
+                                                            self->stats.dispersion, hs_arr, n_hs, arena);
             }
+            double t1 = bench_clock(), c1 = bench_cpu_clock(0);
             path = log_viterbi_run(emis_log_lkl, n_imap, n_hs + (hmm_model == LRR_BAF ? n_hs : 0), model->xy_log_prb,
                                    hmm_model == LRR_BAF ? NAN : model->flip_log_prb, tel_log_prb, model->cen_log_prb,
-                                   last_p, first_q);
-            free(emis_log_lkl);
+                                   last_p, first_q, worker->viterbi_team, arena);
+            double t2 = bench_clock(), c2 = bench_cpu_clock(0);
+            worker->times.wall[BENCH_EMISSION] += t1 - t0;
+            worker->times.wall[BENCH_VITERBI] += t2 - t1;
+            worker->times.cpu[BENCH_EMISSION] += c1 - c0;
+            worker->times.cpu[BENCH_VITERBI] += c2 - c1;
 
             if (hmm_model == LRR_BAF)
                 for (int i = 0; i < n_imap; i++)
@@ -1660,7 +2555,7 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
             if (ret) // two consecutive hidden states were used, hinting that
                      // testing of a middle state might be necessary
             {
-                free(path);
+                arena_release(arena, mark);
                 n_hs++;
                 if (middle && ret < 0.0f) middle++;
                 hts_expand(float, n_hs, m_hs, hs_arr);
@@ -1670,6 +2565,7 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
         } while (ret);
 
         // loop through all the segments called by the Viterbi algorithm
+        double t0 = bench_clock(), c0 = bench_cpu_clock(0);
         for (int i = 0; i < nseg; i++) {
             // compute edges of the call
             int a = imap_arr[beg[i]];
@@ -1678,18 +2574,21 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
             int b = imap_arr[end[i]];
             if (end[i] == n_imap - 1)
                 while (b < n - 1 && ldev[b + 1] == 0 && bdev[b + 1] == 0) b++; // extend call towards q telomere
-            mocha.ldev = get_median(lrr + a, b + 1 - a, NULL);
-            get_mocha_stats(pos, lrr, baf, gt_phase, n, a, b, cen_beg, cen_end, length, self->stats.baf_conc, &mocha);
-
-            double f(double x, void *data) {
-                if (model->flags & WGS_DATA)
-                    return -lrr_ad_lod(lrr + a, ad0 + a, ad1 + a, mocha.n_sites, NULL, model->err_log_prb,
-                                       model->lrr_bias, model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, x);
-                else
-                    return -lrr_baf_lod(lrr + a, baf + a, mocha.n_sites, NULL, model->err_log_prb, model->lrr_bias,
-                                        model->lrr_hap2dip, self->adjlrr_sd, self->stats.dispersion, x);
-            }
-            double x, fx = kmin_brent(f, -0.15, 0.15, NULL, KMIN_EPS, &x);
+            mocha.ldev = running_median_get(&lrr_median, a, b + 1, median_buf);
+            get_mocha_stats(pos, lrr, baf, gt_phase, n, a, b, cen_beg, cen_end, length, self->stats.baf_conc, &mocha,
+                            arena);
+
+            segment_t seg;
+            segment_init(&seg, lrr + a, baf + a, ad0 ? ad0 + a : NULL, ad1 ? ad1 + a : NULL, NULL, NULL,
+                         mocha.n_sites, NULL);
+            seg.err_log_prb = model->err_log_prb;
+            seg.lrr_bias = model->lrr_bias;
+            seg.lrr_hap2dip = model->lrr_hap2dip;
+            seg.lrr_sd = self->adjlrr_sd;
+            seg.baf_sd = self->stats.dispersion;
+            seg.beta_binom_null = beta_binom_null;
+            seg.beta_binom_alt = beta_binom_alt;
+            double x, fx = brent_min(model->flags & WGS_DATA ? lrr_ad_lod_f : lrr_baf_lod_f, -0.15, 0.15, &seg, &x);
             mocha.lod_lrr_baf = -(float)fx;
 
             if (hmm_model == LRR_BAF) {
@@ -1706,26 +2605,24 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
                     mocha.lod_baf_phase =
                         compare_wgs_models(ad0, ad1, gt_phase, n_hets_imap, hets_imap_arr, model->xy_log_prb,
                                            model->err_log_prb, model->flip_log_prb, tel_log_prb, self->stats.dispersion,
-                                           model->bdev_baf_phase, model->bdev_baf_phase_n);
+                                           model->bdev_baf_phase, model->bdev_baf_phase_n, beta_binom_null,
+                                           beta_binom_alt, arena);
                 } else {
                     mocha.lod_baf_phase =
                         compare_models(baf, gt_phase, n_hets_imap, hets_imap_arr, model->xy_log_prb, model->err_log_prb,
                                        model->flip_log_prb, tel_log_prb, self->stats.dispersion, model->bdev_baf_phase,
-                                       model->bdev_baf_phase_n);
+                                       model->bdev_baf_phase_n, arena);
                 }
                 if (mocha.lod_baf_phase > mocha.lod_lrr_baf) continue;
 
                 // compute bdev, if possible
                 if (n_hets_imap > 0) {
-                    double f(double x, void *data) {
-                        if (model->flags & WGS_DATA)
-                            return -ad_lod(ad0, ad1, n_hets_imap, hets_imap_arr, model->err_log_prb,
-                                           self->stats.dispersion, x);
-                        else
-                            return -baf_lod(baf, n_hets_imap, hets_imap_arr, model->err_log_prb, self->stats.dispersion,
-                                            x);
-                    }
-                    fx = kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x);
+                    if (model->flags & WGS_DATA)
+                        fx = ad_lod_max(ad0, ad1, NULL, NULL, n_hets_imap, hets_imap_arr, model->err_log_prb,
+                                        self->stats.dispersion, beta_binom_null, beta_binom_alt, 0.1, 0.2, &x, arena);
+                    else
+                        fx = baf_lod_max(baf, NULL, NULL, n_hets_imap, hets_imap_arr, model->err_log_prb,
+                                         self->stats.dispersion, 0.1, 0.2, &x, arena);
                     mocha.bdev = fabsf((float)x);
                 } else
                     mocha.bdev = NAN;
@@ -1738,15 +2635,14 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
                 for (int j = beg[i]; j < end[i]; j++)
                     if (path[j] != path[j + 1]) mocha.n_flips++;
 
-                double f(double x, void *data) {
-                    if (model->flags & WGS_DATA)
-                        return -ad_phase_lod(ad0, ad1, gt_phase, mocha.n_hets, imap_arr + beg[i], path + beg[i],
-                                             model->err_log_prb, self->stats.dispersion, x);
-                    else
-                        return -baf_phase_lod(baf, gt_phase, mocha.n_hets, imap_arr + beg[i], path + beg[i],
-                                              model->err_log_prb, self->stats.dispersion, x);
-                }
-                double x, fx = kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x);
+                double x, fx;
+                if (model->flags & WGS_DATA)
+                    fx = ad_lod_max(ad0, ad1, gt_phase, path + beg[i], mocha.n_hets, imap_arr + beg[i],
+                                    model->err_log_prb, self->stats.dispersion, beta_binom_null, beta_binom_alt, 0.1,
+                                    0.2, &x, arena);
+                else
+                    fx = baf_lod_max(baf, gt_phase, path + beg[i], mocha.n_hets, imap_arr + beg[i],
+                                     model->err_log_prb, self->stats.dispersion, 0.1, 0.2, &x, arena);
                 mocha.bdev = fabsf((float)x);
                 mocha.lod_baf_phase = -(float)fx + (float)mocha.n_flips * model->flip_log_prb * (float)M_LOG10E;
 
@@ -1773,26 +2669,24 @@ static void sample_run(sample_t *self, mocha_table_t *mocha_table, const model_t
                 lrr[j] = NAN; // do not use the data again
                 baf[j] = NAN; // do not use the data again
             }
+            running_median_mask(&lrr_median, a, b + 1);
         }
-        free(path);
-        free(beg);
-        free(end);
+        worker->times.wall[BENCH_LOD] += bench_clock() - t0;
+        worker->times.cpu[BENCH_LOD] += bench_cpu_clock(0) - c0;
+        arena_release(arena, mark);
+        worker->beg = beg;
+        worker->m_beg = m_beg;
+        worker->end = end;
+        worker->m_end = m_end;
     }
 
-    // clean up
-    free(hs_arr);
-    free(imap_arr);
-    free(hets_imap_arr);
-    free(pbaf_arr);
-    free(pos);
-    free(lrr);
-    free(baf);
+    // clean up, the scratch arrays are released when the arena is reset
+    running_median_destroy(&lrr_median);
+    worker->hs_arr = hs_arr;
+    worker->m_hs = m_hs;
     memcpy(self->data_arr[LDEV], ldev, n * sizeof(int16_t));
     memcpy(self->data_arr[BDEV], bdev, n * sizeof(int16_t));
     memcpy(self->phase_arr, bdev_phase, n * sizeof(int8_t));
-    free(ldev);
-    free(bdev);
-    free(bdev_phase);
 }
 
 // computes the medoid contig for LRR regression
@@ -1849,8 +2743,14 @@ static float get_lrr_cutoff(const float *v, int n) {
     return cutoff;
 }
 
+// median of the LRR values, counting the original int16_t values when the LRR values were not derived from coverage
+static inline float sample_lrr_median(const float *lrr, const int16_t *lrr16, int n, const int *imap, worker_t *worker,
+                                      float *w) {
+    return lrr16 ? get_median_int16_buf(lrr16, n, imap, worker->median_hist, w) : get_median_buf(lrr, n, imap, w);
+}
+
 // this function computes several contig stats and then clears the contig data from the sample
-static void sample_stats(sample_t *self, const model_t *model) {
+static void sample_stats(sample_t *self, worker_t *worker, const model_t *model) {
     int n = self->n;
     if (n == 0) return;
     self->n_sites += n;
@@ -1859,38 +2759,36 @@ static void sample_stats(sample_t *self, const model_t *model) {
 
     int16_t *ad0 = self->data_arr[AD0];
     int16_t *ad1 = self->data_arr[AD1];
-    float *lrr = (float *)malloc(n * sizeof(float));
-    float *baf = (float *)malloc(n * sizeof(float));
+    arena_t *arena = &worker->arena;
+    float *lrr = (float *)arena_alloc(arena, n * sizeof(float));
+    float *baf = (float *)arena_alloc(arena, n * sizeof(float));
+    float *median_buf = (float *)arena_alloc(arena, n * sizeof(float));
+    const int16_t *lrr16 = model->flags & WGS_DATA ? NULL : self->data_arr[LRR];
     if (model->flags & WGS_DATA) {
-        ad_to_lrr_baf(ad0, ad1, lrr, baf, n);
+        ad_to_lrr_baf(ad0, ad1, lrr, baf, n, worker);
     } else {
         for (int i = 0; i < n; i++) {
             lrr[i] = int16_to_float(self->data_arr[LRR][i]);
             baf[i] = int16_to_float(self->data_arr[BAF][i]);
         }
     }
-    int *imap_arr = (int *)malloc(n * sizeof(int));
+    int *imap_arr = (int *)arena_alloc(arena, n * sizeof(int));
 
     if (model->rid == model->genome_rules->x_rid) {
         int n_imap = 0;
         for (int i = 0; i < n; i++) {
             if (!isnan(baf[i])) self->n_hets++;
-            int pos = model->locus_arr[self->vcf_imap_arr[i]].pos;
-            if (pos > model->genome_rules->x_nonpar_beg && pos < model->genome_rules->x_nonpar_end
-                && (pos < model->genome_rules->x_xtr_beg || pos > model->genome_rules->x_xtr_end)) {
+            int region = model->locus_arr[self->vcf_imap_arr[i]].region;
+            if ((region & (REGION_NONPAR | REGION_XTR)) == REGION_NONPAR) {
                 if (!isnan(baf[i])) self->x_nonpar_n_hets++;
                 n_imap++;
                 imap_arr[n_imap - 1] = i;
             }
         }
-        self->x_nonpar_lrr_median = get_median(lrr, n_imap, imap_arr);
+        self->x_nonpar_lrr_median = sample_lrr_median(lrr, lrr16, n_imap, imap_arr, worker, median_buf);
 
         if (model->flags & WGS_DATA) {
-            double f(double x, void *data) { return -lod_lkl_beta_binomial(ad0, ad1, n_imap, imap_arr, x); }
-            double x;
-            kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS,
-                       &x); // dispersions above 0.5 are not allowed
-            self->x_nonpar_dispersion = (float)x;
+            self->x_nonpar_dispersion = get_ad_dispersion(ad0, ad1, n_imap, imap_arr, worker->beta_binom_null, arena);
         } else {
             self->x_nonpar_dispersion = get_sample_sd(baf, n_imap, imap_arr);
         }
@@ -1898,32 +2796,29 @@ static void sample_stats(sample_t *self, const model_t *model) {
         int n_imap = 0;
         for (int i = 0; i < n; i++) {
             if (!isnan(baf[i])) self->n_hets++;
-            int pos = model->locus_arr[self->vcf_imap_arr[i]].pos;
-            if (pos > model->genome_rules->y_nonpar_beg && pos < model->genome_rules->y_nonpar_end
-                && (pos < model->genome_rules->y_xtr_beg || pos > model->genome_rules->y_xtr_end)) {
+            int region = model->locus_arr[self->vcf_imap_arr[i]].region;
+            if ((region & (REGION_NONPAR | REGION_XTR)) == REGION_NONPAR) {
                 n_imap++;
                 imap_arr[n_imap - 1] = i;
             }
         }
-        self->y_nonpar_lrr_median = get_median(lrr, n_imap, imap_arr);
+        self->y_nonpar_lrr_median = sample_lrr_median(lrr, lrr16, n_imap, imap_arr, worker, median_buf);
     } else if (model->rid == model->genome_rules->mt_rid) {
-        self->mt_lrr_median = get_median(lrr, n, NULL);
+        self->mt_lrr_median = sample_lrr_median(lrr, lrr16, n, NULL, worker, median_buf);
     } else {
         // expand arrays if necessary
         self->n_stats++;
         hts_expand(stats_t, self->n_stats, self->m_stats, self->stats_arr);
 
         if (model->flags & WGS_DATA) {
-            double f(double x, void *data) { return -lod_lkl_beta_binomial(ad0, ad1, n, NULL, x); }
-            double x;
-            kmin_brent(f, 0.1, 0.2, NULL, KMIN_EPS, &x); // dispersions above 0.5 are not allowed
-            self->stats_arr[self->n_stats - 1].dispersion = (float)x;
+            self->stats_arr[self->n_stats - 1].dispersion =
+                get_ad_dispersion(ad0, ad1, n, NULL, worker->beta_binom_null, arena);
         } else {
             self->stats_arr[self->n_stats - 1].dispersion = get_sample_sd(baf, n, NULL);
         }
         for (int i = 0; i < n; i++)
             if (!isnan(baf[i])) self->n_hets++;
-        self->stats_arr[self->n_stats - 1].lrr_median = get_median(lrr, n, NULL);
+        self->stats_arr[self->n_stats - 1].lrr_median = sample_lrr_median(lrr, lrr16, n, NULL, worker, median_buf);
         self->stats_arr[self->n_stats - 1].lrr_sd = get_sample_sd(lrr, n, NULL);
 
         int conc, disc;
@@ -1938,20 +2833,17 @@ static void sample_stats(sample_t *self, const model_t *model) {
             if (ret < 0) error("Polynomial regression failed\n");
             adjust_lrr(lrr, model->gc_arr, n, self->vcf_imap_arr, self->stats_arr[self->n_stats - 1].coeffs,
                        model->lrr_gc_order);
-            self->stats_arr[self->n_stats - 1].coeffs[0] += get_median(lrr, n, NULL); // further adjusts by median
+            self->stats_arr[self->n_stats - 1].coeffs[0] +=
+                get_median_buf(lrr, n, NULL, median_buf); // further adjusts by median
             float rss = get_tss(lrr, n);
             self->stats_arr[self->n_stats - 1].lrr_gc_rel_ess = 1.0f - rss / tss;
         } else if (model->lrr_gc_order != -1) {
-            self->stats_arr[self->n_stats - 1].coeffs[0] = get_median(lrr, n, NULL);
+            self->stats_arr[self->n_stats - 1].coeffs[0] = get_median_buf(lrr, n, NULL, median_buf);
             self->stats_arr[self->n_stats - 1].lrr_gc_rel_ess = NAN;
         }
         // compute autocorrelation after GC correction
         self->stats_arr[self->n_stats - 1].lrr_auto = get_lrr_auto_corr(lrr, n, NULL);
     }
-
-    free(lrr);
-    free(baf);
-    free(imap_arr);
 }
 
 // this function computes the median of contig stats
@@ -2050,6 +2942,7 @@ static void mocha_print_stats(FILE *restrict stream, const sample_t *self, int n
     for (int j = 0; j <= lrr_gc_order; j++) fprintf(stream, "\tlrr_gc_%d", j);
     fputc('\n', stream);
     for (int i = 0; i < n; i++) {
+        if (self[i].keep_calls) continue;
         fputs(bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, self[i].idx), stream);
         fprintf(stream, "\t%c", gender[self[i].computed_gender]);
         fprintf(stream, "\t%.4f",
@@ -2075,6 +2968,384 @@ static void mocha_print_stats(FILE *restrict stream, const sample_t *self, int n
     if (stream != stdout && stream != stderr) fclose(stream);
 }
 
+// loads the statistics written by mocha_print_stats() so that samples can be called again without reading the
+// whole genome, the columns are found by name and every sample being called must be present
+#define STATS_N_COLS 16
+static void mocha_parse_stats(sample_t *self, int n, const bcf_hdr_t *hdr, const char *fname, int lrr_gc_order,
+                              int flags) {
+    const char *names[STATS_N_COLS] = {"computed_gender",
+                                       "call_rate",
+                                       flags & WGS_DATA ? "cov_median" : "lrr_median",
+                                       flags & WGS_DATA ? "cov_sd" : "lrr_sd",
+                                       flags & WGS_DATA ? "cov_auto" : "lrr_auto",
+                                       flags & WGS_DATA ? "baf_corr" : "baf_sd",
+                                       "baf_conc",
+                                       "baf_auto",
+                                       "n_sites",
+                                       "n_hets",
+                                       "x_nonpar_n_hets",
+                                       "x_nonpar_baf_corr",
+                                       flags & WGS_DATA ? "x_nonpar_cov_median" : "x_nonpar_lrr_median",
+                                       flags & WGS_DATA ? "y_nonpar_cov_median" : "y_nonpar_lrr_median",
+                                       flags & WGS_DATA ? "mt_cov_median" : "mt_lrr_median",
+                                       "lrr_gc_rel_ess"};
+    int cols[STATS_N_COLS + MAX_ORDER + 1];
+    int n_cols = STATS_N_COLS + (lrr_gc_order < 0 ? 0 : lrr_gc_order + 1);
+
+    htsFile *fp = hts_open(fname, "r");
+    if (!fp) error("Could not read: %s\n", fname);
+    kstring_t str = {0, 0, NULL}, tmp_str = {0, 0, NULL};
+    if (hts_getline(fp, KS_SEP_LINE, &str) <= 0) error("Empty file: %s\n", fname);
+    int moff = 0, *off = NULL;
+    int ncols = ksplit_core(str.s, '\t', &moff, &off);
+    for (int k = 0; k < n_cols; k++) {
+        tmp_str.l = 0;
+        if (k < STATS_N_COLS)
+            kputs(names[k], &tmp_str);
+        else
+            ksprintf(&tmp_str, "lrr_gc_%d", k - STATS_N_COLS);
+        cols[k] = -1;
+        for (int j = 1; j < ncols; j++)
+            if (strcmp(&str.s[off[j]], tmp_str.s) == 0) cols[k] = j;
+        if (cols[k] < 0) error("Error: genome statistics file %s has no %s column\n", fname, tmp_str.s);
+    }
+
+    int8_t *loaded = (int8_t *)calloc(n, sizeof(int8_t));
+    while (hts_getline(fp, KS_SEP_LINE, &str) >= 0) {
+        ncols = ksplit_core(str.s, '\t', &moff, &off);
+        int idx = bcf_hdr_id2int(hdr, BCF_DT_SAMPLE, &str.s[off[0]]);
+        if (idx < 0) continue;
+        for (int k = 0; k < n_cols; k++)
+            if (cols[k] >= ncols) error("Could not parse genome statistics file %s: %s\n", fname, &str.s[off[0]]);
+        float v[STATS_N_COLS + MAX_ORDER + 1];
+        for (int k = 1; k < n_cols; k++) v[k] = strtof(&str.s[off[cols[k]]], NULL);
+        sample_t *sample = &self[idx];
+        switch (toupper(str.s[off[cols[0]]])) {
+        case 'M':
+            sample->computed_gender = GENDER_MALE;
+            break;
+        case 'F':
+            sample->computed_gender = GENDER_FEMALE;
+            break;
+        default:
+            sample->computed_gender = GENDER_UNKNOWN;
+        }
+        sample->call_rate = v[1];
+        sample->stats.lrr_median = flags & WGS_DATA ? logf(v[2]) : v[2];
+        sample->stats.lrr_sd = flags & WGS_DATA ? v[3] / v[2] : v[3];
+        sample->stats.lrr_auto = v[4];
+        sample->stats.dispersion = v[5];
+        sample->stats.baf_conc = v[6];
+        sample->stats.baf_auto = v[7];
+        sample->n_sites = (int)v[8];
+        sample->n_hets = (int)v[9];
+        sample->x_nonpar_n_hets = (int)v[10];
+        sample->x_nonpar_dispersion = v[11];
+        sample->x_nonpar_lrr_median = flags & WGS_DATA ? logf(v[12]) : v[12];
+        sample->y_nonpar_lrr_median = flags & WGS_DATA ? logf(v[13]) : v[13];
+        sample->mt_lrr_median = flags & WGS_DATA ? logf(v[14]) : v[14];
+        sample->stats.lrr_gc_rel_ess = v[15];
+        for (int k = STATS_N_COLS; k < n_cols; k++) sample->stats.coeffs[k - STATS_N_COLS] = v[k];
+        // as computed by sample_summary()
+        sample->adjlrr_sd = sample->stats.lrr_sd;
+        if (lrr_gc_order > 0) sample->adjlrr_sd *= sqrtf(1.0f - sample->stats.lrr_gc_rel_ess);
+        loaded[idx] = 1;
+    }
+    for (int i = 0; i < n; i++)
+        if (!loaded[self[i].idx])
+            error("Error: sample %s missing from genome statistics file %s\n",
+                  bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, self[i].idx), fname);
+
+    free(loaded);
+    free(off);
+    free(str.s);
+    free(tmp_str.s);
+    if (hts_close(fp) < 0) error("Close failed: %s\n", fname);
+}
+
+// flags the samples listed in the first column of a genome statistics file
+static int8_t *mocha_parse_samples(const bcf_hdr_t *hdr, const char *fname) {
+    htsFile *fp = hts_open(fname, "r");
+    if (!fp) error("Could not read: %s\n", fname);
+    int8_t *listed = (int8_t *)calloc(bcf_hdr_nsamples(hdr), sizeof(int8_t));
+    kstring_t str = {0, 0, NULL};
+    while (hts_getline(fp, KS_SEP_LINE, &str) >= 0) {
+        char *tab = strchr(str.s, '\t');
+        if (tab) *tab = '\0';
+        int idx = bcf_hdr_id2int(hdr, BCF_DT_SAMPLE, str.s);
+        if (idx >= 0) listed[idx] = 1;
+    }
+    free(str.s);
+    if (hts_close(fp) < 0) error("Close failed: %s\n", fname);
+    return listed;
+}
+
+/*********************************
+ * WORKER POOL METHODS           *
+ *********************************/
+
+#define BETA_BINOM_CACHE_SIZE 256 // number of (p, rho) pairs whose tables are kept
+
+struct _pool_t {
+    sample_t *sample;
+    int n;
+    const model_t *model;
+    const char *chr; // name of the contig being processed, used to query the CNP regions
+    int stats;       // whether to run sample_stats() rather than sample_run()
+    cnp_region_t *cnp_arr; // CNP regions of the contig being processed
+    int n_cnp, m_cnp;
+    int next;        // index of the next sample to be claimed by a worker
+    worker_t *workers;
+    int n_workers;
+    beta_binom_cache_t *beta_binom_cache; // tables shared by the workers
+    hts_tpool *tpool; // threads of the workers, separate from those decoding and encoding the VCF files
+    hts_tpool_process *q;
+};
+
+// the workers do not share the threads of the readers and of the writer, as with --pipeline these decode and encode the
+// neighboring contigs while a contig is called, and long-running worker jobs would hold all their threads
+static void pool_init(pool_t *self, sample_t *sample, int n, const model_t *model, int n_threads) {
+    memset(self, 0, sizeof(pool_t));
+    self->sample = sample;
+    self->n = n;
+    self->model = model;
+    self->n_workers = 1;
+    // the threads are shared between the samples and the windows of the Viterbi algorithm, one window per thread
+    int n_windows = model->viterbi_windows > 1 ? model->viterbi_windows : 1;
+    int n_helpers = 0;
+    if (n_threads > 0) {
+        self->n_workers = n_threads / n_windows > 0 ? n_threads / n_windows : 1;
+        n_helpers = n_threads / self->n_workers - 1 < n_windows - 1 ? n_threads / self->n_workers - 1 : n_windows - 1;
+        self->tpool = hts_tpool_init(self->n_workers);
+        if (!self->tpool) error("Failed to create the worker threads\n");
+        self->q = hts_tpool_process_init(self->tpool, 2 * self->n_workers, 1);
+        if (!self->q) error("Failed to create the worker queue\n");
+    }
+    self->beta_binom_cache = beta_binom_cache_init(BETA_BINOM_CACHE_SIZE);
+    self->workers = (worker_t *)calloc(self->n_workers, sizeof(worker_t));
+    for (int i = 0; i < self->n_workers; i++) {
+        worker_t *worker = &self->workers[i];
+        worker->pool = self;
+        worker->beta_binom_null = beta_binom_init();
+        worker->beta_binom_alt = beta_binom_init();
+        beta_binom_use_cache(worker->beta_binom_null, self->beta_binom_cache);
+        beta_binom_use_cache(worker->beta_binom_alt, self->beta_binom_cache);
+        worker->median_hist = (int *)calloc(MEDIAN_HIST_SIZE, sizeof(int));
+        if (n_helpers > 0) worker->viterbi_team = viterbi_team_init(n_helpers);
+    }
+}
+
+static void pool_destroy(pool_t *self) {
+    for (int i = 0; i < self->n_workers; i++) {
+        worker_t *worker = &self->workers[i];
+        beta_binom_destroy(worker->beta_binom_null);
+        beta_binom_destroy(worker->beta_binom_alt);
+        if (worker->viterbi_team) viterbi_team_destroy(worker->viterbi_team);
+        free(worker->logf_arr);
+        arena_destroy(&worker->arena);
+        free(worker->hs_arr);
+        free(worker->median_hist);
+        free(worker->beg);
+        free(worker->end);
+        free(worker->mocha_table.a);
+        sample_free_sites(&worker->sites);
+        free(worker->bitmap);
+    }
+    free(self->workers);
+    free(self->cnp_arr);
+    beta_binom_cache_destroy(self->beta_binom_cache);
+    if (self->q) hts_tpool_process_destroy(self->q);
+    if (self->tpool) hts_tpool_destroy(self->tpool);
+}
+
+// defined with the contig cache methods
+static void sample_unpack(sample_t *self, worker_t *worker);
+
+static void pool_process_sample(pool_t *self, worker_t *worker, int j) {
+    const model_t *model = self->model;
+    sample_t *sample = self->sample + j;
+    int unpack = sample->packed && (self->stats || !sample->keep_calls);
+    double c0 = bench_cpu_clock(0);
+    int64_t n_brent_eval = thread_n_brent_eval, n_viterbi_sites = thread_n_viterbi_sites;
+    arena_reset(&worker->arena);
+    if (unpack) sample_unpack(sample, worker);
+    if (self->stats) {
+        sample_stats(sample, worker, model);
+    } else if (!sample->keep_calls) {
+        sample_run(sample, worker, model);
+    }
+    if (unpack) sample_swap_sites(sample, &worker->sites); // the arrays go back to the worker
+    worker->times.cpu[self->stats ? BENCH_STATS : BENCH_CALLS] += bench_cpu_clock(0) - c0;
+    worker->times.n_brent_eval += thread_n_brent_eval - n_brent_eval;
+    worker->times.n_viterbi_sites += thread_n_viterbi_sites - n_viterbi_sites;
+}
+
+// samples are claimed one at a time so that workers stay busy when samples take uneven time
+static void *pool_worker(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    pool_t *pool = worker->pool;
+    int j;
+    while ((j = __sync_fetch_and_add(&pool->next, 1)) < pool->n) pool_process_sample(pool, worker, j);
+    return NULL;
+}
+
+static void pool_run(pool_t *self, int stats) {
+    self->stats = stats;
+    self->next = 0;
+    // the CNP regions are resolved to records once per contig rather than once per sample
+    self->n_cnp = 0;
+    if (!stats && self->model->cnp_idx)
+        self->n_cnp = get_cnp_regions(self->model->cnp_idx, self->chr, self->model, &self->cnp_arr, &self->m_cnp);
+    for (int i = 0; i < self->n_workers; i++) {
+        self->workers[i].cnp_arr = self->cnp_arr;
+        self->workers[i].n_cnp = self->n_cnp;
+    }
+    if (!self->q) {
+        pool_worker(self->workers);
+        return;
+    }
+    for (int i = 0; i < self->n_workers; i++)
+        if (hts_tpool_dispatch(self->tpool, self->q, pool_worker, &self->workers[i]) < 0)
+            error("Failed to dispatch the worker jobs\n");
+    if (hts_tpool_process_flush(self->q) < 0) error("Failed to wait for the worker jobs\n");
+}
+
+static void stage_times_add(stage_times_t *self, const stage_times_t *times) {
+    for (int k = 0; k < BENCH_N; k++) {
+        self->wall[k] += times->wall[k];
+        self->cpu[k] += times->cpu[k];
+    }
+    self->n_sites += times->n_sites;
+    self->n_site_samples += times->n_site_samples;
+    self->n_brent_eval += times->n_brent_eval;
+    self->n_viterbi_sites += times->n_viterbi_sites;
+    self->n_bytes += times->n_bytes;
+}
+
+// stages run by the main thread are charged the CPU time of the whole process, including the htslib threads
+static inline void stage_times_stop(stage_times_t *self, int stage, double t0, double c0) {
+    self->wall[stage] += bench_clock() - t0;
+    self->cpu[stage] += bench_cpu_clock(1) - c0;
+}
+
+// moves the time spent by the workers into the stage times
+static void pool_take_times(pool_t *self, stage_times_t *times) {
+    for (int i = 0; i < self->n_workers; i++) {
+        stage_times_add(times, &self->workers[i].times);
+        memset(&self->workers[i].times, 0, sizeof(stage_times_t));
+    }
+}
+
+// moves the calls from the workers into the table in sample order so that the output does not depend on scheduling
+static void pool_merge(pool_t *self, mocha_table_t *mocha_table) {
+    int *k = (int *)calloc(self->n_workers, sizeof(int));
+    while (1) {
+        int w = -1;
+        for (int i = 0; i < self->n_workers; i++) {
+            const mocha_table_t *shard = &self->workers[i].mocha_table;
+            if (k[i] < shard->n
+                && (w < 0 || shard->a[k[i]].sample_idx < self->workers[w].mocha_table.a[k[w]].sample_idx))
+                w = i;
+        }
+        if (w < 0) break;
+        const mocha_table_t *shard = &self->workers[w].mocha_table;
+        int sample_idx = shard->a[k[w]].sample_idx;
+        while (k[w] < shard->n && shard->a[k[w]].sample_idx == sample_idx) {
+            mocha_table->n++;
+            hts_expand(mocha_t, mocha_table->n, mocha_table->m, mocha_table->a);
+            mocha_table->a[mocha_table->n - 1] = shard->a[k[w]++];
+        }
+    }
+    for (int i = 0; i < self->n_workers; i++) self->workers[i].mocha_table.n = 0;
+    free(k);
+}
+
+/*********************************
+ * ADJUSTMENT FILE METHODS       *
+ *********************************/
+
+// with array data the cluster adjustments depend on the whole cohort, so they can be exported to a sites-only file
+// by a run including all samples and then loaded by runs including only a subset of the samples
+static bcf_hdr_t *adjust_hdr_init(htsFile *fh, bcf_hdr_t *hdr, float lrr_cutoff) {
+    bcf_hdr_t *adjust_hdr = bcf_hdr_subset(hdr, 0, NULL, NULL);
+    if (bcf_hdr_id2int(adjust_hdr, BCF_DT_ID, "ADJ_COEFF") < 0)
+        bcf_hdr_append(adjust_hdr,
+                       "##INFO=<ID=ADJ_COEFF,Number=9,Type=Float,Description=\"Adjust coefficients "
+                       "(order=AA_BAF0,AA_BAF1,AA_LRR0,AB_BAF0,AB_BAF1,AB_LRR0,BB_BAF0,BB_BAF1,BB_LRR0)"
+                       "\">");
+    if (!isnan(lrr_cutoff)) bcf_hdr_printf(adjust_hdr, "##mocha_LRR_cutoff=%.4f", lrr_cutoff);
+    if (bcf_hdr_write(fh, adjust_hdr) < 0) error("Unable to write the header of the adjustment file\n");
+    return adjust_hdr;
+}
+
+static void adjust_put(htsFile *fh, const bcf_hdr_t *adjust_hdr, bcf1_t *rec, bcf1_t *line, const float *coeffs) {
+    bcf_unpack(line, BCF_UN_STR);
+    bcf_clear(rec);
+    rec->rid = line->rid;
+    rec->pos = line->pos;
+    bcf_update_alleles(adjust_hdr, rec, (const char **)line->d.allele, line->n_allele);
+    bcf_update_info_float(adjust_hdr, rec, "ADJ_COEFF", coeffs, 9);
+    if (bcf_write(fh, (bcf_hdr_t *)adjust_hdr, rec) < 0) error("Unable to write to the adjustment file\n");
+}
+
+static adjust_table_t *adjust_table_load(const char *fname, const bcf_hdr_t *hdr) {
+    htsFile *fp = hts_open(fname, "r");
+    if (!fp) error("Could not read: %s\n", fname);
+    bcf_hdr_t *adjust_hdr = bcf_hdr_read(fp);
+    if (!adjust_hdr) error("Could not read the header of: %s\n", fname);
+    if (bcf_hdr_id2int(adjust_hdr, BCF_DT_ID, "ADJ_COEFF") < 0)
+        error("Error: adjustment file %s has no ADJ_COEFF info field\n", fname);
+
+    adjust_table_t *self = (adjust_table_t *)calloc(1, sizeof(adjust_table_t));
+    self->n_ctg = hdr->n[BCF_DT_CTG];
+    self->a = (adjust_contig_t *)calloc(self->n_ctg, sizeof(adjust_contig_t));
+    self->lrr_cutoff = NAN;
+    bcf_hrec_t *hrec = bcf_hdr_get_hrec(adjust_hdr, BCF_HL_GEN, "mocha_LRR_cutoff", NULL, NULL);
+    if (hrec) self->lrr_cutoff = strtof(hrec->value, NULL);
+
+    bcf1_t *rec = bcf_init();
+    float *coeffs = NULL;
+    int m_coeffs = 0;
+    while (bcf_read(fp, adjust_hdr, rec) >= 0) {
+        int rid = bcf_hdr_name2id(hdr, bcf_hdr_id2name(adjust_hdr, rec->rid));
+        if (rid < 0) continue;
+        if (bcf_get_info_float(adjust_hdr, rec, "ADJ_COEFF", &coeffs, &m_coeffs) != 9)
+            error("Error: ADJ_COEFF missing at position %s:%" PRId64 " in %s\n", bcf_hdr_id2name(hdr, rid),
+                  rec->pos + 1, fname);
+        adjust_contig_t *contig = &self->a[rid];
+        if (contig->n > 0 && contig->pos[contig->n - 1] > rec->pos + 1)
+            error("Error: adjustment file %s is not sorted at position %s:%" PRId64 "\n", fname,
+                  bcf_hdr_id2name(hdr, rid), rec->pos + 1);
+        contig->n++;
+        hts_expand(int, contig->n, contig->m_pos, contig->pos);
+        hts_expand(float, 9 * contig->n, contig->m_coeffs, contig->coeffs);
+        contig->pos[contig->n - 1] = rec->pos + 1;
+        memcpy(contig->coeffs + 9 * (contig->n - 1), coeffs, 9 * sizeof(float));
+    }
+    free(coeffs);
+    bcf_destroy(rec);
+    bcf_hdr_destroy(adjust_hdr);
+    if (hts_close(fp) < 0) error("Close failed: %s\n", fname);
+    return self;
+}
+
+// sites are matched in order, so that records at the same position are matched as they were exported
+static const float *adjust_table_get(const adjust_table_t *self, int rid, int pos, int *k) {
+    const adjust_contig_t *contig = &self->a[rid];
+    while (*k < contig->n && contig->pos[*k] < pos) (*k)++;
+    if (*k == contig->n || contig->pos[*k] != pos) return NULL;
+    return contig->coeffs + 9 * (*k)++;
+}
+
+static void adjust_table_destroy(adjust_table_t *self) {
+    for (int rid = 0; rid < self->n_ctg; rid++) {
+        free(self->a[rid].pos);
+        free(self->a[rid].coeffs);
+    }
+    free(self->a);
+    free(self);
+}
+
 /*********************************
  * VCF READ AND WRITE METHODS    *
  *********************************/
@@ -2086,7 +3357,50 @@ static inline int bcf_sr_next_line_reader0(bcf_srs_t *sr) {
     return nret;
 }
 
-// write one contig
+// adds sample j to the samples whose annotations change at record r, the events are either counted, if events is
+// NULL, or stored in the buckets starting at off[r]
+static inline void put_contig_event(int *off, int *events, int n_locus, int r, int j) {
+    if (r >= n_locus) return;
+    if (events)
+        events[off[r]++] = j;
+    else
+        off[r + 1]++;
+}
+
+static void put_contig_events(const sample_t *sample, int nsmpl, int n_locus, int *off, int *events) {
+    for (int j = 0; j < nsmpl; j++) {
+        const int *imap = sample[j].vcf_imap_arr;
+        int n = sample[j].n;
+        if (n == 0) continue;
+        if (imap[0] > 0) put_contig_event(off, events, n_locus, 0, j);
+        for (int k = 0; k < n; k++) {
+            put_contig_event(off, events, n_locus, imap[k], j);
+            if (k == n - 1 || imap[k + 1] > imap[k] + 1) put_contig_event(off, events, n_locus, imap[k] + 1, j);
+        }
+    }
+}
+
+// updates the annotations of a sample at record i
+static inline void put_contig_sample(const sample_t *self, int i, int *iter, float *ldev, float *bdev, int *phase) {
+    while (*iter < self->n - 1 && self->vcf_imap_arr[*iter] < i) (*iter)++;
+    if (self->vcf_imap_arr[*iter] == i) {
+        if (self->data_arr[LDEV]) *ldev = int16_to_float(self->data_arr[LDEV][*iter]);
+        if (self->data_arr[BDEV]) *bdev = int16_to_float(self->data_arr[BDEV][*iter]);
+        if (self->phase_arr) *phase = self->phase_arr[*iter];
+    } else {
+        // if no match variant found, match the end of the contig or
+        // keep conservative
+        if (i == 0 && self->data_arr[BDEV]) *bdev = int16_to_float(self->data_arr[BDEV][0]);
+        if (i == 0 && self->data_arr[LDEV]) *ldev = int16_to_float(self->data_arr[LDEV][0]);
+        if (self->data_arr[BDEV] && int16_to_float(self->data_arr[BDEV][*iter]) == 0.0f) *bdev = 0.0f;
+        if (self->data_arr[LDEV] && int16_to_float(self->data_arr[LDEV][*iter]) == 0.0f) *ldev = 0.0f;
+        if (self->phase_arr) *phase = 0;
+    }
+}
+
+// write one contig, the annotations of a sample only change at the first record, at its sites, and at the records
+// following its sites, so the samples to update at each record are bucketed in advance and the values of the other
+// samples are carried over from the previous record
 static int put_contig(bcf_srs_t *sr, const sample_t *sample, const model_t *model, htsFile *out_fh,
                       bcf_hdr_t *out_hdr) {
     int rid = model->rid;
@@ -2099,35 +3413,25 @@ static int put_contig(bcf_srs_t *sr, const sample_t *sample, const model_t *mode
     float *ldev = (float *)calloc(nsmpl, sizeof(float));
     int *bdev_phase = (int *)calloc(nsmpl, sizeof(int));
 
+    int n_locus = model->n_locus;
+    int *event_off = (int *)calloc(n_locus + 1, sizeof(int));
+    put_contig_events(sample, nsmpl, n_locus, event_off, NULL);
+    for (int r = 0; r < n_locus; r++) event_off[r + 1] += event_off[r];
+    int *events = (int *)malloc((event_off[n_locus] + 1) * sizeof(int));
+    put_contig_events(sample, nsmpl, n_locus, event_off, events); // event_off[r] now ends the bucket of record r
+
     int i;
     for (i = 0; bcf_sr_next_line_reader0(sr); i++) {
         bcf1_t *line = bcf_sr_get_line(sr, 0);
         if (rid != line->rid) break;
 
-        for (int j = 0; j < nsmpl; j++) {
-            while (synced_iter[j] < sample[j].n - 1 && sample[j].vcf_imap_arr[synced_iter[j]] < i) synced_iter[j]++;
-            if (sample[j].vcf_imap_arr[synced_iter[j]] == i) {
-                if (sample[j].data_arr[LDEV])
-                    ldev[sample[j].idx] = int16_to_float(sample[j].data_arr[LDEV][synced_iter[j]]);
-                if (sample[j].data_arr[BDEV])
-                    bdev[sample[j].idx] = int16_to_float(sample[j].data_arr[BDEV][synced_iter[j]]);
-                if (sample[j].phase_arr) bdev_phase[sample[j].idx] = sample[j].phase_arr[synced_iter[j]];
-            } else {
-                // if no match variant found, match the end of the contig or
-                // keep conservative
-                if (i == 0 && sample[j].data_arr[BDEV])
-                    bdev[sample[j].idx] = int16_to_float(sample[j].data_arr[BDEV][0]);
-                if (i == 0 && sample[j].data_arr[LDEV])
-                    ldev[sample[j].idx] = int16_to_float(sample[j].data_arr[LDEV][0]);
-                if (sample[j].data_arr[BDEV] && int16_to_float(sample[j].data_arr[BDEV][synced_iter[j]]) == 0.0f)
-                    bdev[sample[j].idx] = 0.0f;
-                if (sample[j].data_arr[LDEV] && int16_to_float(sample[j].data_arr[LDEV][synced_iter[j]]) == 0.0f)
-                    ldev[sample[j].idx] = 0.0f;
-                if (sample[j].phase_arr) bdev_phase[sample[j].idx] = 0;
-            }
+        for (int e = i == 0 ? 0 : event_off[i - 1]; i < n_locus && e < event_off[i]; e++) {
+            int j = events[e];
+            int idx = sample[j].idx;
+            put_contig_sample(&sample[j], i, &synced_iter[j], &ldev[idx], &bdev[idx], &bdev_phase[idx]);
         }
         if (!(model->flags & WGS_DATA)) {
-            bcf_update_info_float(out_hdr, line, "ADJ_COEFF", model->locus_arr[i].adjust, 9);
+            bcf_update_info_float(out_hdr, line, "ADJ_COEFF", model->adjust_arr + 9 * i, 9);
         }
         if (!(model->flags & NO_ANNOT)) {
             bcf_update_format_float(out_hdr, line, "Ldev", ldev, (int)nsmpl);
@@ -2142,6 +3446,8 @@ static int put_contig(bcf_srs_t *sr, const sample_t *sample, const model_t *mode
     free(ldev);
     free(bdev);
     free(bdev_phase);
+    free(event_off);
+    free(events);
 
     return i;
 }
@@ -2218,6 +3524,263 @@ static int bcf_get_ab_genotypes(bcf_fmt_t *fmt, int8_t *gts, int nsmpl, int alle
     return 1;
 }
 
+// sites are collected site-major in a tile of consecutive records and then copied into the per-sample arrays one
+// sample at a time, so that each sample's arrays are written sequentially rather than once per record
+#define TILE_BYTES (1 << 24)
+#define TILE_MAX_SITES 4096
+
+typedef struct {
+    int n, m;       // number of sites in the tile and maximum number of sites
+    int nsmpl;
+    int *vcf_idx;   // index of the site in the contig
+    int *pos;       // position of the site
+    int16_t *data0; // AD0 or LRR, site-major
+    int16_t *data1; // AD1 or BAF, site-major
+    int8_t *phase;  // site-major
+    uint8_t *keep;  // whether the sample has data at the site, site-major
+} site_tile_t;
+
+static void site_tile_init(site_tile_t *tile, int nsmpl) {
+    tile->n = 0;
+    tile->nsmpl = nsmpl;
+    tile->m = nsmpl > 0 ? TILE_BYTES / (nsmpl * (2 * sizeof(int16_t) + sizeof(int8_t) + sizeof(uint8_t))) : 1;
+    if (tile->m < 1) tile->m = 1;
+    if (tile->m > TILE_MAX_SITES) tile->m = TILE_MAX_SITES;
+    size_t size = (size_t)tile->m * nsmpl;
+    tile->vcf_idx = (int *)malloc(tile->m * sizeof(int));
+    tile->pos = (int *)malloc(tile->m * sizeof(int));
+    tile->data0 = (int16_t *)malloc(size * sizeof(int16_t));
+    tile->data1 = (int16_t *)malloc(size * sizeof(int16_t));
+    tile->phase = (int8_t *)malloc(size * sizeof(int8_t));
+    tile->keep = (uint8_t *)malloc(size * sizeof(uint8_t));
+}
+
+static void site_tile_destroy(site_tile_t *tile) {
+    free(tile->vcf_idx);
+    free(tile->pos);
+    free(tile->data0);
+    free(tile->data1);
+    free(tile->phase);
+    free(tile->keep);
+}
+
+// appends the sites in the tile to the per-sample arrays and empties the tile
+static void site_tile_flush(site_tile_t *tile, sample_t *sample, const model_t *model, int *last_het_pos,
+                            int *last_pos) {
+    int nsmpl = tile->nsmpl;
+    for (int j = 0; j < nsmpl; j++) {
+        int n = sample[j].n + tile->n;
+        hts_expand(int, n, sample[j].m_vcf_imap, sample[j].vcf_imap_arr);
+        hts_expand(int8_t, n, sample[j].m_phase, sample[j].phase_arr);
+        hts_expand(int16_t, n, sample[j].m_data[0], sample[j].data_arr[0]);
+        hts_expand(int16_t, n, sample[j].m_data[1], sample[j].data_arr[1]);
+        int *vcf_imap = sample[j].vcf_imap_arr;
+        int8_t *phase_arr = sample[j].phase_arr;
+        int16_t *data0 = sample[j].data_arr[0];
+        int16_t *data1 = sample[j].data_arr[1];
+        n = sample[j].n;
+        for (int k = 0; k < tile->n; k++) {
+            size_t idx = (size_t)k * nsmpl + j;
+            if (!tile->keep[idx]) continue;
+            int8_t phase = tile->phase[idx];
+            if (model->flags & WGS_DATA) {
+                int pos = tile->pos[k];
+                // site too close to last het site or hom site too close to last site
+                if ((pos < last_het_pos[j] + model->min_dst)
+                    || ((phase == bcf_int8_missing || phase == bcf_int8_vector_end)
+                        && (pos < last_pos[j] + model->min_dst)))
+                    continue;
+
+                // substitute the last hom site with the current het site
+                if (pos < last_pos[j] + model->min_dst) n--;
+
+                if (phase != bcf_int8_missing || phase == bcf_int8_vector_end) last_het_pos[j] = pos;
+                last_pos[j] = pos;
+            }
+            vcf_imap[n] = tile->vcf_idx[k];
+            phase_arr[n] = phase;
+            data0[n] = tile->data0[idx];
+            data1[n] = tile->data1[idx];
+            n++;
+        }
+        sample[j].n = n;
+    }
+    tile->n = 0;
+}
+
+// number of records of the contig according to the index, or 0 if not available
+static int get_contig_n_records(bcf_srs_t *sr, int rid) {
+    bcf_sr_t *reader = bcf_sr_get_reader(sr, 0);
+    uint64_t mapped, unmapped;
+    if (reader->bcf_idx) {
+        if (hts_idx_get_stat(reader->bcf_idx, rid, &mapped, &unmapped) < 0) return 0;
+    } else if (reader->tbx_idx) {
+        int tid = tbx_name2id(reader->tbx_idx, bcf_hdr_id2name(reader->header, rid));
+        if (tid < 0 || hts_idx_get_stat(reader->tbx_idx->idx, tid, &mapped, &unmapped) < 0) return 0;
+    } else {
+        return 0;
+    }
+    return mapped > INT_MAX ? INT_MAX : (int)mapped;
+}
+
+// samples of a site gathered by genotype, with room for all the samples in each of the three genotypes
+typedef struct {
+    int *idx;
+    float *lrr, *baf;
+    float *median_buf;
+} site_adjust_buf_t;
+
+static void site_adjust_buf_init(site_adjust_buf_t *self, int nsmpl) {
+    self->idx = (int *)malloc(3 * nsmpl * sizeof(int));
+    self->lrr = (float *)malloc(3 * nsmpl * sizeof(float));
+    self->baf = (float *)malloc(3 * nsmpl * sizeof(float));
+    self->median_buf = (float *)malloc(nsmpl * sizeof(float));
+}
+
+static void site_adjust_buf_destroy(site_adjust_buf_t *self) {
+    free(self->idx);
+    free(self->lrr);
+    free(self->baf);
+    free(self->median_buf);
+}
+
+// adjust cluster centers and slopes, inspired by
+// (i) Staaf, J. et al. Normalization of Illumina Infinium whole-genome
+// SNP data improves copy number estimates and allelic intensity ratios.
+// BMC Bioinformatics 9, 409 (2008) & (ii) Mayrhofer, M., Viklund, B. &
+// Isaksson, A. Rawcopy: Improved copy number analysis with Affymetrix
+// arrays. Sci Rep 6, 36158 (2016)
+// the samples are split by genotype in a single sweep into contiguous copies, which the statistics and the shifts are
+// computed on in the same order as on the record, so that the 3x3 shifts stored in adjust are unchanged
+static void adjust_site(float *lrr, float *baf, const int8_t *gts, const sample_t *sample, int nsmpl,
+                        const model_t *model, const float *coeffs, int is_x_nonpar, int is_y_or_mt, int flip,
+                        float *adjust, site_adjust_buf_t *buf) {
+    int k[3] = {0, 0, 0};
+    for (int j = 0; j < nsmpl; j++) {
+        int idx = sample[j].idx;
+        if (bcf_float_is_missing(lrr[idx])) lrr[idx] = NAN;
+        if (bcf_float_is_missing(baf[idx])) baf[idx] = NAN;
+        int gt = gts[idx];
+        if (is_y_or_mt || gt < GT_AA || gt > GT_BB) continue;
+        if (is_x_nonpar && sample[j].computed_gender == GENDER_MALE) continue;
+        int l = (gt - 1) * nsmpl + k[gt - 1]++;
+        buf->idx[l] = idx;
+        buf->lrr[l] = lrr[idx];
+        buf->baf[l] = baf[idx];
+    }
+
+    for (int gt = GT_AA; gt <= GT_BB; gt++) {
+        if (is_y_or_mt) continue;
+        int n = k[gt - 1];
+        const int *idx = buf->idx + (gt - 1) * nsmpl;
+        float *x = buf->lrr + (gt - 1) * nsmpl;
+        float *y = buf->baf + (gt - 1) * nsmpl;
+        float baf_b = 0.0f, baf_m = 0.0f, lrr_b = 0.0f;
+        if (coeffs) {
+            // shifts computed from the whole cohort by the run that exported them
+            baf_b = coeffs[3 * (gt - 1)];
+            baf_m = coeffs[3 * (gt - 1) + 1];
+            lrr_b = coeffs[3 * (gt - 1) + 2];
+            for (int j = 0; j < n; j++) {
+                if (baf_m != 0.0f) y[j] -= baf_m * x[j];
+                y[j] -= baf_b;
+                x[j] -= lrr_b;
+            }
+        }
+        if (!coeffs && model->regress_baf_lrr != -1 && model->regress_baf_lrr <= n) {
+            float xss = 0.0f, yss = 0.0f, xyss = 0.0f;
+            get_cov(x, y, n, NULL, &xss, &yss, &xyss);
+            baf_m = xyss / xss;
+            for (int j = 0; j < n; j++) y[j] -= baf_m * x[j];
+        }
+        if (!coeffs && model->adj_baf_lrr != -1 && n >= model->adj_baf_lrr) {
+            baf_b = get_median_buf(y, n, NULL, buf->median_buf) - (float)(gt - 1) * 0.5f;
+            if (isnan(baf_b)) baf_b = 0.0f;
+            for (int j = 0; j < n; j++) y[j] -= baf_b;
+            lrr_b = get_median_buf(x, n, NULL, buf->median_buf);
+            if (isnan(lrr_b)) lrr_b = 0.0f;
+            for (int j = 0; j < n; j++) x[j] -= lrr_b;
+        }
+        for (int j = 0; j < n; j++) {
+            lrr[idx[j]] = x[j];
+            baf[idx[j]] = y[j];
+        }
+        adjust[3 * (gt - 1)] = baf_b;
+        adjust[3 * (gt - 1) + 1] = baf_m;
+        adjust[3 * (gt - 1) + 2] = lrr_b;
+    }
+
+    for (int j = 0; j < nsmpl; j++) {
+        int idx = sample[j].idx;
+        int is_male_x_nonpar = is_x_nonpar && sample[j].computed_gender == GENDER_MALE;
+        // corrects males on X nonPAR
+        if (is_male_x_nonpar && gts[idx] >= GT_AA && gts[idx] <= GT_BB) {
+            const float *shifts = adjust + 3 * (gts[idx] - 1);
+            baf[idx] -= shifts[1] * lrr[idx] + shifts[0];
+            lrr[idx] -= shifts[2];
+        }
+        // if allele A index is bigger than allele B index flip the BAF to make
+        // sure it refers to the highest allele
+        if (flip) baf[idx] = 1.0f - baf[idx];
+        if (gts[j] != GT_AB || is_male_x_nonpar || is_y_or_mt) baf[idx] = NAN;
+    }
+}
+
+// records for each sample the largest change of the shifts of its genotype clusters from those of a previous run
+static void adjust_change_update(sample_t *sample, int nsmpl, const int8_t *gts, const float *adjust,
+                                 const float *prev) {
+    float change[3];
+    for (int gt = GT_AA; gt <= GT_BB; gt++) {
+        change[gt - 1] = 0.0f;
+        for (int k = 3 * (gt - 1); k < 3 * gt; k++)
+            if (change[gt - 1] < fabsf(adjust[k] - prev[k])) change[gt - 1] = fabsf(adjust[k] - prev[k]);
+    }
+    for (int j = 0; j < nsmpl; j++) {
+        int gt = gts[sample[j].idx];
+        if (gt < GT_AA || gt > GT_BB) continue;
+        if (sample[j].adjust_change < change[gt - 1]) sample[j].adjust_change = change[gt - 1];
+    }
+}
+
+// boundaries of the regions of a contig, so that classifying a site requires no lookup in the genome rules
+typedef struct {
+    int short_arm_end;
+    int cen_beg, cen_end;
+    int nonpar_beg, nonpar_end;
+    int xtr_beg, xtr_end;
+    int flags; // REGION_* flags shared by all sites of the contig
+} region_rules_t;
+
+static void region_rules_init(region_rules_t *self, const genome_rules_t *genome_rules, int rid) {
+    self->short_arm_end = genome_rules->is_short_arm[rid] ? genome_rules->cen_beg[rid] : 0;
+    self->cen_beg = genome_rules->cen_beg[rid];
+    self->cen_end = genome_rules->cen_end[rid];
+    self->nonpar_beg = self->nonpar_end = 0;
+    self->xtr_beg = 1;
+    self->xtr_end = 0;
+    if (rid == genome_rules->x_rid) {
+        self->nonpar_beg = genome_rules->x_nonpar_beg;
+        self->nonpar_end = genome_rules->x_nonpar_end;
+        self->xtr_beg = genome_rules->x_xtr_beg;
+        self->xtr_end = genome_rules->x_xtr_end;
+    } else if (rid == genome_rules->y_rid) {
+        self->nonpar_beg = genome_rules->y_nonpar_beg;
+        self->nonpar_end = genome_rules->y_nonpar_end;
+        self->xtr_beg = genome_rules->y_xtr_beg;
+        self->xtr_end = genome_rules->y_xtr_end;
+    }
+    self->flags = rid == genome_rules->y_rid || rid == genome_rules->mt_rid ? REGION_NO_BAF : 0;
+}
+
+static inline int region_rules_get(const region_rules_t *self, int pos) {
+    int region = self->flags;
+    if (pos < self->short_arm_end) region |= REGION_SHORT_ARM;
+    if (pos > self->cen_beg && pos < self->cen_end) region |= REGION_CEN;
+    if (pos > self->nonpar_beg && pos < self->nonpar_end) region |= REGION_NONPAR;
+    if (pos >= self->xtr_beg && pos <= self->xtr_end) region |= REGION_XTR;
+    return region;
+}
+
 // read one contig
 static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
     int rid = model->rid;
@@ -2227,6 +3790,7 @@ static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
     bcf_fmt_t *baf_fmt = NULL, *lrr_fmt = NULL;
     bcf_info_t *info;
     int nsmpl = bcf_hdr_nsamples(hdr);
+    model->n_bytes = 0;
 
     int i;
     int allele_a_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "ALLELE_A");
@@ -2266,31 +3830,67 @@ static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
     }
 
     model->n = 0;
+    model->n_locus = 0;
     model->n_flipped = 0;
     for (int j = 0; j < nsmpl; j++) sample[j].n = 0;
 
+    // with WGS data only the sites of a block of samples are kept
+    int beg = 0, end = nsmpl;
+    if (model->flags & WGS_DATA) {
+        beg = model->block_beg;
+        end = model->block_end;
+    }
+
     if (!(model->flags & USE_NO_RULES_CHRS) && model->genome_rules->cen_beg[rid] == 0
         && model->genome_rules->cen_end[rid] == 0 && rid != model->genome_rules->mt_rid)
         return;
 
+    region_rules_t region_rules;
+    region_rules_init(&region_rules, model->genome_rules, rid);
     int8_t *gts = (int8_t *)malloc(nsmpl * sizeof(int8_t));
     int8_t *phase_arr = (int8_t *)malloc(nsmpl * sizeof(int8_t));
-    int *imap_arr = (int *)malloc(nsmpl * sizeof(int));
+    site_adjust_buf_t adjust_buf;
+    site_adjust_buf_init(&adjust_buf, nsmpl);
     int16_t *gt0 = (int16_t *)malloc(nsmpl * sizeof(int16_t));
     int16_t *gt1 = (int16_t *)malloc(nsmpl * sizeof(int16_t));
     int16_t *ad0 = (int16_t *)malloc(nsmpl * sizeof(int16_t));
     int16_t *ad1 = (int16_t *)malloc(nsmpl * sizeof(int16_t));
     int *last_het_pos = (int *)calloc(nsmpl, sizeof(int));
     int *last_pos = (int *)calloc(nsmpl, sizeof(int));
+    site_tile_t tile;
+    site_tile_init(&tile, end - beg);
+    int adjust_k = 0, prev_adjust_k = 0;
+    bcf1_t *adjust_rec = model->adjust_fh ? bcf_init() : NULL;
+
+    // size the arrays from the number of records in the index rather than growing them one record at a time
+    int n_records = get_contig_n_records(sr, rid);
+    if (n_records > 0) {
+        hts_expand(locus_t, n_records, model->m_locus, model->locus_arr);
+        if (!(model->flags & WGS_DATA)) hts_expand(float, 9 * n_records, model->m_adjust, model->adjust_arr);
+        hts_expand(float, n_records, model->m_gc, model->gc_arr);
+        // with WGS data most sites are dropped by the minimum distance filter so the arrays are grown as needed
+        if (!(model->flags & WGS_DATA)) {
+            for (int j = 0; j < nsmpl; j++) {
+                hts_expand(int, n_records, sample[j].m_vcf_imap, sample[j].vcf_imap_arr);
+                hts_expand(int8_t, n_records, sample[j].m_phase, sample[j].phase_arr);
+                hts_expand(int16_t, n_records, sample[j].m_data[LRR], sample[j].data_arr[LRR]);
+                hts_expand(int16_t, n_records, sample[j].m_data[BAF], sample[j].data_arr[BAF]);
+            }
+        }
+    }
 
     for (i = 0; bcf_sr_next_line_reader0(sr); i++) {
         bcf1_t *line = bcf_sr_get_line(sr, 0);
         if (rid != line->rid) break;
         int pos = line->pos + 1;
+        model->n_bytes += (int64_t)(line->shared.l + line->indiv.l);
 
         hts_expand(locus_t, i + 1, model->m_locus, model->locus_arr);
+        if (!(model->flags & WGS_DATA)) hts_expand(float, 9 * (i + 1), model->m_adjust, model->adjust_arr);
 
         model->locus_arr[i].pos = pos;
+        int region = model->locus_arr[i].region = region_rules_get(&region_rules, pos);
+        if (!(model->flags & WGS_DATA)) memset(model->adjust_arr + 9 * i, 0, 9 * sizeof(float));
 
         hts_expand(float, i + 1, model->m_gc, model->gc_arr);
         if (gc_id >= 0 && (info = bcf_get_info_id(line, gc_id)))
@@ -2303,12 +3903,8 @@ static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
         if ((model->flags & FLT_INCLUDE) && !bcf_sr_get_line(sr, 1)) continue;
 
         // if site falls in short arm or centromere regions skip line
-        if (!(model->flags & USE_SHORT_ARMS) && model->genome_rules->is_short_arm[rid]
-            && pos < model->genome_rules->cen_beg[rid])
-            continue;
-        if (!(model->flags & USE_CENTROMERES) && pos > model->genome_rules->cen_beg[rid]
-            && pos < model->genome_rules->cen_end[rid])
-            continue;
+        if (!(model->flags & USE_SHORT_ARMS) && (region & REGION_SHORT_ARM)) continue;
+        if (!(model->flags & USE_CENTROMERES) && (region & REGION_CEN)) continue;
 
         bcf_fmt_t *gt_fmt = bcf_get_fmt_id(line, gt_id);
         if (!bcf_get_genotype_phase(gt_fmt, phase_arr, nsmpl)) continue;
@@ -2338,123 +3934,61 @@ static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
 
             if (!(lrr_fmt = bcf_get_fmt_id(line, lrr_id)) || !(baf_fmt = bcf_get_fmt_id(line, baf_id))) continue;
 
-            for (int j = 0; j < nsmpl; j++) {
-                if (bcf_float_is_missing(((float *)lrr_fmt->p)[sample[j].idx]))
-                    ((float *)lrr_fmt->p)[sample[j].idx] = NAN;
-                if (bcf_float_is_missing(((float *)baf_fmt->p)[sample[j].idx]))
-                    ((float *)baf_fmt->p)[sample[j].idx] = NAN;
-            }
-
-            int is_x_nonpar = rid == model->genome_rules->x_rid && pos > model->genome_rules->x_nonpar_beg
-                              && pos < model->genome_rules->x_nonpar_end
-                              && (pos < model->genome_rules->x_xtr_beg || pos > model->genome_rules->x_xtr_end);
-            int is_y_or_mt = rid == model->genome_rules->y_rid || rid == model->genome_rules->mt_rid;
-
-            // adjust cluster centers and slopes, inspired by
-            // (i) Staaf, J. et al. Normalization of Illumina Infinium whole-genome
-            // SNP data improves copy number estimates and allelic intensity ratios.
-            // BMC Bioinformatics 9, 409 (2008) & (ii) Mayrhofer, M., Viklund, B. &
-            // Isaksson, A. Rawcopy: Improved copy number analysis with Affymetrix
-            // arrays. Sci Rep 6, 36158 (2016)
-            for (int gt = GT_AA; gt <= GT_BB; gt++) {
-                if (is_y_or_mt) continue;
-                int k = 0;
-                for (int j = 0; j < nsmpl; j++) {
-                    if (is_x_nonpar && sample[j].computed_gender == GENDER_MALE) continue;
-                    if (gts[sample[j].idx] == gt) imap_arr[k++] = sample[j].idx;
-                }
-                float baf_b = 0.0f, baf_m = 0.0f, lrr_b = 0.0f;
-                if (model->regress_baf_lrr != -1 && model->regress_baf_lrr <= k) {
-                    float xss = 0.0f, yss = 0.0f, xyss = 0.0f;
-                    get_cov((float *)lrr_fmt->p, (float *)baf_fmt->p, k, imap_arr, &xss, &yss, &xyss);
-                    baf_m = xyss / xss;
-                    for (int j = 0; j < k; j++)
-                        ((float *)baf_fmt->p)[imap_arr[j]] -= baf_m * ((float *)lrr_fmt->p)[imap_arr[j]];
-                }
-                if (model->adj_baf_lrr != -1 && k >= model->adj_baf_lrr) {
-                    baf_b = get_median((float *)baf_fmt->p, k, imap_arr) - (float)(gt - 1) * 0.5f;
-                    if (isnan(baf_b)) baf_b = 0.0f;
-                    for (int j = 0; j < k; j++) ((float *)baf_fmt->p)[imap_arr[j]] -= baf_b;
-                    lrr_b = get_median((float *)lrr_fmt->p, k, imap_arr);
-                    if (isnan(lrr_b)) lrr_b = 0.0f;
-                    for (int j = 0; j < k; j++) ((float *)lrr_fmt->p)[imap_arr[j]] -= lrr_b;
-                }
-                // corrects males on X nonPAR
-                if (is_x_nonpar) {
-                    for (int j = 0; j < nsmpl; j++) {
-                        if (sample[j].computed_gender != GENDER_MALE) continue;
-                        if (gts[sample[j].idx] == gt) {
-                            ((float *)baf_fmt->p)[sample[j].idx] -=
-                                baf_m * ((float *)lrr_fmt->p)[sample[j].idx] + baf_b;
-                            ((float *)lrr_fmt->p)[sample[j].idx] -= lrr_b;
-                        }
-                    }
-                }
-                model->locus_arr[i].adjust[gt - 1][0] = baf_b;
-                model->locus_arr[i].adjust[gt - 1][1] = baf_m;
-                model->locus_arr[i].adjust[gt - 1][2] = lrr_b;
-            }
-
-            // if allele A index is bigger than allele B index flip the BAF to make
-            // sure it refers to the highest allele
-            if (model->locus_arr[i].allele_a > model->locus_arr[i].allele_b) {
-                for (int j = 0; j < nsmpl; j++)
-                    ((float *)baf_fmt->p)[sample[j].idx] = 1.0f - ((float *)baf_fmt->p)[sample[j].idx];
+            int is_x_nonpar =
+                rid == model->genome_rules->x_rid && (region & (REGION_NONPAR | REGION_XTR)) == REGION_NONPAR;
+            int is_y_or_mt = region & REGION_NO_BAF;
+            const float *coeffs = NULL;
+            if (model->adjust_table && !(coeffs = adjust_table_get(model->adjust_table, rid, pos, &adjust_k)))
+                error("Error: site %s:%" PRId64 " is missing from the adjustment file\n",
+                      bcf_hdr_id2name(hdr, line->rid), line->pos + 1);
+
+            adjust_site((float *)lrr_fmt->p, (float *)baf_fmt->p, gts, sample, nsmpl, model, coeffs, is_x_nonpar,
+                        is_y_or_mt, model->locus_arr[i].allele_a > model->locus_arr[i].allele_b,
+                        model->adjust_arr + 9 * i, &adjust_buf);
+            if (model->prev_adjust_table) {
+                const float *prev = adjust_table_get(model->prev_adjust_table, rid, pos, &prev_adjust_k);
+                if (!prev)
+                    error("Error: site %s:%" PRId64 " is missing from the previous adjustment file\n",
+                          bcf_hdr_id2name(hdr, line->rid), line->pos + 1);
+                adjust_change_update(sample, nsmpl, gts, model->adjust_arr + 9 * i, prev);
             }
-
-            for (int j = 0; j < nsmpl; j++)
-                if (gts[j] != GT_AB || (is_x_nonpar && sample[j].computed_gender == GENDER_MALE) || is_y_or_mt)
-                    ((float *)baf_fmt->p)[sample[j].idx] = NAN;
+            if (model->adjust_fh)
+                adjust_put(model->adjust_fh, model->adjust_hdr, adjust_rec, line, model->adjust_arr + 9 * i);
         }
 
         // read line in memory
         model->n++;
-        for (int j = 0; j < nsmpl; j++) {
-            if (model->flags & WGS_DATA) {
-                if (ad0[j] == bcf_int16_missing && ad1[j] == bcf_int16_missing) continue;
-
-                // site too close to last het site or hom site too close to last site
-                if ((pos < last_het_pos[j] + model->min_dst)
-                    || ((phase_arr[j] == bcf_int8_missing || phase_arr[j] == bcf_int8_vector_end)
-                        && (pos < last_pos[j] + model->min_dst)))
-                    continue;
-
-                // substitute the last hom site with the current het site
-                if (pos < last_pos[j] + model->min_dst) sample[j].n--;
-
-                if (phase_arr[j] != bcf_int8_missing || phase_arr[j] == bcf_int8_vector_end) last_het_pos[j] = pos;
-                last_pos[j] = pos;
-
-                sample[j].n++;
-                hts_expand(int, sample[j].n, sample[j].m_vcf_imap, sample[j].vcf_imap_arr);
-                hts_expand(int8_t, sample[j].n, sample[j].m_phase, sample[j].phase_arr);
-                hts_expand(int16_t, sample[j].n, sample[j].m_data[AD0], sample[j].data_arr[AD0]);
-                hts_expand(int16_t, sample[j].n, sample[j].m_data[AD1], sample[j].data_arr[AD1]);
-                sample[j].vcf_imap_arr[sample[j].n - 1] = i;
-                sample[j].phase_arr[sample[j].n - 1] = phase_arr[j];
-                sample[j].data_arr[AD0][sample[j].n - 1] = ad0[j];
-                sample[j].data_arr[AD1][sample[j].n - 1] = ad1[j];
-
-            } else {
+        int k = tile.n++;
+        tile.vcf_idx[k] = i;
+        tile.pos[k] = pos;
+        int16_t *data0 = tile.data0 + (size_t)k * tile.nsmpl;
+        int16_t *data1 = tile.data1 + (size_t)k * tile.nsmpl;
+        int8_t *phase = tile.phase + (size_t)k * tile.nsmpl;
+        uint8_t *keep = tile.keep + (size_t)k * tile.nsmpl;
+        memcpy(phase, phase_arr + beg, tile.nsmpl * sizeof(int8_t));
+        if (model->flags & WGS_DATA) {
+            memcpy(data0, ad0 + beg, tile.nsmpl * sizeof(int16_t));
+            memcpy(data1, ad1 + beg, tile.nsmpl * sizeof(int16_t));
+            for (int j = beg; j < end; j++)
+                keep[j - beg] = ad0[j] != bcf_int16_missing || ad1[j] != bcf_int16_missing;
+        } else {
+            for (int j = 0; j < nsmpl; j++) {
                 float lrr = ((float *)lrr_fmt->p)[sample[j].idx];
                 float baf = ((float *)baf_fmt->p)[sample[j].idx];
-                if (isnan(lrr) && isnan(baf)) continue;
-
-                sample[j].n++;
-                hts_expand(int, sample[j].n, sample[j].m_vcf_imap, sample[j].vcf_imap_arr);
-                hts_expand(int8_t, sample[j].n, sample[j].m_phase, sample[j].phase_arr);
-                hts_expand(int16_t, sample[j].n, sample[j].m_data[LRR], sample[j].data_arr[LRR]);
-                hts_expand(int16_t, sample[j].n, sample[j].m_data[BAF], sample[j].data_arr[BAF]);
-                sample[j].vcf_imap_arr[sample[j].n - 1] = i;
-                sample[j].phase_arr[sample[j].n - 1] = phase_arr[j];
-                sample[j].data_arr[LRR][sample[j].n - 1] = float_to_int16(lrr);
-                sample[j].data_arr[BAF][sample[j].n - 1] = float_to_int16(baf);
+                keep[j] = !isnan(lrr) || !isnan(baf);
+                data0[j] = float_to_int16(lrr);
+                data1[j] = float_to_int16(baf);
             }
         }
+        if (tile.n == tile.m) site_tile_flush(&tile, sample + beg, model, last_het_pos + beg, last_pos + beg);
     }
+    site_tile_flush(&tile, sample + beg, model, last_het_pos + beg, last_pos + beg);
+    site_tile_destroy(&tile);
+    if (adjust_rec) bcf_destroy(adjust_rec);
+    model->n_locus = i;
     free(gts);
     free(phase_arr);
-    free(imap_arr);
+    site_adjust_buf_destroy(&adjust_buf);
     free(gt0);
     free(gt1);
     free(ad0);
@@ -2463,6 +3997,1138 @@ static void get_contig(bcf_srs_t *sr, sample_t *sample, model_t *model) {
     free(last_pos);
 }
 
+/*********************************
+ * CONTIG CACHE METHODS          *
+ *********************************/
+
+// the sites read from a contig during the first pass are kept, either in memory or in a file, so that the second pass
+// does not need to decode and adjust the VCF records again, the file can also be kept and loaded by a later run
+// only the cache is encoded: get_contig() still fills the full arrays of all the samples, so the peak memory of the
+// first pass is that of the decoded contig, while the passes reading the cache hold one decoded sample per worker
+#define CACHE_MAGIC "MOCHA\x06\x00\x00"
+#define CACHE_FLAGS (FLT_INCLUDE | FLT_EXCLUDE | WGS_DATA | USE_SHORT_ARMS | USE_CENTROMERES | USE_NO_RULES_CHRS)
+
+typedef struct {
+    int rid;
+    char *buf;    // contig data, if kept in memory or mapped
+    size_t size;  // size of the contig data
+    off_t offset; // offset of the contig data, if kept in a file
+} cached_contig_t;
+
+typedef struct {
+    FILE *fp; // file the contigs are written to, NULL if they are kept in memory
+    const char *fname;
+    int persistent; // whether the file is kept at the end of the run
+    char *map;      // read-only mapping of a file written by a previous run
+    size_t map_size;
+    kstring_t str;   // contig being written to memory
+    const char *buf; // contig being read from memory
+    size_t off;
+    int n, m;
+    cached_contig_t *a;
+    int packed;       // whether contig_cache_get() leaves the sites of the samples encoded for the workers
+    char *packed_buf; // contig whose sites are left encoded, when not mapped
+} contig_cache_t;
+
+static contig_cache_t *contig_cache_init(const char *fname, int persistent) {
+    contig_cache_t *self = (contig_cache_t *)calloc(1, sizeof(contig_cache_t));
+    if (fname) {
+        self->fname = fname;
+        self->persistent = persistent;
+        self->fp = fopen(fname, "w+b");
+        if (!self->fp) error("Failed to open %s: %s\n", fname, strerror(errno));
+    }
+    return self;
+}
+
+static void contig_cache_write(contig_cache_t *self, const void *ptr, size_t size) {
+    if (size == 0) return;
+    if (self->fp) {
+        if (fwrite(ptr, 1, size, self->fp) != size) error("Error: failed to write to %s\n", self->fname);
+    } else {
+        if (kputsn((const char *)ptr, size, &self->str) < 0) error("Error: failed to keep the contig in memory\n");
+    }
+}
+
+static void contig_cache_read(contig_cache_t *self, void *ptr, size_t size) {
+    if (size == 0) return;
+    if (self->map || !self->fp) {
+        if (self->map && self->off + size > self->map_size) error("Error: cache file %s is truncated\n", self->fname);
+        memcpy(ptr, self->buf + self->off, size);
+        self->off += size;
+    } else {
+        if (fread(ptr, 1, size, self->fp) != size) error("Error: failed to read from %s\n", self->fname);
+    }
+}
+
+static inline int contig_cache_getc(contig_cache_t *self) {
+    if (self->map && self->off >= self->map_size) error("Error: cache file %s is truncated\n", self->fname);
+    if (self->map || !self->fp) return (uint8_t)self->buf[self->off++];
+    int c = getc(self->fp);
+    if (c == EOF) error("Error: failed to read from %s\n", self->fname);
+    return c;
+}
+
+static void contig_cache_write_str(contig_cache_t *self, const char *str) {
+    int len = str ? strlen(str) : 0;
+    contig_cache_write(self, &len, sizeof(int));
+    contig_cache_write(self, str, len);
+}
+
+static int contig_cache_read_str(contig_cache_t *self, const char *str) {
+    int len;
+    contig_cache_read(self, &len, sizeof(int));
+    if (len < 0 || self->off + len > self->map_size) error("Error: cache file %s is truncated\n", self->fname);
+    int ret = (size_t)len == (str ? strlen(str) : 0) && (len == 0 || memcmp(self->buf + self->off, str, len) == 0);
+    self->off += len;
+    return ret;
+}
+
+static void contig_cache_write_varint(contig_cache_t *self, uint32_t value) {
+    uint8_t tmp[5];
+    int len = 0;
+    do {
+        tmp[len++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0x00);
+        value >>= 7;
+    } while (value);
+    contig_cache_write(self, tmp, len);
+}
+
+static inline uint32_t contig_cache_read_varint(contig_cache_t *self) {
+    uint32_t value = 0;
+    int c, shift = 0;
+    do {
+        c = contig_cache_getc(self);
+        value |= (uint32_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return value;
+}
+
+// record indexes are increasing so they are stored as deltas with a variable length encoding
+static void contig_cache_write_imap(contig_cache_t *self, const int *imap_arr, int n) {
+    for (int i = 0, last = 0; i < n; i++) {
+        contig_cache_write_varint(self, (uint32_t)(imap_arr[i] - last));
+        last = imap_arr[i];
+    }
+}
+
+static void contig_cache_read_imap(contig_cache_t *self, int *imap_arr, int n) {
+    for (int i = 0, last = 0; i < n; i++) {
+        last += (int)contig_cache_read_varint(self);
+        imap_arr[i] = last;
+    }
+}
+
+// homozygous, unphased, and phased heterozygous sites are packed as 2-bit codes, while the few other sites, mostly
+// missing genotypes, are stored afterwards as deltas of their indexes followed by their values
+static inline int phase_to_code(int8_t phase) {
+    switch (phase) {
+    case bcf_int8_vector_end:
+        return 0;
+    case 0:
+        return 1;
+    case 1:
+        return 2;
+    case -1:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+static const int8_t code_to_phase[4] = {bcf_int8_vector_end, 0, 1, -1};
+
+static void contig_cache_write_phase(contig_cache_t *self, const int8_t *phase_arr, int n) {
+    uint8_t tmp[256];
+    int n_other = 0;
+    for (int i = 0; i < n; i += 4 * sizeof(tmp)) {
+        int len = n - i < 4 * (int)sizeof(tmp) ? n - i : 4 * (int)sizeof(tmp);
+        memset(tmp, 0, (len + 3) / 4);
+        for (int k = 0; k < len; k++) {
+            int code = phase_to_code(phase_arr[i + k]);
+            if (code < 0) {
+                n_other++;
+                code = 0;
+            }
+            tmp[k >> 2] |= (uint8_t)(code << (2 * (k & 3)));
+        }
+        contig_cache_write(self, tmp, (len + 3) / 4);
+    }
+    contig_cache_write_varint(self, (uint32_t)n_other);
+    for (int i = 0, last = 0; i < n; i++) {
+        if (phase_to_code(phase_arr[i]) >= 0) continue;
+        contig_cache_write_varint(self, (uint32_t)(i - last));
+        contig_cache_write(self, &phase_arr[i], sizeof(int8_t));
+        last = i;
+    }
+}
+
+static void contig_cache_read_phase(contig_cache_t *self, int8_t *phase_arr, int n) {
+    uint8_t tmp[256];
+    for (int i = 0; i < n; i += 4 * sizeof(tmp)) {
+        int len = n - i < 4 * (int)sizeof(tmp) ? n - i : 4 * (int)sizeof(tmp);
+        contig_cache_read(self, tmp, (len + 3) / 4);
+        for (int k = 0; k < len; k++) phase_arr[i + k] = code_to_phase[(tmp[k >> 2] >> (2 * (k & 3))) & 3];
+    }
+    // the indexes are checked as the file could have been modified since it was written with --write-cache
+    uint32_t n_other = contig_cache_read_varint(self);
+    if (n_other > (uint32_t)n) error("Error: cache file %s is corrupted\n", self->fname);
+    for (int k = 0, last = 0; k < (int)n_other; k++) {
+        uint32_t delta = contig_cache_read_varint(self);
+        if (delta >= (uint32_t)(n - last)) error("Error: cache file %s is corrupted\n", self->fname);
+        last += (int)delta;
+        contig_cache_read(self, &phase_arr[last], sizeof(int8_t));
+    }
+}
+
+// as BAF is missing at homozygous sites, values are stored behind a bitmap of the values that are not missing
+// whenever that takes less space than the values themselves
+static void contig_cache_write_data(contig_cache_t *self, const int16_t *data_arr, int n) {
+    int n_present = 0;
+    for (int i = 0; i < n; i++) n_present += data_arr[i] != bcf_int16_missing;
+    int8_t sparse = (size_t)(n + 7) / 8 + n_present * sizeof(int16_t) < (size_t)n * sizeof(int16_t);
+    contig_cache_write(self, &sparse, sizeof(int8_t));
+    if (!sparse) {
+        contig_cache_write(self, data_arr, n * sizeof(int16_t));
+        return;
+    }
+    uint8_t tmp[256];
+    for (int i = 0; i < n; i += 8 * sizeof(tmp)) {
+        int len = n - i < 8 * (int)sizeof(tmp) ? n - i : 8 * (int)sizeof(tmp);
+        memset(tmp, 0, (len + 7) / 8);
+        for (int k = 0; k < len; k++)
+            if (data_arr[i + k] != bcf_int16_missing) tmp[k >> 3] |= (uint8_t)(1 << (k & 7));
+        contig_cache_write(self, tmp, (len + 7) / 8);
+    }
+    for (int i = 0; i < n; i++)
+        if (data_arr[i] != bcf_int16_missing) contig_cache_write(self, &data_arr[i], sizeof(int16_t));
+}
+
+// the values are read in place at the start of the array and then moved to their sites from the last one
+static void contig_cache_read_data(contig_cache_t *self, int16_t *data_arr, uint8_t **bitmap, int *m_bitmap, int n) {
+    int8_t sparse;
+    contig_cache_read(self, &sparse, sizeof(int8_t));
+    if (!sparse) {
+        contig_cache_read(self, data_arr, n * sizeof(int16_t));
+        return;
+    }
+    hts_expand(uint8_t, (n + 7) / 8, *m_bitmap, *bitmap);
+    contig_cache_read(self, *bitmap, (n + 7) / 8);
+    int n_present = 0;
+    for (int i = 0; i < (n + 7) / 8; i++) n_present += __builtin_popcount((*bitmap)[i]);
+    contig_cache_read(self, data_arr, n_present * sizeof(int16_t));
+    for (int i = n - 1, k = n_present - 1; i >= 0; i--)
+        data_arr[i] = ((*bitmap)[i >> 3] >> (i & 7)) & 1 ? data_arr[k--] : bcf_int16_missing;
+}
+
+// moves past the sites of a sample without decoding them, the contig must be read from memory
+static void contig_cache_skip_sites(contig_cache_t *self, int n, size_t size) {
+    self->off += (size_t)(n + 3) / 4;
+    uint32_t n_other = contig_cache_read_varint(self);
+    if (n_other > (uint32_t)n) error("Error: cache file %s is corrupted\n", self->fname);
+    for (int k = 0, last = 0; k < (int)n_other; k++) {
+        uint32_t delta = contig_cache_read_varint(self);
+        if (delta >= (uint32_t)(n - last)) error("Error: cache file %s is corrupted\n", self->fname);
+        last += (int)delta;
+        self->off += sizeof(int8_t);
+    }
+    for (int k = 0; k < 2; k++) {
+        int8_t sparse = (int8_t)contig_cache_getc(self);
+        if (!sparse) {
+            self->off += (size_t)n * sizeof(int16_t);
+            continue;
+        }
+        if (self->off + (n + 7) / 8 > size) error("Error: cache file %s is truncated\n", self->fname);
+        int n_present = 0;
+        for (int i = 0; i < (n + 7) / 8; i++) n_present += __builtin_popcount((uint8_t)self->buf[self->off + i]);
+        self->off += (size_t)(n + 7) / 8 + n_present * sizeof(int16_t);
+    }
+    for (int i = 0; i < n; i++) contig_cache_read_varint(self);
+    if (self->off > size) error("Error: cache file %s is truncated\n", self->fname);
+}
+
+// files are identified by their size and modification time, as the same file can be reached from different paths,
+// -1 is written for the standard input, for missing files, and for targets given as regions
+static void contig_cache_write_stat(contig_cache_t *self, const char *fname) {
+    struct stat st;
+    int64_t size = -1, mtime = -1;
+    if (fname && strcmp(fname, "-") && stat(fname, &st) == 0) {
+        size = (int64_t)st.st_size;
+        mtime = (int64_t)st.st_mtime;
+    }
+    contig_cache_write(self, &size, sizeof(int64_t));
+    contig_cache_write(self, &mtime, sizeof(int64_t));
+}
+
+static int contig_cache_read_stat(contig_cache_t *self, const char *fname) {
+    struct stat st;
+    int64_t size = -1, mtime = -1, cached_size, cached_mtime;
+    if (fname && strcmp(fname, "-") && stat(fname, &st) == 0) {
+        size = (int64_t)st.st_size;
+        mtime = (int64_t)st.st_mtime;
+    }
+    contig_cache_read(self, &cached_size, sizeof(int64_t));
+    contig_cache_read(self, &cached_mtime, sizeof(int64_t));
+    return cached_size == size && cached_mtime == mtime;
+}
+
+// parameters that change how get_contig() reads and adjusts the sites, and the files the sites were read from
+static void contig_cache_write_header(contig_cache_t *self, const bcf_hdr_t *hdr, const sample_t *sample, int nsmpl,
+                                      const model_t *model, const char *rules, int cache_x, const char *input_fname,
+                                      const char *filter_fname, const char *apply_filters, const char *targets_list) {
+    int flags = model->flags & CACHE_FLAGS;
+    contig_cache_write(self, CACHE_MAGIC, 8);
+    contig_cache_write(self, &flags, sizeof(int));
+    contig_cache_write(self, &model->min_dst, sizeof(int));
+    contig_cache_write(self, &model->adj_baf_lrr, sizeof(int));
+    contig_cache_write(self, &model->regress_baf_lrr, sizeof(int));
+    contig_cache_write_str(self, rules);
+    contig_cache_write_stat(self, input_fname);
+    contig_cache_write_str(self, filter_fname);
+    contig_cache_write_stat(self, filter_fname);
+    contig_cache_write_str(self, apply_filters);
+    contig_cache_write_str(self, targets_list);
+    contig_cache_write_stat(self, targets_list);
+    int n_ctg = hdr->n[BCF_DT_CTG];
+    contig_cache_write(self, &n_ctg, sizeof(int));
+    for (int rid = 0; rid < n_ctg; rid++) contig_cache_write_str(self, bcf_hdr_id2name(hdr, rid));
+    contig_cache_write(self, &cache_x, sizeof(int));
+    contig_cache_write(self, &nsmpl, sizeof(int));
+    for (int j = 0; j < nsmpl; j++) {
+        int8_t gender = (int8_t)sample[j].computed_gender;
+        contig_cache_write_str(self, bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, sample[j].idx));
+        contig_cache_write(self, &gender, sizeof(int8_t));
+    }
+}
+
+// the index of the contigs is written at the end of the file
+static void contig_cache_destroy(contig_cache_t *self, const bcf_hdr_t *hdr) {
+    if (self->fp && self->persistent) {
+        if (fseeko(self->fp, 0, SEEK_END) < 0) error("Error: failed to seek in %s\n", self->fname);
+        int64_t index_offset = (int64_t)ftello(self->fp);
+        contig_cache_write(self, &self->n, sizeof(int));
+        for (int k = 0; k < self->n; k++) {
+            int64_t offset = (int64_t)self->a[k].offset, size = (int64_t)self->a[k].size;
+            contig_cache_write_str(self, bcf_hdr_id2name(hdr, self->a[k].rid));
+            contig_cache_write(self, &offset, sizeof(int64_t));
+            contig_cache_write(self, &size, sizeof(int64_t));
+        }
+        contig_cache_write(self, &index_offset, sizeof(int64_t));
+    }
+    if (!self->map)
+        for (int k = 0; k < self->n; k++) free(self->a[k].buf);
+    free(self->a);
+    free(self->str.s);
+    free(self->packed_buf);
+    if (self->map) munmap(self->map, self->map_size);
+    if (self->fp) {
+        if (fclose(self->fp) < 0) error("Error: failed to close %s\n", self->fname);
+        if (!self->persistent) remove(self->fname);
+    }
+    free(self);
+}
+
+// maps a file written with --write-cache and checks it was written with the same parameters
+static contig_cache_t *contig_cache_load(const char *fname, const bcf_hdr_t *hdr, const sample_t *sample, int nsmpl,
+                                         const model_t *model, const char *rules, int cache_x, const char *input_fname,
+                                         const char *filter_fname, const char *apply_filters,
+                                         const char *targets_list) {
+    contig_cache_t *self = (contig_cache_t *)calloc(1, sizeof(contig_cache_t));
+    self->fname = fname;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) error("Failed to open %s: %s\n", fname, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0) error("Failed to open %s: %s\n", fname, strerror(errno));
+    self->map_size = (size_t)st.st_size;
+    if (self->map_size < 8 + sizeof(int64_t)) error("Error: %s is not a cache file\n", fname);
+    self->map = (char *)mmap(NULL, self->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (self->map == MAP_FAILED) error("Failed to map %s: %s\n", fname, strerror(errno));
+    close(fd);
+    self->buf = self->map;
+    if (memcmp(self->map, CACHE_MAGIC, 8)) error("Error: %s is not a cache file\n", fname);
+    self->off = 8;
+
+    int flags, min_dst, adj_baf_lrr, regress_baf_lrr, has_x, n;
+    contig_cache_read(self, &flags, sizeof(int));
+    contig_cache_read(self, &min_dst, sizeof(int));
+    contig_cache_read(self, &adj_baf_lrr, sizeof(int));
+    contig_cache_read(self, &regress_baf_lrr, sizeof(int));
+    if (flags != (model->flags & CACHE_FLAGS) || min_dst != model->min_dst || adj_baf_lrr != model->adj_baf_lrr
+        || regress_baf_lrr != model->regress_baf_lrr)
+        error("Error: cache file %s was written with different input options\n", fname);
+    if (!contig_cache_read_str(self, rules)) error("Error: cache file %s was written with different rules\n", fname);
+    if (!contig_cache_read_stat(self, input_fname))
+        error("Error: cache file %s was written from a different or modified VCF\n", fname);
+    if (!contig_cache_read_str(self, filter_fname) || !contig_cache_read_stat(self, filter_fname))
+        error("Error: cache file %s was written with different variants\n", fname);
+    if (!contig_cache_read_str(self, apply_filters))
+        error("Error: cache file %s was written with different filters\n", fname);
+    if (!contig_cache_read_str(self, targets_list) || !contig_cache_read_stat(self, targets_list))
+        error("Error: cache file %s was written with different targets\n", fname);
+    contig_cache_read(self, &n, sizeof(int));
+    if (n != hdr->n[BCF_DT_CTG]) error("Error: cache file %s was written from a different VCF\n", fname);
+    for (int rid = 0; rid < n; rid++)
+        if (!contig_cache_read_str(self, bcf_hdr_id2name(hdr, rid)))
+            error("Error: cache file %s was written from a different VCF\n", fname);
+    contig_cache_read(self, &has_x, sizeof(int));
+    contig_cache_read(self, &n, sizeof(int));
+    if (n != nsmpl) error("Error: cache file %s was written with different samples\n", fname);
+    int same_gender = 1;
+    for (int j = 0; j < nsmpl; j++) {
+        int8_t gender;
+        if (!contig_cache_read_str(self, bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, sample[j].idx)))
+            error("Error: cache file %s was written with different samples\n", fname);
+        contig_cache_read(self, &gender, sizeof(int8_t));
+        if (gender != sample[j].computed_gender) same_gender = 0;
+    }
+    // chromosome X can only be used if it was adjusted with the same genders
+    if (has_x && !(cache_x && same_gender)) has_x = 0;
+
+    int64_t index_offset;
+    memcpy(&index_offset, self->map + self->map_size - sizeof(int64_t), sizeof(int64_t));
+    if (index_offset < 0 || (size_t)index_offset > self->map_size - sizeof(int64_t))
+        error("Error: cache file %s is truncated\n", fname);
+    self->off = (size_t)index_offset;
+    contig_cache_read(self, &n, sizeof(int));
+    for (int k = 0; k < n; k++) {
+        int len;
+        int64_t offset, size;
+        contig_cache_read(self, &len, sizeof(int));
+        if (self->off + len > self->map_size) error("Error: cache file %s is truncated\n", fname);
+        kstring_t str = {0, 0, NULL};
+        kputsn(self->buf + self->off, len, &str);
+        self->off += len;
+        contig_cache_read(self, &offset, sizeof(int64_t));
+        contig_cache_read(self, &size, sizeof(int64_t));
+        if (offset < 0 || size < 0 || (size_t)(offset + size) > self->map_size)
+            error("Error: cache file %s is truncated\n", fname);
+        int rid = bcf_hdr_name2id(hdr, str.s);
+        free(str.s);
+        if (rid < 0) error("Error: cache file %s was written from a different VCF\n", fname);
+        if (rid == model->genome_rules->x_rid && !has_x) continue;
+        self->n++;
+        hts_expand(cached_contig_t, self->n, self->m, self->a);
+        self->a[self->n - 1].rid = rid;
+        self->a[self->n - 1].buf = self->map + offset;
+        self->a[self->n - 1].size = (size_t)size;
+        self->a[self->n - 1].offset = (off_t)offset;
+    }
+    return self;
+}
+
+static void contig_cache_put(contig_cache_t *self, const sample_t *sample, int nsmpl, const model_t *model) {
+    self->n++;
+    hts_expand(cached_contig_t, self->n, self->m, self->a);
+    cached_contig_t *contig = &self->a[self->n - 1];
+    memset(contig, 0, sizeof(cached_contig_t));
+    contig->rid = model->rid;
+    if (self->fp) contig->offset = ftello(self->fp);
+
+    contig_cache_write(self, &model->n, sizeof(int));
+    contig_cache_write(self, &model->n_locus, sizeof(int));
+    contig_cache_write(self, &model->n_flipped, sizeof(int));
+    contig_cache_write(self, model->locus_arr, model->n_locus * sizeof(locus_t));
+    if (!(model->flags & WGS_DATA)) contig_cache_write(self, model->adjust_arr, 9 * model->n_locus * sizeof(float));
+    contig_cache_write(self, model->gc_arr, model->n_locus * sizeof(float));
+    for (int j = 0; j < nsmpl; j++) {
+        int n = sample[j].n;
+        contig_cache_write(self, &n, sizeof(int));
+        contig_cache_write_phase(self, sample[j].phase_arr, n);
+        contig_cache_write_data(self, sample[j].data_arr[0], n);
+        contig_cache_write_data(self, sample[j].data_arr[1], n);
+        contig_cache_write_imap(self, sample[j].vcf_imap_arr, n);
+    }
+
+    if (self->fp) {
+        contig->size = (size_t)(ftello(self->fp) - contig->offset);
+    } else {
+        contig->size = self->str.l;
+        contig->buf = ks_release(&self->str);
+    }
+}
+
+// restores the sites of a contig as get_contig() would have read them, returns -1 if the contig is not in the cache
+// with packed set the sites of each sample are left encoded in the contig, to be decoded by sample_unpack()
+static int contig_cache_get(contig_cache_t *self, sample_t *sample, int nsmpl, model_t *model) {
+    cached_contig_t *contig = NULL;
+    for (int k = 0; k < self->n; k++)
+        if (self->a[k].rid == model->rid) contig = &self->a[k];
+    if (!contig || (!self->fp && !contig->buf)) return -1;
+
+    // the contig read by the workers has to stay in memory until the next one is read
+    contig_cache_t mem = {0}, *rd = self;
+    if (self->packed) {
+        mem.fname = self->fname;
+        if (self->map) {
+            mem.buf = contig->buf;
+        } else {
+            free(self->packed_buf);
+            if (self->fp) {
+                self->packed_buf = (char *)malloc(contig->size);
+                if (fseeko(self->fp, contig->offset, SEEK_SET) < 0)
+                    error("Error: failed to seek in %s\n", self->fname);
+                if (fread(self->packed_buf, 1, contig->size, self->fp) != contig->size)
+                    error("Error: failed to read from %s\n", self->fname);
+            } else {
+                self->packed_buf = contig->buf;
+                contig->buf = NULL;
+            }
+            mem.buf = self->packed_buf;
+        }
+        rd = &mem;
+    } else if (self->map || !self->fp) {
+        self->buf = contig->buf;
+        self->off = 0;
+    } else {
+        if (fseeko(self->fp, contig->offset, SEEK_SET) < 0) error("Error: failed to seek in %s\n", self->fname);
+    }
+
+    contig_cache_read(rd, &model->n, sizeof(int));
+    contig_cache_read(rd, &model->n_locus, sizeof(int));
+    contig_cache_read(rd, &model->n_flipped, sizeof(int));
+    hts_expand(locus_t, model->n_locus, model->m_locus, model->locus_arr);
+    hts_expand(float, model->n_locus, model->m_gc, model->gc_arr);
+    contig_cache_read(rd, model->locus_arr, model->n_locus * sizeof(locus_t));
+    if (!(model->flags & WGS_DATA)) {
+        hts_expand(float, 9 * model->n_locus, model->m_adjust, model->adjust_arr);
+        contig_cache_read(rd, model->adjust_arr, 9 * model->n_locus * sizeof(float));
+    }
+    contig_cache_read(rd, model->gc_arr, model->n_locus * sizeof(float));
+    if (self->packed) {
+        for (int j = 0; j < nsmpl; j++) {
+            sample_free_sites(&sample[j]);
+            contig_cache_read(rd, &sample[j].n, sizeof(int));
+            sample[j].packed = rd->buf + rd->off;
+            contig_cache_skip_sites(rd, sample[j].n, contig->size);
+        }
+        return model->n;
+    }
+    uint8_t *bitmap = NULL;
+    int m_bitmap = 0;
+    for (int j = 0; j < nsmpl; j++) {
+        contig_cache_read(self, &sample[j].n, sizeof(int));
+        int n = sample[j].n;
+        hts_expand(int, n, sample[j].m_vcf_imap, sample[j].vcf_imap_arr);
+        hts_expand(int8_t, n, sample[j].m_phase, sample[j].phase_arr);
+        hts_expand(int16_t, n, sample[j].m_data[0], sample[j].data_arr[0]);
+        hts_expand(int16_t, n, sample[j].m_data[1], sample[j].data_arr[1]);
+        contig_cache_read_phase(self, sample[j].phase_arr, n);
+        contig_cache_read_data(self, sample[j].data_arr[0], &bitmap, &m_bitmap, n);
+        contig_cache_read_data(self, sample[j].data_arr[1], &bitmap, &m_bitmap, n);
+        contig_cache_read_imap(self, sample[j].vcf_imap_arr, n);
+        sample[j].packed = NULL;
+    }
+    free(bitmap);
+
+    // contigs kept in memory are only restored once
+    if (!self->map && !self->fp) {
+        free(contig->buf);
+        contig->buf = NULL;
+    }
+    self->buf = self->map;
+    return model->n;
+}
+
+// decodes the sites of a sample left encoded by contig_cache_get() into the arrays of the worker, which are lent to
+// the sample until they are swapped back once the sample is processed
+// the indexes of the sites were checked by contig_cache_skip_sites() when the contig was read
+static void sample_unpack(sample_t *self, worker_t *worker) {
+    contig_cache_t mem = {0};
+    mem.buf = self->packed;
+    sample_t *sites = &worker->sites;
+    int n = self->n;
+    hts_expand(int, n, sites->m_vcf_imap, sites->vcf_imap_arr);
+    hts_expand(int8_t, n, sites->m_phase, sites->phase_arr);
+    hts_expand(int16_t, n, sites->m_data[0], sites->data_arr[0]);
+    hts_expand(int16_t, n, sites->m_data[1], sites->data_arr[1]);
+    contig_cache_read_phase(&mem, sites->phase_arr, n);
+    contig_cache_read_data(&mem, sites->data_arr[0], &worker->bitmap, &worker->m_bitmap, n);
+    contig_cache_read_data(&mem, sites->data_arr[1], &worker->bitmap, &worker->m_bitmap, n);
+    contig_cache_read_imap(&mem, sites->vcf_imap_arr, n);
+    sample_swap_sites(self, sites);
+}
+
+/*********************************
+ * SPARSE ANNOTATIONS METHODS    *
+ *********************************/
+
+// with --sparse-annotations the Ldev, Bdev, and Bdev_Phase annotations are written as runs of records rather than as
+// FORMAT fields of each record, the format is described with the reader in mocha.h
+static contig_cache_t *annot_writer_init(const char *fname, const bcf_hdr_t *hdr, const sample_t *sample,
+                                         int nsmpl) {
+    contig_cache_t *self = contig_cache_init(fname, 1);
+    contig_cache_write(self, ANNOT_MAGIC, 8);
+    contig_cache_write(self, &nsmpl, sizeof(int));
+    for (int j = 0; j < nsmpl; j++) contig_cache_write_str(self, bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, sample[j].idx));
+    return self;
+}
+
+// sets the annotations of records r to next - 1, where they do not change, merging them with the previous run
+static inline void annot_put_run(annot_run_t **runs, int *n, int *m, const model_t *model, int r, int next,
+                                 float ldev, float bdev, int *last) {
+    if (ldev == 0.0f && bdev == 0.0f) return;
+    if (*n > 0 && *last == r - 1 && (*runs)[*n - 1].ldev == ldev && (*runs)[*n - 1].bdev == bdev) {
+        (*runs)[*n - 1].end = model->locus_arr[next - 1].pos;
+    } else {
+        (*n)++;
+        hts_expand(annot_run_t, *n, *m, *runs);
+        annot_run_t *run = &(*runs)[*n - 1];
+        run->beg = model->locus_arr[r].pos;
+        run->end = model->locus_arr[next - 1].pos;
+        run->ldev = ldev;
+        run->bdev = bdev;
+    }
+    *last = next - 1;
+}
+
+// the annotations of each sample only change at the same records used by put_contig()
+static void annot_put_contig(contig_cache_t *self, const sample_t *sample, int nsmpl, const model_t *model) {
+    self->n++;
+    hts_expand(cached_contig_t, self->n, self->m, self->a);
+    cached_contig_t *contig = &self->a[self->n - 1];
+    memset(contig, 0, sizeof(cached_contig_t));
+    contig->rid = model->rid;
+    contig->offset = ftello(self->fp);
+
+    int n_locus = model->n_locus;
+    int n_runs = 0, m_runs = 0, n_phase = 0, m_phase_pos = 0, m_phase = 0, m_events = 0;
+    annot_run_t *runs = NULL;
+    int *phase_pos = NULL, *events = NULL;
+    int8_t *phase_arr = NULL;
+    for (int j = 0; j < nsmpl; j++) {
+        const int *imap = sample[j].vcf_imap_arr;
+        int n = sample[j].n, n_events = 0;
+        hts_expand(int, 2 * n + 1, m_events, events);
+        if (n > 0 && imap[0] > 0) events[n_events++] = 0;
+        for (int k = 0; k < n; k++) {
+            if (imap[k] < n_locus) events[n_events++] = imap[k];
+            if ((k == n - 1 || imap[k + 1] > imap[k] + 1) && imap[k] + 1 < n_locus) events[n_events++] = imap[k] + 1;
+        }
+
+        // the first change is at the first record, unless the sample has no sites
+        n_runs = n_phase = 0;
+        int iter = 0, phase = 0, last = -1;
+        float ldev = 0.0f, bdev = 0.0f;
+        for (int e = 0; e < n_events; e++) {
+            int r = events[e];
+            put_contig_sample(&sample[j], r, &iter, &ldev, &bdev, &phase);
+            if (phase != 0) {
+                n_phase++;
+                hts_expand(int, n_phase, m_phase_pos, phase_pos);
+                hts_expand(int8_t, n_phase, m_phase, phase_arr);
+                phase_pos[n_phase - 1] = model->locus_arr[r].pos;
+                phase_arr[n_phase - 1] = (int8_t)phase;
+            }
+            int next = e + 1 < n_events ? events[e + 1] : n_locus;
+            annot_put_run(&runs, &n_runs, &m_runs, model, r, next, ldev, bdev, &last);
+        }
+
+        contig_cache_write(self, &n_runs, sizeof(int));
+        contig_cache_write(self, runs, n_runs * sizeof(annot_run_t));
+        contig_cache_write(self, &n_phase, sizeof(int));
+        contig_cache_write(self, phase_pos, n_phase * sizeof(int));
+        contig_cache_write(self, phase_arr, n_phase * sizeof(int8_t));
+    }
+    free(runs);
+    free(phase_pos);
+    free(phase_arr);
+    free(events);
+
+    contig->size = (size_t)(ftello(self->fp) - contig->offset);
+}
+
+/*********************************
+ * CONTIG PIPELINE METHODS       *
+ *********************************/
+
+// reads a contig from the cache if available or from the VCF otherwise, optionally adding it to the cache
+static void read_contig(bcf_srs_t *sr, contig_cache_t *cache, int put, sample_t *sample, int nsmpl, model_t *model) {
+    model->n_bytes = 0;
+    if (!cache || contig_cache_get(cache, sample, nsmpl, model) < 0) {
+        for (int j = 0; j < nsmpl; j++) sample[j].packed = NULL;
+        get_contig(sr, sample, model);
+        if (put) contig_cache_put(cache, sample, nsmpl, model);
+    }
+}
+
+// with --sample-block the per-contig arrays of a block are released once the block is processed, so that only the
+// samples of one block hold sites at any time
+static void release_block(sample_t *sample, int beg, int end) {
+    for (int j = beg; j < end; j++) sample_free_sites(&sample[j]);
+}
+
+// with --pipeline the next contig is decoded and the previous contig is written while the current contig is called,
+// each stage owns a separate set of per-contig arrays and the sets are handed over by swapping pointers
+typedef struct {
+    sample_t *sample; // only the per-contig arrays, the index, and the gender are used
+    model_t model;    // only the per-contig arrays are used
+    int put;          // whether the decoded contig is added to the cache
+    int nret;         // number of records written
+} contig_buf_t;
+
+typedef struct {
+    bcf_srs_t *sr;     // reader used by the decoder
+    bcf_srs_t *out_sr; // reader used by the writer
+    contig_cache_t *cache;
+    htsFile *out_fh;
+    bcf_hdr_t *out_hdr;
+    int nsmpl;
+    contig_buf_t next; // contig being decoded
+    contig_buf_t prev; // contig being written
+    pthread_t decoder, writer;
+    int decoding, writing;
+} contig_pipeline_t;
+
+#define SWAP(type_t, a, b)                                                                                             \
+    {                                                                                                                  \
+        type_t t = a;                                                                                                  \
+        a = b;                                                                                                         \
+        b = t;                                                                                                         \
+    }
+
+static void contig_buf_swap(contig_buf_t *buf, sample_t *sample, int nsmpl, model_t *model) {
+    for (int j = 0; j < nsmpl; j++) {
+        SWAP(int, buf->sample[j].n, sample[j].n);
+        SWAP(int *, buf->sample[j].vcf_imap_arr, sample[j].vcf_imap_arr);
+        SWAP(int, buf->sample[j].m_vcf_imap, sample[j].m_vcf_imap);
+        SWAP(int8_t *, buf->sample[j].phase_arr, sample[j].phase_arr);
+        SWAP(int, buf->sample[j].m_phase, sample[j].m_phase);
+        for (int k = 0; k < 2; k++) {
+            SWAP(int16_t *, buf->sample[j].data_arr[k], sample[j].data_arr[k]);
+            SWAP(int, buf->sample[j].m_data[k], sample[j].m_data[k]);
+        }
+    }
+    SWAP(int, buf->model.rid, model->rid);
+    SWAP(int, buf->model.n, model->n);
+    SWAP(int, buf->model.n_locus, model->n_locus);
+    SWAP(int, buf->model.n_flipped, model->n_flipped);
+    SWAP(int64_t, buf->model.n_bytes, model->n_bytes);
+    SWAP(locus_t *, buf->model.locus_arr, model->locus_arr);
+    SWAP(int, buf->model.m_locus, model->m_locus);
+    SWAP(float *, buf->model.adjust_arr, model->adjust_arr);
+    SWAP(int, buf->model.m_adjust, model->m_adjust);
+    SWAP(float *, buf->model.gc_arr, model->gc_arr);
+    SWAP(int, buf->model.m_gc, model->m_gc);
+}
+
+#undef SWAP
+
+static void contig_buf_init(contig_buf_t *buf, int nsmpl, const model_t *model) {
+    buf->sample = (sample_t *)calloc(nsmpl, sizeof(sample_t));
+    buf->model = *model;
+    buf->model.n = 0;
+    buf->model.n_locus = 0;
+    buf->model.locus_arr = NULL;
+    buf->model.m_locus = 0;
+    buf->model.adjust_arr = NULL;
+    buf->model.m_adjust = 0;
+    buf->model.gc_arr = NULL;
+    buf->model.m_gc = 0;
+}
+
+static void contig_buf_destroy(contig_buf_t *buf, int nsmpl) {
+    for (int j = 0; j < nsmpl; j++) {
+        free(buf->sample[j].vcf_imap_arr);
+        free(buf->sample[j].data_arr[0]);
+        free(buf->sample[j].data_arr[1]);
+        free(buf->sample[j].phase_arr);
+    }
+    free(buf->sample);
+    free(buf->model.locus_arr);
+    free(buf->model.adjust_arr);
+    free(buf->model.gc_arr);
+}
+
+static void contig_pipeline_init(contig_pipeline_t *self, bcf_srs_t *sr, bcf_srs_t *out_sr, contig_cache_t *cache,
+                                 htsFile *out_fh, bcf_hdr_t *out_hdr, int nsmpl, const model_t *model) {
+    memset(self, 0, sizeof(contig_pipeline_t));
+    self->sr = sr;
+    self->out_sr = out_sr;
+    self->cache = cache;
+    self->out_fh = out_fh;
+    self->out_hdr = out_hdr;
+    self->nsmpl = nsmpl;
+    contig_buf_init(&self->next, nsmpl, model);
+    contig_buf_init(&self->prev, nsmpl, model);
+}
+
+// the stages need the sample indexes and the genders, as get_contig() adjusts males differently on chromosome X
+static void contig_pipeline_set_samples(contig_pipeline_t *self, const sample_t *sample) {
+    for (int j = 0; j < self->nsmpl; j++) {
+        self->next.sample[j].idx = self->prev.sample[j].idx = sample[j].idx;
+        self->next.sample[j].computed_gender = self->prev.sample[j].computed_gender = sample[j].computed_gender;
+    }
+}
+
+static void *contig_pipeline_decoder(void *arg) {
+    contig_pipeline_t *self = (contig_pipeline_t *)arg;
+    read_contig(self->sr, self->cache, self->next.put, self->next.sample, self->nsmpl, &self->next.model);
+    return NULL;
+}
+
+static void *contig_pipeline_writer(void *arg) {
+    contig_pipeline_t *self = (contig_pipeline_t *)arg;
+    self->prev.nret = put_contig(self->out_sr, self->prev.sample, &self->prev.model, self->out_fh, self->out_hdr);
+    return NULL;
+}
+
+// starts decoding a contig in the background
+static void contig_pipeline_decode(contig_pipeline_t *self, int rid, int put) {
+    self->next.model.rid = rid;
+    self->next.put = put;
+    if (pthread_create(&self->decoder, NULL, contig_pipeline_decoder, self))
+        error("Error: failed to create the decoder thread\n");
+    self->decoding = 1;
+}
+
+// waits for the contig being decoded and moves it into the sample and model arrays
+static void contig_pipeline_get(contig_pipeline_t *self, sample_t *sample, model_t *model) {
+    if (!self->decoding) error("Error: no contig is being decoded\n");
+    pthread_join(self->decoder, NULL);
+    self->decoding = 0;
+    contig_buf_swap(&self->next, sample, self->nsmpl, model);
+}
+
+// waits for the contig being written, returns the number of records written or -1 if no contig was being written
+static int contig_pipeline_flush(contig_pipeline_t *self) {
+    if (!self->writing) return -1;
+    pthread_join(self->writer, NULL);
+    self->writing = 0;
+    return self->prev.nret;
+}
+
+// moves the contig out of the sample and model arrays and starts writing it in the background
+static void contig_pipeline_put(contig_pipeline_t *self, sample_t *sample, model_t *model) {
+    if (self->writing) error("Error: a contig is already being written\n");
+    contig_buf_swap(&self->prev, sample, self->nsmpl, model);
+    if (pthread_create(&self->writer, NULL, contig_pipeline_writer, self))
+        error("Error: failed to create the writer thread\n");
+    self->writing = 1;
+}
+
+static void contig_pipeline_destroy(contig_pipeline_t *self) {
+    if (self->decoding) pthread_join(self->decoder, NULL);
+    if (self->writing) pthread_join(self->writer, NULL);
+    contig_buf_destroy(&self->next, self->nsmpl);
+    contig_buf_destroy(&self->prev, self->nsmpl);
+}
+
+/*********************************
+ * BENCHMARK METHODS             *
+ *********************************/
+
+// with --simulate a synthetic VCF with mosaic chromosomal alterations is written to the input file and then called
+// as usual, the contigs follow GRCh38 and the X nonPAR region is simulated as haploid in half of the samples
+static const int sim_ctg_len[] = {248956422, 242193529, 198295559, 190214555, 181538259, 170805979, 159345973,
+                                  145138636, 138394717, 133797422, 135086622, 133275309, 114364328, 107043718,
+                                  101991189, 90338345,  83257441,  80373285,  58617616,  64444167,  46709983,
+                                  50818468};
+#define SIM_X_LEN 156040895
+#define SIM_X_NONPAR_BEG 2781479
+#define SIM_X_NONPAR_END 155700628
+#define SIM_DEPTH 30.0
+
+typedef struct {
+    int wgs;      // whether to simulate AD rather than LRR and BAF
+    int n_ctg;    // number of autosomes
+    int n_sites;  // number of sites per contig
+    int nsmpl;    // number of samples
+    float burden; // probability of a mosaic chromosomal alteration for each sample and autosome
+    unsigned short seed[3];
+} sim_t;
+
+typedef struct {
+    int type; // MOCHA_LOSS, MOCHA_GAIN, MOCHA_CNLOH, or MOCHA_UNDET if none
+    int beg, end;
+    int hap; // haplotype that is lost, gained, or replaced
+    float cf;
+} sim_event_t;
+
+static void sim_parse(sim_t *self, const char *str) {
+    memset(self, 0, sizeof(sim_t));
+    char type[8];
+    int seed = 1;
+    if (sscanf(str, "%7[^,],%d,%d,%d,%f,%d", type, &self->n_ctg, &self->n_sites, &self->nsmpl, &self->burden, &seed)
+        < 5)
+        error("Could not parse: --simulate %s\n", str);
+    if (strcmp(type, "array") == 0)
+        self->wgs = 0;
+    else if (strcmp(type, "wgs") == 0)
+        self->wgs = 1;
+    else
+        error("Data type must be array or wgs: --simulate %s\n", str);
+    int max_ctg = sizeof(sim_ctg_len) / sizeof(int);
+    if (self->n_ctg < 1 || self->n_ctg > max_ctg || self->n_sites < 1 || self->nsmpl < 1 || self->burden < 0.0f
+        || self->burden > 1.0f)
+        error("Number of contigs must be between 1 and %d, probability of alterations between 0 and 1: --simulate %s\n",
+              max_ctg, str);
+    self->seed[0] = 0x330E;
+    self->seed[1] = (unsigned short)seed;
+    self->seed[2] = (unsigned short)(seed >> 16);
+}
+
+static inline double sim_normal(unsigned short *seed) {
+    double u = erand48(seed), v = erand48(seed);
+    return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+}
+
+static inline int sim_poisson(unsigned short *seed, double lambda) {
+    double l = exp(-lambda), p = erand48(seed);
+    int k = 0;
+    while (p > l) {
+        p *= erand48(seed);
+        k++;
+    }
+    return k;
+}
+
+static inline int sim_binomial(unsigned short *seed, int n, double p) {
+    int k = 0;
+    for (int i = 0; i < n; i++) k += erand48(seed) < p;
+    return k;
+}
+
+// the file is created exclusively so that an existing input VCF is never overwritten
+static void sim_write(const sim_t *self, const char *fname, FILE *log_file) {
+    int fd = open(fname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST)
+        error("Error: %s already exists, option --simulate requires a path that does not exist yet\n", fname);
+    if (fd < 0) error("Cannot write to \"%s\": %s\n", fname, strerror(errno));
+    close(fd);
+    htsFile *fh = hts_open(fname, "wb");
+    if (fh == NULL) error("Cannot write to \"%s\": %s\n", fname, strerror(errno));
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    kstring_t str = {0, 0, NULL};
+    for (int rid = 0; rid <= self->n_ctg; rid++) {
+        str.l = 0;
+        if (rid < self->n_ctg)
+            ksprintf(&str, "##contig=<ID=%d,length=%d>", rid + 1, sim_ctg_len[rid]);
+        else
+            ksprintf(&str, "##contig=<ID=X,length=%d>", SIM_X_LEN);
+        bcf_hdr_append(hdr, str.s);
+    }
+    bcf_hdr_append(hdr, "##INFO=<ID=ALLELE_A,Number=1,Type=Integer,Description=\"A allele\">");
+    bcf_hdr_append(hdr, "##INFO=<ID=ALLELE_B,Number=1,Type=Integer,Description=\"B allele\">");
+    bcf_hdr_append(hdr, "##INFO=<ID=GC,Number=1,Type=Float,Description=\"GC ratio content around the variant\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    if (self->wgs) {
+        bcf_hdr_append(hdr, "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allelic depths\">");
+    } else {
+        bcf_hdr_append(hdr, "##FORMAT=<ID=BAF,Number=1,Type=Float,Description=\"B Allele Frequency\">");
+        bcf_hdr_append(hdr, "##FORMAT=<ID=LRR,Number=1,Type=Float,Description=\"Log R Ratio\">");
+    }
+    for (int j = 0; j < self->nsmpl; j++) {
+        str.l = 0;
+        ksprintf(&str, "SIM%d", j + 1);
+        bcf_hdr_add_sample(hdr, str.s);
+    }
+    bcf_hdr_sync(hdr);
+    if (bcf_hdr_write(fh, hdr) < 0) error("Unable to write to output VCF file\n");
+
+    unsigned short seed[3] = {self->seed[0], self->seed[1], self->seed[2]};
+    float lrr_hap2dip = strtof(LRR_HAP2DIP_DFLT, NULL);
+    int nsmpl = self->nsmpl;
+    sim_event_t *events = (sim_event_t *)malloc(nsmpl * sizeof(sim_event_t));
+    int32_t *gts = (int32_t *)malloc(2 * nsmpl * sizeof(int32_t));
+    int32_t *ad = (int32_t *)malloc(2 * nsmpl * sizeof(int32_t));
+    float *baf = (float *)malloc(nsmpl * sizeof(float));
+    float *lrr = (float *)malloc(nsmpl * sizeof(float));
+    bcf1_t *rec = bcf_init();
+    int n_events = 0;
+    for (int rid = 0; rid <= self->n_ctg; rid++) {
+        int is_x = rid == self->n_ctg;
+        int len = is_x ? SIM_X_LEN : sim_ctg_len[rid];
+        for (int j = 0; j < nsmpl; j++) {
+            sim_event_t *event = &events[j];
+            event->type = MOCHA_UNDET;
+            if (is_x || erand48(seed) >= self->burden) continue;
+            event->type = MOCHA_LOSS + (int)(3.0 * erand48(seed));
+            event->cf = (float)(0.05 + 0.45 * erand48(seed));
+            int ev_len = (int)((0.05 + 0.45 * erand48(seed)) * len);
+            event->beg = (int)(erand48(seed) * (len - ev_len));
+            event->end = event->beg + ev_len;
+            event->hap = erand48(seed) < 0.5;
+            n_events++;
+        }
+        for (int k = 0; k < self->n_sites; k++) {
+            int pos = (int)((double)(k + 1) * len / (self->n_sites + 1));
+            double af = 0.05 + 0.45 * erand48(seed);
+            bcf_clear(rec);
+            rec->rid = rid;
+            rec->pos = pos - 1;
+            bcf_update_alleles_str(hdr, rec, "A,C");
+            int allele_a = 0, allele_b = 1;
+            float gc = (float)(0.3 + 0.3 * erand48(seed));
+            bcf_update_info_int32(hdr, rec, "ALLELE_A", &allele_a, 1);
+            bcf_update_info_int32(hdr, rec, "ALLELE_B", &allele_b, 1);
+            bcf_update_info_float(hdr, rec, "GC", &gc, 1);
+            for (int j = 0; j < nsmpl; j++) {
+                int hap[2] = {erand48(seed) < af, erand48(seed) < af};
+                // the odd samples are males, with a single X chromosome outside the PARs
+                int haploid = is_x && (j & 1) && pos > SIM_X_NONPAR_BEG && pos < SIM_X_NONPAR_END;
+                if (haploid) hap[1] = hap[0];
+                gts[2 * j] = bcf_gt_phased(hap[0]);
+                gts[2 * j + 1] = bcf_gt_phased(hap[1]);
+
+                // copy number of each haplotype
+                double cn[2] = {1.0, haploid ? 0.0 : 1.0};
+                const sim_event_t *event = &events[j];
+                if (event->type != MOCHA_UNDET && pos >= event->beg && pos <= event->end) {
+                    int h = event->hap;
+                    if (event->type == MOCHA_LOSS) {
+                        cn[h] -= event->cf;
+                    } else if (event->type == MOCHA_GAIN) {
+                        cn[h] += event->cf;
+                    } else {
+                        cn[h] -= event->cf;
+                        cn[1 - h] += event->cf;
+                    }
+                }
+                double b_frac = (hap[0] * cn[0] + hap[1] * cn[1]) / (cn[0] + cn[1]);
+                if (self->wgs) {
+                    int depth = sim_poisson(seed, SIM_DEPTH * (cn[0] + cn[1]) / 2.0);
+                    int alt = sim_binomial(seed, depth, b_frac * 0.99 + (1.0 - b_frac) * 0.01);
+                    ad[2 * j] = depth - alt;
+                    ad[2 * j + 1] = alt;
+                } else {
+                    double sd = hap[0] != hap[1] ? 0.03 : 0.015;
+                    double x = b_frac + sd * sim_normal(seed);
+                    baf[j] = (float)(x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x));
+                    lrr[j] = (float)(lrr_hap2dip * log2((cn[0] + cn[1]) / 2.0) + 0.2 * sim_normal(seed));
+                }
+            }
+            bcf_update_genotypes(hdr, rec, gts, 2 * nsmpl);
+            if (self->wgs) {
+                bcf_update_format_int32(hdr, rec, "AD", ad, 2 * nsmpl);
+            } else {
+                bcf_update_format_float(hdr, rec, "BAF", baf, nsmpl);
+                bcf_update_format_float(hdr, rec, "LRR", lrr, nsmpl);
+            }
+            if (bcf_write(fh, hdr, rec) < 0) error("Unable to write to output VCF file\n");
+        }
+    }
+    if (hts_close(fh) < 0) error("Close failed: %s\n", fname);
+    if (bcf_index_build(fname, 14) < 0) error("Failed to index %s\n", fname);
+    fprintf(log_file, "Simulated %d sites for %d sample(s) with %d alteration(s) in %s\n",
+            (self->n_ctg + 1) * self->n_sites, nsmpl, n_events, fname);
+
+    bcf_destroy(rec);
+    bcf_hdr_destroy(hdr);
+    free(str.s);
+    free(events);
+    free(gts);
+    free(ad);
+    free(baf);
+    free(lrr);
+}
+
+static const char *bench_stage[BENCH_N] = {"ingest", "stats", "emission", "viterbi", "lod", "calls", "output"};
+
+// with --benchmark the time spent in each stage is reported together with the throughput in sites times samples
+// processed per second, the stages run by the workers are summed across worker threads
+typedef struct {
+    double t0;
+    stage_times_t times;
+    int64_t n_alloc, n_malloc; // scratch allocations of the workers
+    size_t arena_peak;
+} bench_t;
+
+// adds the scratch memory used by the workers
+static void bench_collect(bench_t *self, const pool_t *pool) {
+    for (int i = 0; i < pool->n_workers; i++) {
+        const worker_t *worker = &pool->workers[i];
+        self->n_alloc += worker->arena.n_alloc;
+        self->n_malloc += worker->arena.n_malloc;
+        self->arena_peak += worker->arena.peak;
+    }
+}
+
+// compares the calls with a reference table line by line, returns the number of lines that differ
+static int bench_compare(const char *calls, size_t size, const char *ref_fname, int *n_lines, int *n_ref_lines) {
+    kstring_t ref = {0, 0, NULL};
+    FILE *fp = fopen(ref_fname, "r");
+    if (!fp) error("Failed to open %s: %s\n", ref_fname, strerror(errno));
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) kputsn(buf, n, &ref);
+    fclose(fp);
+
+    int n_diff = 0;
+    const char *a = calls, *a_end = calls + size, *b = ref.s, *b_end = ref.s + ref.l;
+    *n_lines = *n_ref_lines = 0;
+    while (a < a_end || b < b_end) {
+        const char *a_eol = a < a_end ? memchr(a, '\n', a_end - a) : NULL;
+        const char *b_eol = b < b_end ? memchr(b, '\n', b_end - b) : NULL;
+        if (a < a_end && !a_eol) a_eol = a_end;
+        if (b < b_end && !b_eol) b_eol = b_end;
+        if (a < a_end) (*n_lines)++;
+        if (b < b_end) (*n_ref_lines)++;
+        if (a >= a_end || b >= b_end || a_eol - a != b_eol - b || memcmp(a, b, a_eol - a)) n_diff++;
+        a = a < a_end ? a_eol + 1 : a;
+        b = b < b_end ? b_eol + 1 : b;
+    }
+    free(ref.s);
+    return n_diff;
+}
+
+static void bench_print(FILE *restrict stream, const bench_t *self, int nsmpl, int n_diff, int n_lines,
+                        int n_ref_lines) {
+    if (stream == NULL) return;
+    const stage_times_t *times = &self->times;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stream, "metric\tvalue\n");
+    fprintf(stream, "n_samples\t%d\n", nsmpl);
+    fprintf(stream, "n_sites\t%" PRId64 "\n", times->n_sites);
+    fprintf(stream, "n_site_samples\t%" PRId64 "\n", times->n_site_samples);
+    for (int i = 0; i < BENCH_N; i++) {
+        fprintf(stream, "%s_seconds\t%.4f\n", bench_stage[i], times->wall[i]);
+        fprintf(stream, "%s_site_samples_per_second\t%.4g\n", bench_stage[i],
+                times->wall[i] > 0.0 ? (double)times->n_site_samples / times->wall[i] : NAN);
+    }
+    fprintf(stream, "total_seconds\t%.4f\n", bench_clock() - self->t0);
+    fprintf(stream, "user_cpu_seconds\t%.4f\n", (double)usage.ru_utime.tv_sec + 1e-6 * (double)usage.ru_utime.tv_usec);
+    fprintf(stream, "peak_rss_kb\t%ld\n", usage.ru_maxrss);
+    fprintf(stream, "arena_allocations\t%" PRId64 "\n", self->n_alloc);
+    fprintf(stream, "arena_malloc_fallbacks\t%" PRId64 "\n", self->n_malloc);
+    fprintf(stream, "arena_peak_bytes\t%zu\n", self->arena_peak);
+    if (n_diff >= 0) {
+        fprintf(stream, "call_lines\t%d\n", n_lines);
+        fprintf(stream, "reference_call_lines\t%d\n", n_ref_lines);
+        fprintf(stream, "differing_call_lines\t%d\n", n_diff);
+    }
+    if (stream != stdout && stream != stderr) fclose(stream);
+}
+
+// with --stage-times the time spent in each stage and the work done are reported for each contig
+static void stage_times_print(FILE *restrict stream, const stage_times_t *times, const bcf_hdr_t *hdr) {
+    if (stream == NULL) return;
+    fprintf(stream, "contig\tn_sites\tn_site_samples\tdecoded_bytes\tbrent_evals\tviterbi_sites");
+    for (int k = 0; k < BENCH_N; k++) fprintf(stream, "\t%s_wall\t%s_cpu", bench_stage[k], bench_stage[k]);
+    fputc('\n', stream);
+    for (int rid = 0; rid < hdr->n[BCF_DT_CTG]; rid++) {
+        const stage_times_t *t = &times[rid];
+        if (t->n_bytes == 0 && t->n_sites == 0) continue;
+        fprintf(stream, "%s\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64,
+                bcf_hdr_id2name(hdr, rid), t->n_sites, t->n_site_samples, t->n_bytes, t->n_brent_eval,
+                t->n_viterbi_sites);
+        for (int k = 0; k < BENCH_N; k++) fprintf(stream, "\t%.4f\t%.4f", t->wall[k], t->cpu[k]);
+        fputc('\n', stream);
+    }
+    if (stream != stdout && stream != stderr) fclose(stream);
+}
+
+// with --pipeline a contig is only logged once it has been written, while the next contig is called
+static void stage_times_log(FILE *log_file, const stage_times_t *t, const bcf_hdr_t *hdr, int rid) {
+    fprintf(log_file,
+            "Contig %s took %.2fs to read, %.2fs to compute the statistics, %.2fs to call (%.2fs of CPU), and %.2fs "
+            "to write\n",
+            bcf_hdr_id2name(hdr, rid), t->wall[BENCH_INGEST], t->wall[BENCH_STATS], t->wall[BENCH_CALLS],
+            t->cpu[BENCH_CALLS], t->wall[BENCH_OUTPUT]);
+}
+
 /*********************************
  * PLUGIN CODE                   *
  *********************************/
@@ -2485,6 +5151,9 @@ static const char *usage_text(void) {
            "General Options:\n"
            "    -x, --sex <file>               file including information about the gender of the samples\n"
            "        --call-rate <file>         file including information about the call_rate of the samples\n"
+           "        --load-stats <file>        load the genome-wide statistics of the samples from a previous "
+           "--genome-stats output\n"
+           "                                   rather than reading the whole genome to compute them\n"
            "    -s, --samples [^]<list>        comma separated list of samples to include (or exclude with \"^\" "
            "prefix)\n"
            "    -S, --samples-file [^]<file>   file of samples to include (or exclude with \"^\" prefix)\n"
@@ -2494,10 +5163,38 @@ static const char *usage_text(void) {
            "prefix\n"
            "    -T, --targets-file [^]<file>   restrict to regions listed in a file. Exclude regions with \"^\" "
            "prefix\n"
+           "        --contigs <list>           comma-separated list of contigs to call, other contigs are skipped "
+           "through the index\n"
            "    -f, --apply-filters <list>     require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n"
            "                                   to include (or exclude with \"^\" prefix) in the analysis\n"
            "    -p  --cnp <file>               list of regions to genotype in BED format\n"
-           "        --threads <int>            number of extra output compression threads [0]\n"
+           "        --threads <int>            number of extra threads for computation and output compression [0]\n"
+           "        --single-pass              keep the sites read for the statistics in memory rather than reading "
+           "the VCF again\n"
+           "        --spill-file <file>        keep the sites read for the statistics in a temporary file (implies "
+           "--single-pass)\n"
+           "        --write-cache <file>       write the adjusted sites to a file that later runs can load with "
+           "--read-cache\n"
+           "        --read-cache <file>        load the adjusted sites from a file rather than from the VCF\n"
+           "        --pipeline                 decode the next contig and write the previous one while calling "
+           "contigs\n"
+           "        --sample-block <int>       read and call WGS samples in blocks of this size, reading each contig "
+           "once per block\n"
+           "        --export-adjust <file>     write the cohort-wide array adjustments to a sites-only file and "
+           "make no calls\n"
+           "        --import-adjust <file>     adjust array data with a file written by --export-adjust rather than "
+           "with the samples\n"
+           "        --previous-adjust <file>   adjustments imported by a previous run whose calls are updated "
+           "(requires --previous-stats)\n"
+           "        --previous-stats <file>    genome statistics of a previous run, its samples are only called "
+           "again if their adjustments moved\n"
+           "        --recall-tolerance <float> largest change of the adjustments of a sample keeping its previous "
+           "calls [" RECALL_TOLERANCE_DFLT "]\n"
+           "        --viterbi-windows <int>    split each contig in this many windows run in parallel by the Viterbi "
+           "algorithm [1]\n"
+           "                                   (windows take threads from --threads, and keep all the backpointers of "
+           "the\n"
+           "                                   contig in memory rather than recomputing them in blocks)\n"
            "\n"
            "Output Options:\n"
            "    -o, --output <file>            write output to a file [no output]\n"
@@ -2505,11 +5202,21 @@ static const char *usage_text(void) {
            "uncompressed VCF [v]\n"
            "        --no-version               do not append version and command line to the header\n"
            "    -a  --no-annotations           omit Ldev and Bdev FORMAT from output VCF (requires --output)\n"
+           "        --sparse-annotations <file> write Ldev, Bdev, and Bdev_Phase as runs of sites to a file for "
+           "bcftools +mochatools\n"
            "        --no-log                   suppress progress report on standard error\n"
            "    -l  --log <file>               write log to file [standard error]\n"
            "    -m, --mosaic-calls <file>      write mosaic chromosomal alterations to a file [standard output]\n"
            "    -g, --genome-stats <file>      write sample genome-wide statistics to a file [no output]\n"
            "    -u, --ucsc-bed <file>          write UCSC bed track to a file [no output]\n"
+           "        --benchmark <file>         write the time spent in each stage, the throughput, and the memory "
+           "used to a file\n"
+           "        --benchmark-ref <file>     compare the mosaic chromosomal alterations with a reference table "
+           "(requires --benchmark)\n"
+           "        --simulate <spec>          first write to <in.vcf>, which must not exist, a synthetic VCF, with "
+           "spec array|wgs,<contigs>,<sites>,<samples>,<burden>[,<seed>]\n"
+           "        --stage-times <file>       write the time spent in each stage and the work done for each contig "
+           "to a file\n"
            "\n"
            "HMM Options:\n"
            "        --bdev-LRR-BAF <list>      comma separated list of inverse BAF deviations for LRR+BAF model "
@@ -2621,8 +5328,6 @@ static FILE *get_file_handle(const char *str) {
 }
 
 int run(int argc, char *argv[]) {
-    beta_binom_null = beta_binom_init();
-    beta_binom_alt = beta_binom_init();
 
     // program options
     char *tmp = NULL;
@@ -2632,6 +5337,9 @@ int run(int argc, char *argv[]) {
     int force_samples = 0;
     int output_type = FT_VCF;
     int n_threads = 0;
+    int single_pass = 0;
+    int pipeline = 0;
+    int sample_block = 0;
     int record_cmd_line = 1;
     char *computed_gender_fname = NULL;
     char *call_rate_fname = NULL;
@@ -2640,12 +5348,27 @@ int run(int argc, char *argv[]) {
     char *targets_list = NULL;
     char *output_fname = NULL;
     char *cnp_fname = NULL;
+    char *spill_fname = NULL;
+    char *write_cache_fname = NULL;
+    char *read_cache_fname = NULL;
+    char *export_adjust_fname = NULL;
+    char *import_adjust_fname = NULL;
+    char *previous_adjust_fname = NULL;
+    char *previous_stats_fname = NULL;
+    float recall_tolerance = strtof(RECALL_TOLERANCE_DFLT, NULL);
+    char *load_stats_fname = NULL;
+    char *contigs_list = NULL;
+    char *sparse_annot_fname = NULL;
+    char *simulate_spec = NULL;
+    char *bench_ref_fname = NULL;
     char *rules = NULL;
     sample_t *sample = NULL;
     FILE *log_file = stderr;
     FILE *out_fm = stdout;
     FILE *out_fg = NULL;
     FILE *out_fu = NULL;
+    FILE *out_fb = NULL;
+    FILE *out_ft = NULL;
     bcf_hdr_t *hdr = NULL;
     bcf_hdr_t *out_hdr = NULL;
     htsFile *out_fh = NULL;
@@ -2720,6 +5443,25 @@ int run(int argc, char *argv[]) {
                                        {"LRR-weight", required_argument, NULL, 28},
                                        {"LRR-hap2dip", required_argument, NULL, 29},
                                        {"LRR-cutoff", required_argument, NULL, 30},
+                                       {"single-pass", no_argument, NULL, 31},
+                                       {"spill-file", required_argument, NULL, 32},
+                                       {"write-cache", required_argument, NULL, 33},
+                                       {"read-cache", required_argument, NULL, 34},
+                                       {"pipeline", no_argument, NULL, 35},
+                                       {"sample-block", required_argument, NULL, 36},
+                                       {"export-adjust", required_argument, NULL, 37},
+                                       {"import-adjust", required_argument, NULL, 38},
+                                       {"viterbi-windows", required_argument, NULL, 39},
+                                       {"load-stats", required_argument, NULL, 40},
+                                       {"contigs", required_argument, NULL, 41},
+                                       {"sparse-annotations", required_argument, NULL, 42},
+                                       {"simulate", required_argument, NULL, 43},
+                                       {"benchmark", required_argument, NULL, 44},
+                                       {"benchmark-ref", required_argument, NULL, 45},
+                                       {"stage-times", required_argument, NULL, 46},
+                                       {"previous-adjust", required_argument, NULL, 47},
+                                       {"previous-stats", required_argument, NULL, 48},
+                                       {"recall-tolerance", required_argument, NULL, 49},
                                        {NULL, 0, NULL, 0}};
     int c;
     while ((c = getopt_long(argc, argv, "h?r:R:x:s:S:v:t:T:f:p:o:O:am:g:u:l:", loptions, NULL)) >= 0) {
@@ -2889,6 +5631,67 @@ int run(int argc, char *argv[]) {
             model.lrr_cutoff = strtof(optarg, &tmp);
             if (*tmp) error("Could not parse: --LRR-cutoff %s\n", optarg);
             break;
+        case 31:
+            single_pass = 1;
+            break;
+        case 32:
+            spill_fname = optarg;
+            single_pass = 1;
+            break;
+        case 33:
+            write_cache_fname = optarg;
+            break;
+        case 34:
+            read_cache_fname = optarg;
+            break;
+        case 35:
+            pipeline = 1;
+            break;
+        case 36:
+            sample_block = (int)strtol(optarg, &tmp, 0);
+            if (*tmp || sample_block <= 0) error("Could not parse: --sample-block %s\n", optarg);
+            break;
+        case 37:
+            export_adjust_fname = optarg;
+            break;
+        case 38:
+            import_adjust_fname = optarg;
+            break;
+        case 39:
+            model.viterbi_windows = (int)strtol(optarg, &tmp, 0);
+            if (*tmp || model.viterbi_windows < 0) error("Could not parse: --viterbi-windows %s\n", optarg);
+            break;
+        case 40:
+            load_stats_fname = optarg;
+            break;
+        case 41:
+            contigs_list = optarg;
+            break;
+        case 42:
+            sparse_annot_fname = optarg;
+            break;
+        case 43:
+            simulate_spec = optarg;
+            break;
+        case 44:
+            out_fb = get_file_handle(optarg);
+            break;
+        case 45:
+            bench_ref_fname = optarg;
+            break;
+        case 46:
+            out_ft = get_file_handle(optarg);
+            break;
+        case 47:
+            previous_adjust_fname = optarg;
+            break;
+        case 48:
+            previous_stats_fname = optarg;
+            break;
+        case 49:
+            recall_tolerance = strtof(optarg, &tmp);
+            if (*tmp || recall_tolerance < 0.0f) error("Could not parse: --recall-tolerance %s\n", optarg);
+            break;
         case 'h':
         case '?':
             error("%s", usage_text());
@@ -2922,6 +5725,67 @@ int run(int argc, char *argv[]) {
         error("%s", usage_text());
     }
 
+    if (read_cache_fname && (write_cache_fname || spill_fname)) {
+        fprintf(log_file, "Cannot use option --read-cache with options --write-cache or --spill-file\n");
+        error("%s", usage_text());
+    }
+
+    if (sample_block && (output_fname || single_pass || write_cache_fname || read_cache_fname || pipeline)) {
+        fprintf(log_file,
+                "Cannot use option --sample-block with options --output, --single-pass, --spill-file, --write-cache, "
+                "--read-cache, or --pipeline\n");
+        error("%s", usage_text());
+    }
+
+    if (export_adjust_fname
+        && (import_adjust_fname || output_fname || single_pass || write_cache_fname || read_cache_fname || pipeline)) {
+        fprintf(log_file,
+                "Cannot use option --export-adjust with options --import-adjust, --output, --single-pass, "
+                "--spill-file, --write-cache, --read-cache, or --pipeline\n");
+        error("%s", usage_text());
+    }
+
+    if (load_stats_fname
+        && (computed_gender_fname || call_rate_fname || !isnan(model.lrr_cutoff) || single_pass || write_cache_fname
+            || read_cache_fname || export_adjust_fname)) {
+        fprintf(log_file,
+                "Cannot use option --load-stats with options --sex, --call-rate, --LRR-cutoff, --single-pass, "
+                "--spill-file, --write-cache, --read-cache, or --export-adjust\n");
+        error("%s", usage_text());
+    }
+
+    if (contigs_list && (pipeline || export_adjust_fname)) {
+        fprintf(log_file, "Cannot use option --contigs with options --pipeline or --export-adjust\n");
+        error("%s", usage_text());
+    }
+
+    if (sparse_annot_fname && (sample_block || export_adjust_fname)) {
+        fprintf(log_file, "Cannot use option --sparse-annotations with options --sample-block or --export-adjust\n");
+        error("%s", usage_text());
+    }
+
+    if (bench_ref_fname && !out_fb) {
+        fprintf(log_file, "Option --benchmark-ref requires option --benchmark\n");
+        error("%s", usage_text());
+    }
+
+    if (import_adjust_fname && (write_cache_fname || read_cache_fname)) {
+        fprintf(log_file, "Cannot use option --import-adjust with options --write-cache or --read-cache\n");
+        error("%s", usage_text());
+    }
+
+    if (!previous_adjust_fname != !previous_stats_fname || (previous_adjust_fname && !import_adjust_fname)) {
+        fprintf(log_file, "Options --previous-adjust and --previous-stats require each other and --import-adjust\n");
+        error("%s", usage_text());
+    }
+
+    if (previous_adjust_fname && (output_fname || load_stats_fname || pipeline || sparse_annot_fname)) {
+        fprintf(log_file,
+                "Cannot use option --previous-adjust with options --output, --load-stats, --pipeline, or "
+                "--sparse-annotations\n");
+        error("%s", usage_text());
+    }
+
     // parse parameters defining hidden states
     model.bdev_lrr_baf = read_list_invf(bdev_lrr_baf, &model.bdev_lrr_baf_n, -0.5f, 0.25f);
     model.bdev_baf_phase = read_list_invf(bdev_baf_phase, &model.bdev_baf_phase_n, 0.0f, 0.5f);
@@ -2930,7 +5794,6 @@ int run(int argc, char *argv[]) {
     if (cnp_fname) {
         model.cnp_idx = regidx_init(cnp_fname, cnp_parse, NULL, sizeof(int), NULL);
         if (!model.cnp_idx) error("Error: failed to initialize CNP regions: --cnp %s\n", cnp_fname);
-        model.cnp_itr = regitr_init(model.cnp_idx);
     }
 
     // input VCF
@@ -2940,6 +5803,16 @@ int run(int argc, char *argv[]) {
     } else
         input_fname = argv[optind];
     if (!input_fname) error("%s", usage_text());
+    if (simulate_spec) {
+        if (strcmp(input_fname, "-") == 0) error("Option --simulate requires a file name for the input VCF\n");
+        sim_t sim;
+        sim_parse(&sim, simulate_spec);
+        sim_write(&sim, input_fname, log_file);
+    }
+    stage_times_on = out_ft || out_fb;
+    bench_t bench;
+    memset(&bench, 0, sizeof(bench_t));
+    bench.t0 = bench_clock();
 
     // read in the regions from the command line
     if (targets_list) {
@@ -2969,9 +5842,19 @@ int run(int argc, char *argv[]) {
             "Error: input VCF has no GC info field: use \"--LRR-GC-order 0/-1\" to disable LRR "
             "adjustment through GC correction\n");
 
+    if ((export_adjust_fname || import_adjust_fname) && (model.flags & WGS_DATA))
+        error("Error: options --export-adjust and --import-adjust require the LRR and BAF format fields\n");
+
     // read gender information if provided
     if (computed_gender_fname) computed_gender = mocha_parse_gender(hdr, computed_gender_fname);
 
+    // the genders of a subset of the samples are inferred with the LRR cutoff of the whole cohort
+    if (import_adjust_fname) {
+        model.adjust_table = adjust_table_load(import_adjust_fname, hdr);
+        if (!computed_gender_fname && isnan(model.lrr_cutoff)) model.lrr_cutoff = model.adjust_table->lrr_cutoff;
+    }
+    if (previous_adjust_fname) model.prev_adjust_table = adjust_table_load(previous_adjust_fname, hdr);
+
     // read call rate information if provided
     if (call_rate_fname) call_rate = mocha_parse_float(hdr, call_rate_fname);
 
@@ -2986,6 +5869,8 @@ int run(int argc, char *argv[]) {
     if (sr->apply_filters) fprintf(log_file, "Filters: %s\n", sr->apply_filters);
     if (filter_fname) fprintf(log_file, "Variants: %s\n", filter_fname);
     if (cnp_fname) fprintf(log_file, "Regions to genotype: %s\n", cnp_fname);
+    if (import_adjust_fname) fprintf(log_file, "Adjustments: %s\n", import_adjust_fname);
+    if (previous_adjust_fname) fprintf(log_file, "Previous adjustments: %s\n", previous_adjust_fname);
     fprintf(log_file, "BAF deviations for LRR+BAF model: %s\n", bdev_lrr_baf);
     fprintf(log_file, "BAF deviations for BAF+phase model: %s\n", bdev_baf_phase);
     if (model.flags & WGS_DATA) {
@@ -3046,6 +5931,31 @@ int run(int argc, char *argv[]) {
         out_hdr = print_hdr(out_fh, hdr, argc, argv, record_cmd_line, model.flags);
     }
 
+    // with --pipeline the output is annotated through a second reader with the same settings
+    bcf_srs_t *out_sr = NULL;
+    if (pipeline && output_fname) {
+        out_sr = bcf_sr_init();
+        bcf_sr_set_opt(out_sr, BCF_SR_REQUIRE_IDX);
+        out_sr->apply_filters = sr->apply_filters;
+        if (targets_list && bcf_sr_set_targets(out_sr, targets_list, targets_is_file, 0) < 0)
+            error("Failed to read the targets: %s\n", targets_list);
+        if (!bcf_sr_add_reader(out_sr, input_fname))
+            error("Failed to open %s: %s\n", input_fname, bcf_sr_strerror(out_sr->errnum));
+        if (filter_fname && !bcf_sr_add_reader(out_sr, filter_fname))
+            error("Failed to open %s: %s\n", filter_fname, bcf_sr_strerror(out_sr->errnum));
+        if (n_threads)
+            for (int i = 0; i < out_sr->nreaders; i++)
+                hts_set_opt(out_sr->readers[i].file, HTS_OPT_THREAD_POOL, sr->p);
+        // the samples dropped with --force-samples have to be dropped by the writer as well
+        if (sample_names) {
+            bcf_hdr_t *out_sr_hdr = bcf_sr_get_header(out_sr, 0);
+            int ret = bcf_hdr_set_samples(out_sr_hdr, sample_names, sample_is_file);
+            if (ret < 0 || (ret > 0 && !force_samples)) error("Error parsing the sample list\n");
+            if (bcf_hdr_nsamples(out_sr_hdr) != bcf_hdr_nsamples(hdr))
+                error("Error: the samples of the writer do not match those of the reader\n");
+        }
+    }
+
     int nsmpl = bcf_hdr_nsamples(hdr);
     if (nsmpl == 0) error("No samples in the VCF?\n");
     if (!(model.flags & NO_LOG)) fprintf(log_file, "Loading %d sample(s) from the VCF file\n", nsmpl);
@@ -3082,19 +5992,110 @@ int run(int argc, char *argv[]) {
         sample[i].y_nonpar_lrr_median = NAN;
         sample[i].mt_lrr_median = NAN;
     }
+    if (load_stats_fname) mocha_parse_stats(sample, nsmpl, hdr, load_stats_fname, model.lrr_gc_order, model.flags);
+
+    // contigs to call, the others are still read for the statistics unless these are loaded
+    int8_t *call_ctg = NULL;
+    if (contigs_list) {
+        call_ctg = (int8_t *)calloc(hdr->n[BCF_DT_CTG], sizeof(int8_t));
+        int n_list;
+        char **list = hts_readlist(contigs_list, 0, &n_list);
+        if (!list) error("Failed to read the contigs: %s\n", contigs_list);
+        for (int i = 0; i < n_list; i++) {
+            int rid = bcf_hdr_name2id(hdr, list[i]);
+            if (rid < 0) error("Error: contig %s not found in the input VCF header\n", list[i]);
+            call_ctg[rid] = 1;
+            free(list[i]);
+        }
+        free(list);
+    }
 
-    for (int rid = 0; rid < hdr->n[BCF_DT_CTG]; rid++) {
-        model.rid = rid;
-        get_contig(sr, sample, &model);
-        if (model.n <= 0) continue;
-        if (!(model.flags & NO_LOG))
-            fprintf(log_file, "Read %d variants from contig %s\n", model.n, bcf_hdr_id2name(hdr, rid));
-        if (model.genome_rules->length[rid] < model.locus_arr[model.n - 1].pos)
-            model.genome_rules->length[rid] = model.locus_arr[model.n - 1].pos;
-        for (int j = 0; j < nsmpl; j++) sample_stats(sample + j, &model);
+    // samples are only read in blocks with WGS data, as array data is adjusted using all samples
+    if (sample_block && !(model.flags & WGS_DATA))
+        error("Error: option --sample-block requires the AD format field in the input VCF\n");
+    if (!sample_block || sample_block > nsmpl) sample_block = nsmpl;
+    model.block_beg = 0;
+    model.block_end = nsmpl;
+
+    pool_t pool;
+    pool_init(&pool, sample, nsmpl, &model, n_threads);
+
+    // when genders are inferred the adjustments on chromosome X depend on them, so X has to be read again
+    int cache_x = computed_gender != NULL || (model.flags & WGS_DATA);
+    contig_cache_t *cache = NULL;
+    if (read_cache_fname) {
+        cache = contig_cache_load(read_cache_fname, hdr, sample, nsmpl, &model, rules, cache_x, input_fname,
+                                  filter_fname, sr->apply_filters, targets_list);
+    } else if (write_cache_fname) {
+        cache = contig_cache_init(write_cache_fname, 1);
+        contig_cache_write_header(cache, hdr, sample, nsmpl, &model, rules, cache_x, input_fname, filter_fname,
+                                  sr->apply_filters, targets_list);
+    } else if (single_pass) {
+        cache = contig_cache_init(spill_fname, 0);
     }
 
-    sample_summary(sample, nsmpl, &model, computed_gender == NULL);
+    contig_pipeline_t *pl = NULL;
+    if (pipeline) {
+        pl = (contig_pipeline_t *)malloc(sizeof(contig_pipeline_t));
+        contig_pipeline_init(pl, sr, out_sr, cache, out_fh, out_hdr, nsmpl, &model);
+        contig_pipeline_set_samples(pl, sample);
+    }
+
+    // contigs read during the first pass are added to the cache, unless it was loaded from a file
+    int put = cache && !read_cache_fname;
+    // the sites restored from the cache are decoded by the workers, unless they are needed once the samples are done
+    if (cache) cache->packed = !pl;
+    int x_rid = cache_x ? -1 : model.genome_rules->x_rid;
+    int n_ctg = hdr->n[BCF_DT_CTG];
+    stage_times_t *ctg_times = (stage_times_t *)calloc(n_ctg, sizeof(stage_times_t));
+    if (pl && n_ctg > 0 && !load_stats_fname) contig_pipeline_decode(pl, 0, put && x_rid != 0);
+    for (int rid = 0; rid < (load_stats_fname ? 0 : n_ctg); rid++) {
+        // with --sample-block each contig is read once for each block of samples
+        for (int beg = 0; beg < nsmpl; beg += sample_block) {
+            double t0 = bench_clock(), c0 = bench_cpu_clock(1);
+            if (pl) {
+                contig_pipeline_get(pl, sample, &model);
+                if (rid + 1 < n_ctg) contig_pipeline_decode(pl, rid + 1, put && x_rid != rid + 1);
+            } else {
+                model.rid = rid;
+                model.block_beg = beg;
+                model.block_end = beg + sample_block < nsmpl ? beg + sample_block : nsmpl;
+                read_contig(sr, cache, put && x_rid != rid, sample, nsmpl, &model);
+            }
+            stage_times_stop(&ctg_times[rid], BENCH_INGEST, t0, c0);
+            ctg_times[rid].n_bytes += model.n_bytes;
+            if (model.n <= 0) break;
+            if (beg == 0 && !(model.flags & NO_LOG))
+                fprintf(log_file, "Read %d variants from contig %s\n", model.n, bcf_hdr_id2name(hdr, rid));
+            if (model.genome_rules->length[rid] < model.locus_arr[model.n - 1].pos)
+                model.genome_rules->length[rid] = model.locus_arr[model.n - 1].pos;
+            pool.sample = sample + model.block_beg;
+            pool.n = model.block_end - model.block_beg;
+            t0 = bench_clock();
+            pool_run(&pool, 1);
+            ctg_times[rid].wall[BENCH_STATS] += bench_clock() - t0;
+            pool_take_times(&pool, &ctg_times[rid]);
+            if (sample_block < nsmpl) release_block(sample, model.block_beg, model.block_end);
+        }
+    }
+
+    if (!load_stats_fname) sample_summary(sample, nsmpl, &model, computed_gender == NULL);
+
+    // samples of the previous run are only called again if the shifts of their clusters moved past the tolerance
+    if (model.prev_adjust_table) {
+        int8_t *is_prev = mocha_parse_samples(hdr, previous_stats_fname);
+        int n_keep = 0;
+        for (int i = 0; i < nsmpl; i++) {
+            sample[i].keep_calls = is_prev[sample[i].idx] && sample[i].adjust_change <= recall_tolerance;
+            n_keep += sample[i].keep_calls;
+        }
+        free(is_prev);
+        adjust_table_destroy(model.prev_adjust_table);
+        model.prev_adjust_table = NULL;
+        if (!(model.flags & NO_LOG))
+            fprintf(log_file, "Keeping the previous calls of %d sample(s) and calling %d sample(s)\n", n_keep,
+                    nsmpl - n_keep);
+    }
     int cnt[3] = {0, 0, 0};
     for (int i = 0; i < nsmpl; i++) cnt[sample[i].computed_gender]++;
     if (!(model.flags & NO_LOG))
@@ -3102,7 +6103,7 @@ int run(int argc, char *argv[]) {
                 cnt[GENDER_UNKNOWN], cnt[GENDER_MALE], cnt[GENDER_FEMALE]);
     mocha_print_stats(out_fg, sample, nsmpl, model.lrr_gc_order, hdr, model.flags);
 
-    if (computed_gender == NULL) {
+    if (computed_gender == NULL && !load_stats_fname) {
         if (isnan(model.lrr_cutoff))
             error(
                 "Error: Unable to estimate LRR cutoff. Make sure "
@@ -3113,28 +6114,106 @@ int run(int argc, char *argv[]) {
             fprintf(log_file, "Cutoff between LRR for haploid and diploid: %.2f\n", model.lrr_cutoff);
     }
 
-    for (int rid = 0; rid < hdr->n[BCF_DT_CTG]; rid++) {
-        model.rid = rid;
-        get_contig(sr, sample, &model);
-        if (model.n <= 0) continue;
-        if (!(model.flags & NO_LOG))
-            fprintf(log_file, "Read %d variants from contig %s\n", model.n, bcf_hdr_id2name(hdr, rid));
-        for (int j = 0; j < nsmpl; j++) {
-            if (model.cnp_idx)
-                regidx_overlap(model.cnp_idx, bcf_hdr_id2name(hdr, rid), 0, model.genome_rules->length[rid],
-                               model.cnp_itr);
-            sample_run(sample + j, &mocha_table, &model);
-        }
+    // with --export-adjust the contigs are read again only to write the adjustments computed with the final genders
+    if (export_adjust_fname) {
+        model.adjust_fh = hts_open(export_adjust_fname, "wb");
+        if (model.adjust_fh == NULL) error("Cannot write to \"%s\": %s\n", export_adjust_fname, strerror(errno));
+        if (n_threads) hts_set_opt(model.adjust_fh, HTS_OPT_THREAD_POOL, sr->p);
+        model.adjust_hdr = adjust_hdr_init(model.adjust_fh, hdr, model.lrr_cutoff);
+    }
 
-        if (output_fname) {
+    contig_cache_t *annot = sparse_annot_fname ? annot_writer_init(sparse_annot_fname, hdr, sample, nsmpl) : NULL;
+
+    // the genders are now final and the contigs are read again
+    if (cache) cache->packed = !pl && !output_fname && !annot;
+    if (pl) {
+        contig_pipeline_set_samples(pl, sample);
+        if (n_ctg > 0) contig_pipeline_decode(pl, 0, 0);
+    }
+    for (int rid = 0; rid < n_ctg; rid++) {
+        if (call_ctg && !call_ctg[rid]) continue;
+        stage_times_t *times = &ctg_times[rid];
+        for (int beg = 0; beg < nsmpl; beg += sample_block) {
+            double t0 = bench_clock(), c0 = bench_cpu_clock(1);
+            if (pl) {
+                contig_pipeline_get(pl, sample, &model);
+                if (rid + 1 < n_ctg) contig_pipeline_decode(pl, rid + 1, 0);
+            } else {
+                model.rid = rid;
+                model.block_beg = beg;
+                model.block_end = beg + sample_block < nsmpl ? beg + sample_block : nsmpl;
+                read_contig(sr, cache, 0, sample, nsmpl, &model);
+            }
+            stage_times_stop(times, BENCH_INGEST, t0, c0);
+            times->n_bytes += model.n_bytes;
+            if (model.n <= 0) break;
+            if (beg == 0) times->n_sites += model.n;
+            for (int j = model.block_beg; j < model.block_end; j++) times->n_site_samples += sample[j].n;
+            if (beg == 0 && !(model.flags & NO_LOG))
+                fprintf(log_file, "Read %d variants from contig %s\n", model.n, bcf_hdr_id2name(hdr, rid));
+            if (export_adjust_fname) continue;
+            // the contig lengths are otherwise set while computing the statistics
+            if (model.genome_rules->length[rid] < model.locus_arr[model.n - 1].pos)
+                model.genome_rules->length[rid] = model.locus_arr[model.n - 1].pos;
+            pool.chr = bcf_hdr_id2name(hdr, rid);
+            pool.sample = sample + model.block_beg;
+            pool.n = model.block_end - model.block_beg;
+            t0 = bench_clock();
+            pool_run(&pool, 0);
+            pool_merge(&pool, &mocha_table);
+            times->wall[BENCH_CALLS] += bench_clock() - t0;
+            pool_take_times(&pool, times);
+            if (sample_block < nsmpl) release_block(sample, model.block_beg, model.block_end);
+        }
+        if (model.n <= 0) continue;
+        double t0 = bench_clock(), c0 = bench_cpu_clock(1);
+        if (annot) annot_put_contig(annot, sample, nsmpl, &model);
+
+        // the output requires a single block of samples
+        if (output_fname && pl) {
+            // the wait for the previous contig to be written is charged to that contig, which is then complete
+            stage_times_stop(times, BENCH_OUTPUT, t0, c0);
+            int prev_rid = pl->prev.model.rid;
+            t0 = bench_clock();
+            c0 = bench_cpu_clock(1);
+            int nret = contig_pipeline_flush(pl);
+            if (nret >= 0 && !(model.flags & NO_LOG))
+                fprintf(log_file, "Written %d variants for contig %s\n", nret, bcf_hdr_id2name(hdr, prev_rid));
+            if (prev_rid >= 0) {
+                stage_times_stop(&ctg_times[prev_rid], BENCH_OUTPUT, t0, c0);
+                if (out_ft && !(model.flags & NO_LOG)) stage_times_log(log_file, &ctg_times[prev_rid], hdr, prev_rid);
+            }
+            t0 = bench_clock();
+            c0 = bench_cpu_clock(1);
+            contig_pipeline_put(pl, sample, &model);
+        } else if (output_fname) {
             int nret = put_contig(sr, sample, &model, out_fh, out_hdr);
             if (!(model.flags & NO_LOG))
                 fprintf(log_file, "Written %d variants for contig %s\n", nret, bcf_hdr_id2name(hdr, rid));
         }
+        stage_times_stop(times, BENCH_OUTPUT, t0, c0);
+        if (out_ft && !(model.flags & NO_LOG) && !(output_fname && pl)) stage_times_log(log_file, times, hdr, rid);
+    }
+    if (pl) {
+        double t0 = bench_clock(), c0 = bench_cpu_clock(1);
+        int prev_rid = pl->prev.model.rid;
+        int nret = contig_pipeline_flush(pl);
+        if (nret >= 0 && !(model.flags & NO_LOG))
+            fprintf(log_file, "Written %d variants for contig %s\n", nret, bcf_hdr_id2name(hdr, prev_rid));
+        contig_pipeline_destroy(pl);
+        free(pl);
+        if (prev_rid >= 0) {
+            stage_times_stop(&ctg_times[prev_rid], BENCH_OUTPUT, t0, c0);
+            if (out_ft && !(model.flags & NO_LOG) && output_fname)
+                stage_times_log(log_file, &ctg_times[prev_rid], hdr, prev_rid);
+        }
     }
+    for (int rid = 0; rid < n_ctg; rid++) stage_times_add(&bench.times, &ctg_times[rid]);
+    stage_times_print(out_ft, ctg_times, hdr);
+    free(ctg_times);
 
     // estimate LRR at common autosomal losses and gains
-    if (!(model.flags & NO_LOG) && model.cnp_itr) {
+    if (!(model.flags & NO_LOG) && model.cnp_idx) {
         int n_cnp_loss = 0, n_cnp_gain = 0, n_rare_gain = 0, n_rare_loss = 0;
         float *cnp_ldev = (float *)malloc(mocha_table.n * sizeof(float));
         float *rare_ldev = (float *)malloc(mocha_table.n * sizeof(float));
@@ -3171,19 +6250,46 @@ int run(int argc, char *argv[]) {
         free(sample[j].phase_arr);
     }
 
+    if (model.adjust_fh) {
+        bcf_hdr_destroy(model.adjust_hdr);
+        if (hts_close(model.adjust_fh) < 0) error("Close failed: %s\n", export_adjust_fname);
+    }
+    if (model.adjust_table) adjust_table_destroy(model.adjust_table);
+    free(call_ctg);
+
+    // clear worker data
+    bench_collect(&bench, &pool);
+    pool_destroy(&pool);
+    if (cache) contig_cache_destroy(cache, hdr);
+    if (annot) contig_cache_destroy(annot, hdr);
+
     // clear model data
     free(model.locus_arr);
+    free(model.adjust_arr);
     free(model.gc_arr);
     free(model.bdev_lrr_baf);
     free(model.bdev_baf_phase);
     genome_destroy(model.genome_rules);
 
-    // free precomputed tables
-    ad_to_lrr_baf(NULL, NULL, NULL, NULL, 0);
-
     // write table with mosaic chromosomal alterations (and UCSC bed track)
     mocha_print_calls(out_fm, mocha_table.a, mocha_table.n, hdr, model.flags, rules, model.lrr_hap2dip);
     mocha_print_ucsc(out_fu, mocha_table.a, mocha_table.n, hdr);
+
+    // with --benchmark-ref the calls are written again to memory to be compared with the reference table
+    int n_diff = -1, n_lines = 0, n_ref_lines = 0;
+    if (bench_ref_fname) {
+        char *calls = NULL;
+        size_t size = 0;
+        FILE *fp = open_memstream(&calls, &size);
+        if (!fp) error("Failed to write the calls to memory\n");
+        mocha_print_calls(fp, mocha_table.a, mocha_table.n, hdr, model.flags, rules, model.lrr_hap2dip);
+        n_diff = bench_compare(calls, size, bench_ref_fname, &n_lines, &n_ref_lines);
+        free(calls);
+        if (n_diff > 0 && !(model.flags & NO_LOG))
+            fprintf(log_file, "Warning: %d line(s) of the calls differ from the reference %s\n", n_diff,
+                    bench_ref_fname);
+    }
+    bench_print(out_fb, &bench, nsmpl, n_diff, n_lines, n_ref_lines);
     free(mocha_table.a);
 
     // close output VCF
@@ -3196,11 +6302,8 @@ int run(int argc, char *argv[]) {
 
     // clean up
     if (model.cnp_idx) regidx_destroy(model.cnp_idx);
-    if (model.cnp_itr) regitr_destroy(model.cnp_itr);
     bcf_sr_destroy(sr);
+    if (out_sr) bcf_sr_destroy(out_sr);
     free(sample);
-
-    beta_binom_destroy(beta_binom_null);
-    beta_binom_destroy(beta_binom_alt);
     return 0;
 }
@@ -31,6 +31,9 @@
 #ifndef __MOCHA_H__
 #define __MOCHA_H__
 
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <htslib/kseq.h>
 #include <htslib/ksort.h>
 #include <htslib/vcf.h>
@@ -100,21 +103,34 @@ static inline float *mocha_parse_float(bcf_hdr_t *hdr, char *fname) {
     return float_arr;
 }
 
-// compute the median of a vector using the ksort library (with iterator)
-float get_median(const float *v, int n, const int *imap) {
+// compute the median of a vector using the ksort library (with iterator and a buffer of at least n floats), with an
+// even number of values this is the mean of the two middle values, while previously the upper middle value was
+// averaged with whichever value ks_ksmall happened to leave before it, so results with even counts can differ
+float get_median_buf(const float *v, int n, const int *imap, float *w) {
     if (n == 0) return NAN;
-    float tmp, *w = (float *)malloc(n * sizeof(float));
+    float tmp;
     int j = 0;
     for (int i = 0; i < n; i++) {
         tmp = imap ? v[imap[i]] : v[i];
         if (!isnan(tmp)) w[j++] = tmp;
     }
-    if (j == 0) {
-        free(w);
-        return NAN;
-    }
+    if (j == 0) return NAN;
     float ret = ks_ksmall_float((size_t)j, w, (size_t)j / 2);
-    if (j % 2 == 0) ret = (ret + w[j / 2 - 1]) * 0.5f;
+    if (j % 2 == 0) {
+        // ks_ksmall leaves the lower half unsorted, so its largest element has to be searched
+        float lower = w[0];
+        for (int i = 1; i < j / 2; i++)
+            if (w[i] > lower) lower = w[i];
+        ret = (ret + lower) * 0.5f;
+    }
+    return ret;
+}
+
+// compute the median of a vector using the ksort library (with iterator)
+float get_median(const float *v, int n, const int *imap) {
+    if (n == 0) return NAN;
+    float *w = (float *)malloc(n * sizeof(float));
+    float ret = get_median_buf(v, n, imap, w);
     free(w);
     return ret;
 }
@@ -285,4 +301,142 @@ int bcf_get_allelic_depth(const bcf_fmt_t *fmt, const int16_t *gt0_arr, const in
     return 1;
 }
 
+/****************************************
+ * SPARSE ANNOTATIONS                   *
+ ****************************************/
+
+// the Ldev, Bdev, and Bdev_Phase annotations of each sample written by mocha --sparse-annotations, as runs of
+// positions with the same nonzero Ldev and Bdev and as the positions with a nonzero Bdev_Phase, for each contig, with
+// an index of the contigs at the end of the file
+#define ANNOT_MAGIC "MOCHAAN\x01"
+
+typedef struct {
+    int beg, end; // first and last position of the run
+    float ldev, bdev;
+} annot_run_t;
+
+typedef struct {
+    int n_runs, m_runs;
+    annot_run_t *runs;
+    int n_phase, m_phase_pos, m_phase;
+    int *phase_pos;
+    int8_t *phase;
+    int run_k, phase_k, last_pos; // cursors of the last position queried
+} annot_sample_t;
+
+typedef struct {
+    FILE *fp;
+    const char *fname;
+    int nsmpl;
+    char **names;
+    int n_ctg;
+    char **ctg_names;
+    int64_t *ctg_off;
+    int ctg; // contig loaded, -1 if none
+    annot_sample_t *a;
+} annot_reader_t;
+
+static inline void annot_read(annot_reader_t *self, void *ptr, size_t size) {
+    if (size && fread(ptr, 1, size, self->fp) != size) error("Error: annotations file %s is truncated\n", self->fname);
+}
+
+static inline char *annot_read_str(annot_reader_t *self) {
+    int len;
+    annot_read(self, &len, sizeof(int));
+    if (len < 0) error("Error: annotations file %s is truncated\n", self->fname);
+    char *str = (char *)malloc(len + 1);
+    annot_read(self, str, len);
+    str[len] = '\0';
+    return str;
+}
+
+static inline annot_reader_t *annot_reader_init(const char *fname) {
+    annot_reader_t *self = (annot_reader_t *)calloc(1, sizeof(annot_reader_t));
+    self->fname = fname;
+    self->fp = fopen(fname, "rb");
+    if (!self->fp) error("Failed to open %s: %s\n", fname, strerror(errno));
+    char magic[8];
+    annot_read(self, magic, 8);
+    if (memcmp(magic, ANNOT_MAGIC, 8)) error("Error: %s is not an annotations file\n", fname);
+    annot_read(self, &self->nsmpl, sizeof(int));
+    self->names = (char **)malloc(self->nsmpl * sizeof(char *));
+    for (int j = 0; j < self->nsmpl; j++) self->names[j] = annot_read_str(self);
+    self->a = (annot_sample_t *)calloc(self->nsmpl, sizeof(annot_sample_t));
+
+    int64_t index_offset;
+    if (fseeko(self->fp, -(off_t)sizeof(int64_t), SEEK_END) < 0) error("Error: failed to seek in %s\n", fname);
+    annot_read(self, &index_offset, sizeof(int64_t));
+    if (fseeko(self->fp, (off_t)index_offset, SEEK_SET) < 0) error("Error: failed to seek in %s\n", fname);
+    annot_read(self, &self->n_ctg, sizeof(int));
+    self->ctg_names = (char **)malloc(self->n_ctg * sizeof(char *));
+    self->ctg_off = (int64_t *)malloc(self->n_ctg * sizeof(int64_t));
+    for (int k = 0; k < self->n_ctg; k++) {
+        int64_t size;
+        self->ctg_names[k] = annot_read_str(self);
+        annot_read(self, &self->ctg_off[k], sizeof(int64_t));
+        annot_read(self, &size, sizeof(int64_t));
+    }
+    self->ctg = -1;
+    return self;
+}
+
+static inline int annot_reader_sample(const annot_reader_t *self, const char *name) {
+    for (int j = 0; j < self->nsmpl; j++)
+        if (strcmp(self->names[j], name) == 0) return j;
+    return -1;
+}
+
+// loads the annotations of a contig, samples have no annotations if the contig is not in the file
+static inline void annot_reader_load(annot_reader_t *self, const char *chr) {
+    self->ctg = -1;
+    for (int k = 0; k < self->n_ctg; k++)
+        if (strcmp(self->ctg_names[k], chr) == 0) self->ctg = k;
+    if (self->ctg >= 0 && fseeko(self->fp, (off_t)self->ctg_off[self->ctg], SEEK_SET) < 0)
+        error("Error: failed to seek in %s\n", self->fname);
+    for (int j = 0; j < self->nsmpl; j++) {
+        annot_sample_t *sample = &self->a[j];
+        sample->n_runs = sample->n_phase = sample->run_k = sample->phase_k = sample->last_pos = 0;
+        if (self->ctg < 0) continue;
+        annot_read(self, &sample->n_runs, sizeof(int));
+        hts_expand(annot_run_t, sample->n_runs, sample->m_runs, sample->runs);
+        annot_read(self, sample->runs, sample->n_runs * sizeof(annot_run_t));
+        annot_read(self, &sample->n_phase, sizeof(int));
+        hts_expand(int, sample->n_phase, sample->m_phase_pos, sample->phase_pos);
+        hts_expand(int8_t, sample->n_phase, sample->m_phase, sample->phase);
+        annot_read(self, sample->phase_pos, sample->n_phase * sizeof(int));
+        annot_read(self, sample->phase, sample->n_phase * sizeof(int8_t));
+    }
+}
+
+// positions are expected in increasing order within a contig, otherwise the cursors are moved back to the beginning
+static inline void annot_reader_get(annot_reader_t *self, int j, int pos, float *ldev, float *bdev, int *phase) {
+    annot_sample_t *sample = &self->a[j];
+    if (pos < sample->last_pos) sample->run_k = sample->phase_k = 0;
+    sample->last_pos = pos;
+    while (sample->run_k < sample->n_runs && sample->runs[sample->run_k].end < pos) sample->run_k++;
+    while (sample->phase_k < sample->n_phase && sample->phase_pos[sample->phase_k] < pos) sample->phase_k++;
+    int in_run = sample->run_k < sample->n_runs && sample->runs[sample->run_k].beg <= pos;
+    *ldev = in_run ? sample->runs[sample->run_k].ldev : 0.0f;
+    *bdev = in_run ? sample->runs[sample->run_k].bdev : 0.0f;
+    *phase = sample->phase_k < sample->n_phase && sample->phase_pos[sample->phase_k] == pos
+                 ? sample->phase[sample->phase_k]
+                 : 0;
+}
+
+static inline void annot_reader_destroy(annot_reader_t *self) {
+    for (int j = 0; j < self->nsmpl; j++) {
+        free(self->names[j]);
+        free(self->a[j].runs);
+        free(self->a[j].phase_pos);
+        free(self->a[j].phase);
+    }
+    for (int k = 0; k < self->n_ctg; k++) free(self->ctg_names[k]);
+    free(self->names);
+    free(self->ctg_names);
+    free(self->ctg_off);
+    free(self->a);
+    fclose(self->fp);
+    free(self);
+}
+
 #endif
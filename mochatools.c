@@ -29,6 +29,7 @@
 #include <getopt.h>
 #include <htslib/vcf.h>
 #include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
 #include <htslib/kfunc.h>
 #include "mocha.h"
 #include "bcftools.h"
@@ -36,6 +37,32 @@
 #define MOCHATOOLS_VERSION "2020-08-13"
 
 #define GC_WIN_DFLT "200"
+#define GC_CHUNK_SIZE 1048576 // length of the reference chunks loaded to compute GC and CpG content
+
+#define SITE_JOB_MIN 4096 // minimum number of samples counted by a worker job
+
+typedef struct {
+    int at, cg, cpg;
+} gc_sum_t;
+
+// counts at a site across a range of samples
+typedef struct {
+    int beg, end;
+    int gt_phase, fmt_sign, ad, baf; // formats available at the site
+    const bcf_fmt_t *baf_fmt;
+    int ac_het, ac_sex[4], ac_het_sex[2], ac_het_phase[2], fmt_bal[2], fmt_bal_phase[2], ad_het[2];
+    float *baf_arr[2]; // BAF at heterozygous sites of the samples in the range with each genotype phase
+} site_job_t;
+
+// GC and CpG content of a chunk of the reference, kept as prefix sums so that each window is computed in constant
+// time
+typedef struct {
+    int rid;      // contig of the chunk, -1 if none is loaded
+    int len;      // length of the contig
+    int beg, end; // chunk [beg, end] loaded
+    gc_sum_t *sum;
+    int m_sum;
+} gc_cache_t;
 
 static inline double sq(double x) { return x * x; }
 
@@ -51,8 +78,20 @@ typedef struct {
     int8_t *gt_phase_arr, *fmt_sign_arr;
     int16_t *gt0_arr, *gt1_arr, *ad0_arr, *ad1_arr;
     float *baf_arr[2];
+    float *median_buf;  // buffer for get_median_buf()
+    uint32_t *sort_buf; // buffer for radix_sort_float()
     int *imap_arr;
+    site_job_t *jobs;
+    int n_jobs;
+    hts_tpool *tpool;
+    hts_tpool_process *q;
     faidx_t *fai;
+    gc_cache_t gc_cache;
+    annot_reader_t *annot; // sparse annotations written by mocha
+    int *annot_imap;       // index of each sample in the sparse annotations, -1 if missing
+    int annot_rid;
+    float *ldev_arr, *bdev_arr;
+    int *bdev_phase_arr;
     bcf_hdr_t *in_hdr, *out_hdr;
 } args_t;
 
@@ -85,6 +124,9 @@ const char *usage(void) {
            "   -S, --samples-file [^]<file>  file of samples to include (or exclude with \"^\" prefix)\n"
            "       --force-samples           only warn about unknown subset samples\n"
            "   -G, --drop-genotypes          drop individual genotype information (after running statistical tests)\n"
+           "       --sparse-annotations <file> add Ldev, Bdev, and Bdev_Phase from a mocha --sparse-annotations "
+           "file\n"
+           "       --threads <int>           number of extra threads to count the samples at each site [0]\n"
            "\n"
            "Example:\n"
            "    bcftools +mochatools file.bcf -- --balance Bdev_Phase --drop-genotypes\n"
@@ -103,7 +145,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     int sites_only = 0;
     char *sample_names = NULL;
     char *gender_fname = NULL;
+    int n_threads = 0;
     char *ref_fname = NULL;
+    char *annot_fname = NULL;
 
     int c;
     static struct option loptions[] = {{"balance", required_argument, NULL, 'b'},
@@ -118,6 +162,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
                                        {"samples-file", required_argument, NULL, 'S'},
                                        {"force-samples", no_argument, NULL, 3},
                                        {"drop-genotypes", no_argument, NULL, 'G'},
+                                       {"sparse-annotations", required_argument, NULL, 4},
+                                       {"threads", required_argument, NULL, 5},
                                        {NULL, 0, NULL, 0}};
 
     while ((c = getopt_long(argc, argv, "h?b:ax:pf:w:s:S:G", loptions, NULL)) >= 0) {
@@ -161,6 +207,13 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
         case 'G':
             sites_only = 1;
             break;
+        case 4:
+            annot_fname = optarg;
+            break;
+        case 5:
+            n_threads = (int)strtol(optarg, &tmp, 0);
+            if (*tmp || n_threads < 0) error("Could not parse: --threads %s\n", optarg);
+            break;
         case 'h':
         case '?':
         default:
@@ -203,10 +256,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     }
 
     if (gender_fname) args->gender = mocha_parse_gender(args->in_hdr, gender_fname);
+    if (annot_fname && sites_only) error("Cannot use option --sparse-annotations with option --drop-genotypes\n");
 
     if (ref_fname) {
         args->fai = fai_load(ref_fname);
         if (!args->fai) error("Failed to load the fai index: %s\n", ref_fname);
+        args->gc_cache.rid = -1;
         bcf_hdr_append(args->out_hdr,
                        "##INFO=<ID=GC,Number=1,Type=Float,Description=\"GC ratio content "
                        "around the variant\">");
@@ -218,6 +273,29 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     args->nsmpl = bcf_hdr_nsamples(args->in_hdr);
     if (args->nsmpl == 0) return 0;
 
+    if (annot_fname) {
+        args->annot = annot_reader_init(annot_fname);
+        args->annot_imap = (int *)malloc(args->nsmpl * sizeof(int));
+        for (int i = 0; i < args->nsmpl; i++)
+            args->annot_imap[i] = annot_reader_sample(args->annot, args->in_hdr->samples[i]);
+        args->annot_rid = -1;
+        args->ldev_arr = (float *)malloc(args->nsmpl * sizeof(float));
+        args->bdev_arr = (float *)malloc(args->nsmpl * sizeof(float));
+        args->bdev_phase_arr = (int *)malloc(args->nsmpl * sizeof(int));
+        if (bcf_hdr_id2int(args->out_hdr, BCF_DT_ID, "Ldev") < 0)
+            bcf_hdr_append(args->out_hdr,
+                           "##FORMAT=<ID=Ldev,Number=1,Type=Float,Description=\"LRR deviation "
+                           "due to chromosomal alteration\">");
+        if (bcf_hdr_id2int(args->out_hdr, BCF_DT_ID, "Bdev") < 0)
+            bcf_hdr_append(args->out_hdr,
+                           "##FORMAT=<ID=Bdev,Number=1,Type=Float,Description=\"BAF deviation "
+                           "due to chromosomal alteration\">");
+        if (bcf_hdr_id2int(args->out_hdr, BCF_DT_ID, "Bdev_Phase") < 0)
+            bcf_hdr_append(args->out_hdr,
+                           "##FORMAT=<ID=Bdev_Phase,Number=1,Type=Integer,Description=\"BAF "
+                           "deviation phase, if available\">");
+    }
+
     args->gt_id = bcf_hdr_id2int(args->in_hdr, BCF_DT_ID, "GT");
     args->ad_id = bcf_hdr_id2int(args->in_hdr, BCF_DT_ID, "AD");
     args->baf_id = bcf_hdr_id2int(args->in_hdr, BCF_DT_ID, "BAF");
@@ -330,6 +408,27 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     args->baf_arr[0] = (float *)malloc(args->nsmpl * sizeof(float));
     args->baf_arr[1] = (float *)malloc(args->nsmpl * sizeof(float));
     args->imap_arr = (int *)malloc(args->nsmpl * sizeof(int));
+    args->median_buf = (float *)malloc(args->nsmpl * sizeof(float));
+    args->sort_buf = (uint32_t *)malloc(2 * args->nsmpl * sizeof(uint32_t));
+
+    // the main thread counts the last range of samples while the extra threads count the others
+    args->n_jobs = n_threads + 1;
+    if (args->n_jobs > args->nsmpl / SITE_JOB_MIN) args->n_jobs = args->nsmpl / SITE_JOB_MIN;
+    if (args->n_jobs < 1) args->n_jobs = 1;
+    args->jobs = (site_job_t *)calloc(args->n_jobs, sizeof(site_job_t));
+    for (int i = 0; i < args->n_jobs; i++) {
+        site_job_t *job = &args->jobs[i];
+        job->beg = (int)((int64_t)args->nsmpl * i / args->n_jobs);
+        job->end = (int)((int64_t)args->nsmpl * (i + 1) / args->n_jobs);
+        for (int k = 0; k < 2; k++)
+            job->baf_arr[k] = i == 0 ? args->baf_arr[k] : (float *)malloc((job->end - job->beg) * sizeof(float));
+    }
+    if (args->n_jobs > 1) {
+        args->tpool = hts_tpool_init(n_threads);
+        if (!args->tpool) error("Failed to create the thread pool\n");
+        args->q = hts_tpool_process_init(args->tpool, 2 * n_threads, 1);
+        if (!args->q) error("Failed to create the worker queue\n");
+    }
 
     return 0;
 }
@@ -414,13 +513,68 @@ static double welch_t_test(float *a, float *b, int na, int nb) {
 // Petr Danecek's and James Bonfield's implementation in bcftools/bam2bcf.c
 double mann_whitney_1947_cdf(int n, int m, int U);
 
-static int cmpfunc(const void *a, const void *b) { return (*(float *)a > *(float *)b) - (*(float *)a < *(float *)b); }
+#define RADIX_SORT_MIN 64 // arrays shorter than this are sorted by comparisons
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+// sorts floats with three passes of a least significant digit radix sort on their bits, skipping the passes whose
+// digit is the same across all values, using a buffer of at least 2n unsigned integers
+static void radix_sort_float(float *v, int n, uint32_t *buf) {
+    if (n < RADIX_SORT_MIN) {
+        ks_introsort_float((size_t)n, v);
+        return;
+    }
+    int cnt[3][RADIX_SIZE] = {{0}};
+    uint32_t *src = buf, *dst = buf + n;
+    for (int i = 0; i < n; i++) {
+        union {
+            float f;
+            uint32_t u;
+        } x = {v[i]};
+        src[i] = x.u & 0x80000000 ? ~x.u : x.u | 0x80000000; // unsigned keys sort as the floats do
+        for (int k = 0; k < 3; k++) cnt[k][(src[i] >> (k * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+    }
+    for (int k = 0; k < 3; k++) {
+        int shift = k * RADIX_BITS;
+        if (cnt[k][(src[0] >> shift) & (RADIX_SIZE - 1)] == n) continue;
+        for (int d = 0, off = 0; d < RADIX_SIZE; d++) {
+            int c = cnt[k][d];
+            cnt[k][d] = off;
+            off += c;
+        }
+        for (int i = 0; i < n; i++) dst[cnt[k][(src[i] >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+        uint32_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    for (int i = 0; i < n; i++) {
+        union {
+            uint32_t u;
+            float f;
+        } x = {src[i] & 0x80000000 ? src[i] & 0x7FFFFFFF : ~src[i]};
+        v[i] = x.f;
+    }
+}
+
+#define MWU_EXACT_MAX 8 // sample sizes below which the Mann-Whitney U p-value is computed exactly
+
+// exact Mann-Whitney U p-values, memoized by sample sizes and statistic
+static double mann_whitney_exact(int na, int nb, int U) {
+    static double pval[MWU_EXACT_MAX][MWU_EXACT_MAX][MWU_EXACT_MAX * MWU_EXACT_MAX];
+    static int8_t done[MWU_EXACT_MAX][MWU_EXACT_MAX][MWU_EXACT_MAX * MWU_EXACT_MAX];
+    if (!done[na][nb][U]) {
+        double p = 2.0 * mann_whitney_1947_cdf(na, nb, U);
+        pval[na][nb][U] = p > 1.0 ? 1.0 : p;
+        done[na][nb][U] = 1;
+    }
+    return pval[na][nb][U];
+}
 
 // it currently does not handle nans
 // adapted from Petr Danecek's implementation of calc_mwu_bias_cdf() in bcftools/bam2bcf.c
-static double mann_whitney_u(float *a, float *b, int na, int nb) {
-    qsort(a, (size_t)na, sizeof(float), cmpfunc);
-    qsort(b, (size_t)nb, sizeof(float), cmpfunc);
+static double mann_whitney_u(float *a, float *b, int na, int nb, uint32_t *buf) {
+    radix_sort_float(a, na, buf);
+    radix_sort_float(b, nb, buf);
 
     int i = 0, j = 0, ca, cb;
     double U = 0, ties = 0;
@@ -443,7 +597,7 @@ static double mann_whitney_u(float *a, float *b, int na, int nb) {
     if (nb == 1) return 2.0 * (floor(U_min) + 1.0) / (double)(na + 1);
 
     // Normal approximation, very good for na>=8 && nb>=8 and reasonable if na<8 or nb<8
-    if (na >= 8 || nb >= 8) {
+    if (na >= MWU_EXACT_MAX || nb >= MWU_EXACT_MAX) {
         double mean = ((double)na * nb) * 0.5;
         // Correction for ties:
         double N = na + nb;
@@ -458,8 +612,7 @@ static double mann_whitney_u(float *a, float *b, int na, int nb) {
     }
 
     // Exact calculation
-    double pval = 2.0 * mann_whitney_1947_cdf(na, nb, (int)U_min);
-    return pval > 1.0 ? 1.0 : pval;
+    return mann_whitney_exact(na, nb, (int)U_min);
 }
 
 // retrieve phase information from BCF record
@@ -502,51 +655,58 @@ static int bcf_get_format_sign(bcf_fmt_t *fmt, int8_t *fmt_sign_arr, int nsmpl)
     return 1;
 }
 
-bcf1_t *process(bcf1_t *rec) {
-    // compute GC and CpG content for each site
-    if (args->fai) {
-        int fa_len;
-        int at_cnt = 0, cg_cnt = 0, cpg_cnt = 0;
-        const char *ref = rec->d.allele[0];
-        char *fa = faidx_fetch_seq(args->fai, bcf_seqname(args->in_hdr, rec), rec->pos - args->gc_win,
-                                   rec->pos + (int)strlen(ref) - 1 + args->gc_win, &fa_len);
-        if (!fa)
-            error("fai_fetch_seq failed at %s:%" PRId64 "\n", bcf_hdr_id2name(args->in_hdr, rec->rid), rec->pos + 1);
-        for (int i = 0; i < fa_len; i++) {
-            if (fa[i] > 96) fa[i] = (char)(fa[i] - 32);
-            if (fa[i] == 'A' || fa[i] == 'T') at_cnt++;
-            if (fa[i] == 'C' || fa[i] == 'G') cg_cnt++;
-            if (i > 0)
-                if (fa[i - 1] == 'C' && fa[i] == 'G') cpg_cnt += 2;
-        }
-        free(fa);
-        float ratio = (float)(cg_cnt) / (float)(at_cnt + cg_cnt);
-        bcf_update_info_float(args->out_hdr, rec, "GC", &ratio, 1);
-        ratio = (float)cpg_cnt / (float)(fa_len);
-        bcf_update_info_float(args->out_hdr, rec, "CpG", &ratio, 1);
+// loads the chunk of the reference starting at beg and covering at least up to end
+static void gc_cache_load(gc_cache_t *self, const faidx_t *fai, const char *name, int beg, int end) {
+    if (end < beg + GC_CHUNK_SIZE - 1) end = beg + GC_CHUNK_SIZE - 1;
+    if (end > self->len - 1) end = self->len - 1;
+    int fa_len;
+    char *fa = faidx_fetch_seq(fai, name, beg, end, &fa_len);
+    if (!fa || fa_len != end - beg + 1) error("fai_fetch_seq failed at %s:%d\n", name, beg + 1);
+    hts_expand(gc_sum_t, fa_len + 1, self->m_sum, self->sum);
+    gc_sum_t *sum = self->sum;
+    sum[0].at = sum[0].cg = sum[0].cpg = 0;
+    for (int i = 0; i < fa_len; i++) {
+        if (fa[i] > 96) fa[i] = (char)(fa[i] - 32);
+        sum[i + 1].at = sum[i].at + (fa[i] == 'A' || fa[i] == 'T');
+        sum[i + 1].cg = sum[i].cg + (fa[i] == 'C' || fa[i] == 'G');
+        sum[i + 1].cpg = sum[i].cpg + (i > 0 && fa[i - 1] == 'C' && fa[i] == 'G');
     }
-    if (args->nsmpl == 0) return rec;
+    free(fa);
+    self->beg = beg;
+    self->end = end;
+}
 
-    // extract format information from VCF format records
-    bcf_fmt_t *gt_fmt = bcf_get_fmt_id(rec, args->gt_id);
-    int gt_phase = bcf_get_genotype_phase(gt_fmt, args->gt_phase_arr, args->nsmpl);
-    if (!bcf_get_genotype_alleles(gt_fmt, args->gt0_arr, args->gt1_arr, args->nsmpl)) goto ret;
-    bcf_fmt_t *fmt = bcf_get_fmt_id(rec, args->fmt_id);
-    int fmt_sign = (args->format && fmt) ? bcf_get_format_sign(fmt, args->fmt_sign_arr, args->nsmpl) : 0;
-    bcf_fmt_t *ad_fmt = bcf_get_fmt_id(rec, args->ad_id);
-    int ad =
-        ad_fmt ? bcf_get_allelic_depth(ad_fmt, args->gt0_arr, args->gt1_arr, args->ad0_arr, args->ad1_arr, args->nsmpl)
-               : 0;
-    bcf_fmt_t *baf_fmt = bcf_get_fmt_id(rec, args->baf_id);
-    int baf = baf_fmt && baf_fmt->n == 1 && baf_fmt->type == BCF_BT_FLOAT ? 1 : 0;
-    bcf_fmt_t *lrr_fmt = bcf_get_fmt_id(rec, args->lrr_id);
-    int lrr = lrr_fmt && lrr_fmt->n == 1 && lrr_fmt->type == BCF_BT_FLOAT ? 1 : 0;
+// computes GC and CpG content in the window [beg, end] of the reference, clipped to the contig as faidx_fetch_seq()
+// does, and returns the length of the clipped window
+static int gc_cache_get(gc_cache_t *self, const faidx_t *fai, const char *name, int rid, int beg, int end, int *at_cnt,
+                        int *cg_cnt, int *cpg_cnt) {
+    if (self->rid != rid) {
+        self->len = faidx_seq_len(fai, name);
+        if (self->len < 0) error("Contig %s is missing from the reference\n", name);
+        self->rid = rid;
+        self->beg = 0;
+        self->end = -1;
+    }
+    if (beg < 0) beg = 0;
+    if (end > self->len - 1) end = self->len - 1;
+    if (beg > end) error("fai_fetch_seq failed at %s:%d\n", name, beg + 1);
+    if (beg < self->beg || end > self->end) gc_cache_load(self, fai, name, beg, end);
+    const gc_sum_t *sum = self->sum;
+    int a = beg - self->beg, b = end - self->beg;
+    *at_cnt = sum[b + 1].at - sum[a].at;
+    *cg_cnt = sum[b + 1].cg - sum[a].cg;
+    *cpg_cnt = 2 * (sum[b + 1].cpg - sum[a + 1].cpg); // skips the pair whose C precedes the window
+    return end - beg + 1;
+}
 
-    float ret[4];
+// counts heterozygous genotypes, phases, and allelic depths across a range of samples
+static void *site_job_run(void *arg) {
+    site_job_t *job = (site_job_t *)arg;
+    int gt_phase = job->gt_phase, fmt_sign = job->fmt_sign, ad = job->ad, baf = job->baf;
     int ac_het = 0, ac_sex[] = {0, 0, 0, 0}, ac_het_sex[] = {0, 0}, ac_het_phase[] = {0, 0}, fmt_bal[] = {0, 0},
         fmt_bal_phase[] = {0, 0}, ad_het[] = {0, 0};
 
-    for (int i = 0; i < args->nsmpl; i++) {
+    for (int i = job->beg; i < job->end; i++) {
         float curr_baf = NAN;
 
         // if genotype is missing, skip
@@ -585,9 +745,109 @@ bcf1_t *process(bcf1_t *rec) {
             ad_het[1] += alt_cnt;
             curr_baf = ((float)alt_cnt + 0.5f) / ((float)ref_cnt + (float)alt_cnt + 1.0f);
         }
-        if (baf) curr_baf = ((float *)baf_fmt->p)[i];
+        if (baf) curr_baf = ((const float *)job->baf_fmt->p)[i];
         if (idx_gt_phase >= 0 && !isnan(curr_baf)) {
-            args->baf_arr[idx_gt_phase][ac_het_phase[idx_gt_phase] - 1] = curr_baf;
+            job->baf_arr[idx_gt_phase][ac_het_phase[idx_gt_phase] - 1] = curr_baf;
+        }
+    }
+
+    job->ac_het = ac_het;
+    for (int k = 0; k < 4; k++) job->ac_sex[k] = ac_sex[k];
+    for (int k = 0; k < 2; k++) {
+        job->ac_het_sex[k] = ac_het_sex[k];
+        job->ac_het_phase[k] = ac_het_phase[k];
+        job->fmt_bal[k] = fmt_bal[k];
+        job->fmt_bal_phase[k] = fmt_bal_phase[k];
+        job->ad_het[k] = ad_het[k];
+    }
+    return NULL;
+}
+
+bcf1_t *process(bcf1_t *rec) {
+    // compute GC and CpG content for each site
+    if (args->fai) {
+        int at_cnt, cg_cnt, cpg_cnt;
+        const char *ref = rec->d.allele[0];
+        int fa_len = gc_cache_get(&args->gc_cache, args->fai, bcf_seqname(args->in_hdr, rec), rec->rid,
+                                  (int)rec->pos - args->gc_win, (int)rec->pos + (int)strlen(ref) - 1 + args->gc_win,
+                                  &at_cnt, &cg_cnt, &cpg_cnt);
+        float ratio = (float)(cg_cnt) / (float)(at_cnt + cg_cnt);
+        bcf_update_info_float(args->out_hdr, rec, "GC", &ratio, 1);
+        ratio = (float)cpg_cnt / (float)(fa_len);
+        bcf_update_info_float(args->out_hdr, rec, "CpG", &ratio, 1);
+    }
+    if (args->nsmpl == 0) return rec;
+
+    // regenerate the dense annotations from the runs of the sparse annotations
+    if (args->annot) {
+        if (args->annot_rid != rec->rid) {
+            annot_reader_load(args->annot, bcf_seqname(args->in_hdr, rec));
+            args->annot_rid = rec->rid;
+        }
+        for (int i = 0; i < args->nsmpl; i++) {
+            if (args->annot_imap[i] < 0) {
+                bcf_float_set_missing(args->ldev_arr[i]);
+                bcf_float_set_missing(args->bdev_arr[i]);
+                args->bdev_phase_arr[i] = bcf_int32_missing;
+            } else {
+                annot_reader_get(args->annot, args->annot_imap[i], (int)rec->pos + 1, &args->ldev_arr[i],
+                                 &args->bdev_arr[i], &args->bdev_phase_arr[i]);
+            }
+        }
+        bcf_update_format_float(args->out_hdr, rec, "Ldev", args->ldev_arr, args->nsmpl);
+        bcf_update_format_float(args->out_hdr, rec, "Bdev", args->bdev_arr, args->nsmpl);
+        bcf_update_format_int32(args->out_hdr, rec, "Bdev_Phase", args->bdev_phase_arr, args->nsmpl);
+    }
+
+    // extract format information from VCF format records
+    bcf_fmt_t *gt_fmt = bcf_get_fmt_id(rec, args->gt_id);
+    int gt_phase = bcf_get_genotype_phase(gt_fmt, args->gt_phase_arr, args->nsmpl);
+    if (!bcf_get_genotype_alleles(gt_fmt, args->gt0_arr, args->gt1_arr, args->nsmpl)) goto ret;
+    bcf_fmt_t *fmt = bcf_get_fmt_id(rec, args->fmt_id);
+    int fmt_sign = (args->format && fmt) ? bcf_get_format_sign(fmt, args->fmt_sign_arr, args->nsmpl) : 0;
+    bcf_fmt_t *ad_fmt = bcf_get_fmt_id(rec, args->ad_id);
+    int ad =
+        ad_fmt ? bcf_get_allelic_depth(ad_fmt, args->gt0_arr, args->gt1_arr, args->ad0_arr, args->ad1_arr, args->nsmpl)
+               : 0;
+    bcf_fmt_t *baf_fmt = bcf_get_fmt_id(rec, args->baf_id);
+    int baf = baf_fmt && baf_fmt->n == 1 && baf_fmt->type == BCF_BT_FLOAT ? 1 : 0;
+    bcf_fmt_t *lrr_fmt = bcf_get_fmt_id(rec, args->lrr_id);
+    int lrr = lrr_fmt && lrr_fmt->n == 1 && lrr_fmt->type == BCF_BT_FLOAT ? 1 : 0;
+
+    float ret[4];
+    int ac_het = 0, ac_sex[] = {0, 0, 0, 0}, ac_het_sex[] = {0, 0}, ac_het_phase[] = {0, 0}, fmt_bal[] = {0, 0},
+        fmt_bal_phase[] = {0, 0}, ad_het[] = {0, 0};
+
+    // count the samples in ranges across the threads and then combine the counts in the order of the samples
+    for (int i = 0; i < args->n_jobs; i++) {
+        site_job_t *job = &args->jobs[i];
+        job->gt_phase = gt_phase;
+        job->fmt_sign = fmt_sign;
+        job->ad = ad;
+        job->baf = baf;
+        job->baf_fmt = baf_fmt;
+    }
+    if (args->q) {
+        for (int i = 0; i < args->n_jobs - 1; i++)
+            if (hts_tpool_dispatch(args->tpool, args->q, site_job_run, &args->jobs[i]) < 0)
+                error("Failed to dispatch the site jobs\n");
+        site_job_run(&args->jobs[args->n_jobs - 1]);
+        if (hts_tpool_process_flush(args->q) < 0) error("Failed to wait for the site jobs\n");
+    } else {
+        site_job_run(&args->jobs[0]);
+    }
+    for (int i = 0; i < args->n_jobs; i++) {
+        const site_job_t *job = &args->jobs[i];
+        ac_het += job->ac_het;
+        for (int k = 0; k < 4; k++) ac_sex[k] += job->ac_sex[k];
+        for (int k = 0; k < 2; k++) {
+            if (i > 0)
+                memcpy(args->baf_arr[k] + ac_het_phase[k], job->baf_arr[k], job->ac_het_phase[k] * sizeof(float));
+            ac_het_sex[k] += job->ac_het_sex[k];
+            ac_het_phase[k] += job->ac_het_phase[k];
+            fmt_bal[k] += job->fmt_bal[k];
+            fmt_bal_phase[k] += job->fmt_bal_phase[k];
+            ad_het[k] += job->ad_het[k];
         }
     }
 
@@ -620,12 +880,14 @@ bcf1_t *process(bcf1_t *rec) {
         bcf_update_info_float(args->out_hdr, rec, "AD_Het_Test", &ret, 1);
     }
     if (args->phase && ac_het_phase[0] && ac_het_phase[1]) {
-        ret[0] = get_median(args->baf_arr[0], ac_het_phase[0], NULL);
-        ret[1] = get_median(args->baf_arr[1], ac_het_phase[1], NULL);
+        ret[0] = get_median_buf(args->baf_arr[0], ac_het_phase[0], NULL, args->median_buf);
+        ret[1] = get_median_buf(args->baf_arr[1], ac_het_phase[1], NULL, args->median_buf);
         ret[2] =
             0.0f - (float)log10(welch_t_test(args->baf_arr[0], args->baf_arr[1], ac_het_phase[0], ac_het_phase[1]));
         ret[3] =
-            0.0f - (float)log10(mann_whitney_u(args->baf_arr[0], args->baf_arr[1], ac_het_phase[0], ac_het_phase[1]));
+            0.0f
+            - (float)log10(mann_whitney_u(args->baf_arr[0], args->baf_arr[1], ac_het_phase[0], ac_het_phase[1],
+                                          args->sort_buf));
         bcf_update_info_float(args->out_hdr, rec, "BAF_Phase_Test", &ret, 4);
     }
 
@@ -656,7 +918,7 @@ bcf1_t *process(bcf1_t *rec) {
             int n = 0;
             for (int j = 0; j < args->nsmpl; j++)
                 if (args->gt0_arr[j] == alleles[i] && args->gt1_arr[j] == alleles[i]) args->imap_arr[n++] = j;
-            median[i] = get_median((float *)baf_fmt->p, n, args->imap_arr);
+            median[i] = get_median_buf((float *)baf_fmt->p, n, args->imap_arr, args->median_buf);
             if (median[i] < .5)
                 alleles_idx[i] = alleles[0];
             else if (median[i] > .5)
@@ -716,5 +978,21 @@ void destroy(void) {
     free(args->baf_arr[0]);
     free(args->baf_arr[1]);
     free(args->imap_arr);
+    free(args->median_buf);
+    free(args->sort_buf);
+    for (int i = 1; i < args->n_jobs; i++) {
+        free(args->jobs[i].baf_arr[0]);
+        free(args->jobs[i].baf_arr[1]);
+    }
+    free(args->jobs);
+    if (args->q) hts_tpool_process_destroy(args->q);
+    if (args->tpool) hts_tpool_destroy(args->tpool);
+    if (args->annot) annot_reader_destroy(args->annot);
+    free(args->annot_imap);
+    free(args->ldev_arr);
+    free(args->bdev_arr);
+    free(args->bdev_phase_arr);
+    if (args->fai) fai_destroy(args->fai);
+    free(args->gc_cache.sum);
     free(args);
 }
@@ -32,9 +32,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <htslib/vcf.h>
 #include <htslib/kseq.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 
 #define TRIO_PHASE_VERSION "2020-08-13"
@@ -42,6 +44,8 @@
 #define ABSOLUTE (1 << 24)
 #define TRANSMITTED (1 << 16)
 #define RELATIVE (1 << 8)
+#define FAMILY_JOB_MIN 1024 // minimum number of individuals in the families of a worker job
+#define TRIO_LANES 64        // trios phased together by the packed kernel
 
 typedef struct {
     int *a;
@@ -60,6 +64,28 @@ typedef struct {
     int32_t ibd_mother;
 } ind_t;
 
+// pedigree connected component, as the phase of its individuals does not depend on other families
+typedef struct {
+    set_t children;
+    set_t inds;
+    int is_trio; // whether the family is a single child with at most one father and one mother
+    int trio[3]; // child, father, and mother of a trio, -1 if missing
+} family_t;
+
+// biallelic genotypes of up to 64 trios, one trio per bit, for child, father, and mother
+typedef struct {
+    uint64_t a0[3], a1[3]; // whether each allele is the alternate allele
+    uint64_t phased[3];    // phase bit of the second allele
+    uint64_t present[3];   // whether the genotype is not missing
+    uint64_t ibd[2];       // IBD state of the child with the father and the mother
+} trio_pack_t;
+
+// families phased by one worker job
+typedef struct {
+    family_t *families;
+    int n;
+} family_job_t;
+
 typedef struct {
     bcf_hdr_t *in_hdr, *out_hdr;
     ind_t *inds;
@@ -68,6 +94,12 @@ typedef struct {
     int32_t *arr;
     int m_arr;
     int niters;
+    family_t *families;
+    int n_families;
+    family_job_t *jobs;
+    int n_jobs;
+    hts_tpool *tpool;
+    hts_tpool_process *q;
 } args_t;
 
 args_t *args;
@@ -137,6 +169,7 @@ const char *usage(void) {
            "   -i, --ibd                   Whether to add IBD state for duos\n"
            "   -n, --niters                Number of iterations when propagating information "
            "[3]\n"
+           "       --threads <int>         Number of extra threads to phase the families [0]\n"
            "\n"
            "Example:\n"
            "   bcftools +trio-phase file.bcf -- --ped file.ped\n"
@@ -171,6 +204,87 @@ static void parse_ped(args_t *args, char *fname) {
     hts_close(fp);
 }
 
+static void set_push(set_t *set, int id) {
+    set->n++;
+    hts_expand(int, set->n, set->m, set->a);
+    set->a[set->n - 1] = id;
+}
+
+static int find_root(int *root, int i) {
+    while (root[i] != i) {
+        root[i] = root[root[i]];
+        i = root[i];
+    }
+    return i;
+}
+
+// splits children and parents into families and spreads the families across the worker jobs
+static void init_families(args_t *args, int n_threads) {
+    int nsmpl = bcf_hdr_nsamples(args->in_hdr);
+    int *root = (int *)malloc(nsmpl * sizeof(int));
+    for (int i = 0; i < nsmpl; i++) root[i] = i;
+    for (int i = 0; i < args->children.n; i++) {
+        int child_id = args->children.a[i];
+        ind_t *child_ind = &args->inds[child_id];
+        for (int j = 0; j < child_ind->fathers.n; j++)
+            root[find_root(root, child_ind->fathers.a[j])] = find_root(root, child_id);
+        for (int j = 0; j < child_ind->mothers.n; j++)
+            root[find_root(root, child_ind->mothers.a[j])] = find_root(root, child_id);
+    }
+
+    // families are numbered and their children kept in the order the children were read
+    int *family_idx = (int *)malloc(nsmpl * sizeof(int));
+    for (int i = 0; i < nsmpl; i++) family_idx[i] = -1;
+    int m_families = 0;
+    for (int i = 0; i < args->children.n; i++) {
+        int r = find_root(root, args->children.a[i]);
+        if (family_idx[r] < 0) {
+            family_idx[r] = args->n_families++;
+            hts_expand0(family_t, args->n_families, m_families, args->families);
+        }
+        set_push(&args->families[family_idx[r]].children, args->children.a[i]);
+    }
+    for (int i = 0; i < nsmpl; i++) {
+        int r = find_root(root, i);
+        if (family_idx[r] >= 0) set_push(&args->families[family_idx[r]].inds, i);
+    }
+    free(root);
+    free(family_idx);
+    for (int i = 0; i < args->n_families; i++) {
+        family_t *family = &args->families[i];
+        if (family->children.n != 1) continue;
+        ind_t *child_ind = &args->inds[family->children.a[0]];
+        if (child_ind->fathers.n > 1 || child_ind->mothers.n > 1
+            || family->inds.n != 1 + child_ind->fathers.n + child_ind->mothers.n)
+            continue;
+        family->is_trio = 1;
+        family->trio[0] = family->children.a[0];
+        family->trio[1] = child_ind->fathers.n ? child_ind->fathers.a[0] : -1;
+        family->trio[2] = child_ind->mothers.n ? child_ind->mothers.a[0] : -1;
+    }
+
+    int n_inds = 0;
+    for (int i = 0; i < args->n_families; i++) n_inds += args->families[i].inds.n;
+    // the main thread runs the last job while the extra threads run the others
+    args->n_jobs = n_threads + 1;
+    if (args->n_jobs > n_inds / FAMILY_JOB_MIN) args->n_jobs = n_inds / FAMILY_JOB_MIN;
+    if (args->n_jobs < 1) args->n_jobs = 1;
+    args->jobs = (family_job_t *)calloc(args->n_jobs, sizeof(family_job_t));
+    for (int i = 0, j = 0, k = 0; i < args->n_jobs; i++) {
+        int end = i == args->n_jobs - 1 ? n_inds : (int)((int64_t)n_inds * (i + 1) / args->n_jobs);
+        args->jobs[i].families = args->families + j;
+        while (j < args->n_families && k < end) k += args->families[j++].inds.n;
+        args->jobs[i].n = (int)(args->families + j - args->jobs[i].families);
+    }
+
+    if (args->n_jobs > 1) {
+        args->tpool = hts_tpool_init(n_threads);
+        if (!args->tpool) error("Failed to create the thread pool\n");
+        args->q = hts_tpool_process_init(args->tpool, 2 * n_threads, 1);
+        if (!args->q) error("Failed to create the worker queue\n");
+    }
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     args = (args_t *)calloc(1, sizeof(args_t));
     args->prev_rid = -1;
@@ -183,10 +297,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     }
     args->niters = 3;
     char *ped_fname = NULL;
+    int n_threads = 0;
 
     static struct option loptions[] = {{"ped", required_argument, NULL, 'p'},
                                        {"ibd", no_argument, NULL, 'i'},
                                        {"niters", required_argument, NULL, 'n'},
+                                       {"threads", required_argument, NULL, 9},
                                        {0, 0, 0, 0}};
     int c;
     char *tmp = NULL;
@@ -200,7 +316,11 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
             break;
         case 'n':
             args->niters = (int)strtol(optarg, &tmp, 0);
-            if (*tmp) error("Could not parse: --threads %s\n", optarg);
+            if (*tmp) error("Could not parse: --niters %s\n", optarg);
+            break;
+        case 9:
+            n_threads = (int)strtol(optarg, &tmp, 0);
+            if (*tmp || n_threads < 0) error("Could not parse: --threads %s\n", optarg);
             break;
         case 'h':
         case '?':
@@ -211,6 +331,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     }
     if (!ped_fname) error("Expected the -p option\n");
     parse_ped(args, ped_fname);
+    init_families(args, n_threads);
     if (args->ibd) {
         bcf_hdr_append(args->out_hdr,
                        "##FORMAT=<ID=IBD_F,Number=1,Type=Integer,Description=\"IBD state with "
@@ -222,46 +343,15 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out) {
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec) {
-    // extract genotypes from record and checks whether they follow a diploid model
-    int nsmpl = bcf_hdr_nsamples(args->in_hdr);
-    int ngt = bcf_get_genotypes(args->in_hdr, rec, &args->arr, &args->m_arr);
-    if (ngt < 0) return rec;
-    int ploidy = ngt / nsmpl;
-    if (ploidy != 2) return rec;
-
-    // check whether the chromosome in the record has changed
-    if (rec->rid != args->prev_rid) {
-        args->prev_rid = rec->rid;
-        for (int i = 0; i < nsmpl; i++) {
-            ind_t *sample_ind = &args->inds[i];
-            sample_ind->is_prev_het_flipped = 0;
-        }
-        for (int i = 0; i < args->children.n; i++) {
-            int child_id = args->children.a[i];
-            ind_t *child_ind = &args->inds[child_id];
-            child_ind->ibd_father = 0;
-            child_ind->ibd_mother = 0;
-        }
-    }
-
-    // copy genotypes inside individual structure while propagating information across
-    // consecutive heterozygous sites
-    for (int i = 0; i < nsmpl; i++) {
-        ind_t *sample_ind = &args->inds[i];
-        sample_ind->gt[0] = args->arr[ploidy * i];
-        sample_ind->gt[1] = args->arr[ploidy * i + 1];
-        if (gt_is_het(sample_ind->gt) && gt_is_phased(sample_ind->gt) && sample_ind->is_prev_het_flipped)
-            flip_gt(sample_ind->gt);
-    }
-
+// propagates phase information within a family
+static void family_phase(args_t *args, const family_t *family) {
     // run multiple times to ensure convergence
     for (int j = 0; j < args->niters; j++) {
-        for (int i = 0; i < nsmpl; i++) args->inds[i].flip_vote = 0;
+        for (int i = 0; i < family->inds.n; i++) args->inds[family->inds.a[i]].flip_vote = 0;
 
         // propagate absolute and relative phase information from parents to children
-        for (int i = 0; i < args->children.n; i++) {
-            int child_id = args->children.a[i];
+        for (int i = 0; i < family->children.n; i++) {
+            int child_id = family->children.a[i];
             ind_t *child_ind = &args->inds[child_id];
             if (gt_is_missing(child_ind->gt) || !gt_is_het(child_ind->gt)) continue;
 
@@ -319,8 +409,8 @@ bcf1_t *process(bcf1_t *rec) {
         }
 
         // propagate relative phase information from children to parents
-        for (int i = 0; i < args->children.n; i++) {
-            int child_id = args->children.a[i];
+        for (int i = 0; i < family->children.n; i++) {
+            int child_id = family->children.a[i];
             ind_t *child_ind = &args->inds[child_id];
 
             if (gt_is_missing(child_ind->gt) || (gt_is_het(child_ind->gt) && !gt_is_phased(child_ind->gt))) continue;
@@ -347,12 +437,12 @@ bcf1_t *process(bcf1_t *rec) {
         }
 
         // propagate relative phase information from children to parents
-        for (int i = 0; i < nsmpl; i++) ind_vote(&args->inds[i]);
+        for (int i = 0; i < family->inds.n; i++) ind_vote(&args->inds[family->inds.a[i]]);
     }
 
     // update IBD states in children (if both child and parent are heterozygous and phased)
-    for (int i = 0; i < args->children.n; i++) {
-        int child_id = args->children.a[i];
+    for (int i = 0; i < family->children.n; i++) {
+        int child_id = family->children.a[i];
         ind_t *child_ind = &args->inds[child_id];
         if (gt_is_missing(child_ind->gt) || !gt_is_het(child_ind->gt) || !gt_is_phased(child_ind->gt)) continue;
 
@@ -388,6 +478,168 @@ bcf1_t *process(bcf1_t *rec) {
         else if (vote < 0)
             child_ind->ibd_mother = 1;
     }
+}
+
+// packs the genotypes of the trios and returns the mask of the trios with only biallelic or missing genotypes,
+// unphased first alleles, and IBD states set, as only these follow the packed kernel
+static uint64_t trio_pack(const args_t *args, family_t **trios, int n, trio_pack_t *pack) {
+    memset(pack, 0, sizeof(trio_pack_t));
+    uint64_t regular = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        int is_regular = 1;
+        for (int k = 0; k < 3; k++) {
+            if (trios[i]->trio[k] < 0) continue;
+            const int32_t *gt = args->inds[trios[i]->trio[k]].gt;
+            if (gt[0] >> 1 == 0 && gt[1] >> 1 == 0) continue; // missing genotype
+            if ((gt[0] & 1) || gt[0] >> 1 < 1 || gt[0] >> 1 > 2 || gt[1] >> 1 < 1 || gt[1] >> 1 > 2) is_regular = 0;
+            pack->present[k] |= bit;
+            if (gt[0] >> 1 == 2) pack->a0[k] |= bit;
+            if (gt[1] >> 1 == 2) pack->a1[k] |= bit;
+            if (gt[1] & 1) pack->phased[k] |= bit;
+        }
+        const ind_t *child_ind = &args->inds[trios[i]->trio[0]];
+        if (child_ind->ibd_father != 0 && child_ind->ibd_father != 1) is_regular = 0;
+        if (child_ind->ibd_mother != 0 && child_ind->ibd_mother != 1) is_regular = 0;
+        if (child_ind->ibd_father == 1) pack->ibd[0] |= bit;
+        if (child_ind->ibd_mother == 1) pack->ibd[1] |= bit;
+        if (is_regular) regular |= bit;
+    }
+    return regular;
+}
+
+// follows the same votes as family_phase() for trios, as no vote on a trio comes from more than one individual
+static void trio_pack_phase(trio_pack_t *pack, int niters) {
+    uint64_t *a0 = pack->a0, *a1 = pack->a1, *ph = pack->phased, *pr = pack->present;
+    uint64_t het_c, het_f, het_m, fa, ma, dev_f, dev_m;
+    for (int j = 0; j < niters; j++) {
+        // votes of the parents on the child, where the father breaks the ties
+        het_c = (a0[0] ^ a1[0]) & pr[0];
+        het_f = (a0[1] ^ a1[1]) & pr[1];
+        het_m = (a0[2] ^ a1[2]) & pr[2];
+        uint64_t hom_f = ~(a0[1] ^ a1[1]) & pr[1], hom_m = ~(a0[2] ^ a1[2]) & pr[2];
+        fa = (pack->ibd[0] & a1[1]) | (~pack->ibd[0] & a0[1]); // allele of the father transmitted to the child
+        ma = (pack->ibd[1] & a1[2]) | (~pack->ibd[1] & a0[2]); // allele of the mother transmitted to the child
+        uint64_t f_neg_abs = het_c & hom_f & ~(a0[1] ^ a0[0]), f_pos_abs = het_c & hom_f & (a0[1] ^ a0[0]);
+        uint64_t m_pos_abs = het_c & hom_m & ~(a0[2] ^ a0[0]), m_neg_abs = het_c & hom_m & (a0[2] ^ a0[0]);
+        uint64_t f_neg_rel = het_c & het_f & ph[1] & ~(fa ^ a0[0]), f_pos_rel = het_c & het_f & ph[1] & (fa ^ a0[0]);
+        uint64_t m_pos_rel = het_c & het_m & ph[2] & ~(ma ^ a0[0]), m_neg_rel = het_c & het_m & ph[2] & (ma ^ a0[0]);
+        uint64_t f_abs = f_neg_abs | f_pos_abs, m_abs = m_neg_abs | m_pos_abs, f_rel = f_neg_rel | f_pos_rel;
+        uint64_t flip = f_pos_abs | (~f_abs & (m_pos_abs | (~m_abs & (f_pos_rel | (~f_rel & m_pos_rel)))));
+        uint64_t keep = f_neg_abs | (~f_abs & (m_neg_abs | (~m_abs & (f_neg_rel | (~f_rel & m_neg_rel)))));
+        a0[0] ^= flip;
+        a1[0] ^= flip;
+        ph[0] |= flip | keep;
+
+        // votes of the child on the heterozygous parents
+        uint64_t valid_c = pr[0] & (~(a0[0] ^ a1[0]) | ph[0]);
+        dev_f = valid_c & het_f & (fa ^ a0[0]);
+        dev_m = valid_c & het_m & (ma ^ a1[0]);
+        a0[1] ^= dev_f;
+        a1[1] ^= dev_f;
+        ph[1] |= valid_c & het_f;
+        a0[2] ^= dev_m;
+        a1[2] ^= dev_m;
+        ph[2] |= valid_c & het_m;
+    }
+
+    // IBD states of phased heterozygous children with phased heterozygous parents
+    het_c = (a0[0] ^ a1[0]) & pr[0] & ph[0];
+    het_f = het_c & (a0[1] ^ a1[1]) & pr[1] & ph[1];
+    het_m = het_c & (a0[2] ^ a1[2]) & pr[2] & ph[2];
+    pack->ibd[0] = (pack->ibd[0] & ~het_f) | ((a0[0] ^ a0[1]) & het_f);
+    pack->ibd[1] = (pack->ibd[1] & ~het_m) | ((a1[0] ^ a0[2]) & het_m);
+}
+
+static void trio_unpack(args_t *args, family_t **trios, int n, const trio_pack_t *pack, uint64_t regular) {
+    for (int i = 0; i < n; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        if (!(regular & bit)) continue;
+        for (int k = 0; k < 3; k++) {
+            if (trios[i]->trio[k] < 0 || !(pack->present[k] & bit)) continue;
+            int32_t *gt = args->inds[trios[i]->trio[k]].gt;
+            gt[0] = bcf_gt_unphased(pack->a0[k] & bit ? 1 : 0);
+            gt[1] = pack->phased[k] & bit ? bcf_gt_phased(pack->a1[k] & bit ? 1 : 0)
+                                           : bcf_gt_unphased(pack->a1[k] & bit ? 1 : 0);
+        }
+        ind_t *child_ind = &args->inds[trios[i]->trio[0]];
+        child_ind->ibd_father = pack->ibd[0] & bit ? 1 : 0;
+        child_ind->ibd_mother = pack->ibd[1] & bit ? 1 : 0;
+    }
+}
+
+// phases up to 64 trios together, falling back to family_phase() for the trios the kernel does not cover
+static void trio_batch_phase(args_t *args, family_t **trios, int n) {
+    trio_pack_t pack;
+    uint64_t regular = trio_pack(args, trios, n, &pack);
+    trio_pack_phase(&pack, args->niters);
+    trio_unpack(args, trios, n, &pack, regular);
+    for (int i = 0; i < n; i++)
+        if (!(regular & (uint64_t)1 << i)) family_phase(args, trios[i]);
+}
+
+static void *family_job_run(void *arg) {
+    family_job_t *job = (family_job_t *)arg;
+    family_t *trios[TRIO_LANES];
+    int n_trios = 0;
+    for (int i = 0; i < job->n; i++) {
+        if (!job->families[i].is_trio) {
+            family_phase(args, &job->families[i]);
+            continue;
+        }
+        trios[n_trios++] = &job->families[i];
+        if (n_trios == TRIO_LANES) {
+            trio_batch_phase(args, trios, n_trios);
+            n_trios = 0;
+        }
+    }
+    if (n_trios) trio_batch_phase(args, trios, n_trios);
+    return NULL;
+}
+
+bcf1_t *process(bcf1_t *rec) {
+    // extract genotypes from record and checks whether they follow a diploid model
+    int nsmpl = bcf_hdr_nsamples(args->in_hdr);
+    int ngt = bcf_get_genotypes(args->in_hdr, rec, &args->arr, &args->m_arr);
+    if (ngt < 0) return rec;
+    int ploidy = ngt / nsmpl;
+    if (ploidy != 2) return rec;
+
+    // check whether the chromosome in the record has changed
+    if (rec->rid != args->prev_rid) {
+        args->prev_rid = rec->rid;
+        for (int i = 0; i < nsmpl; i++) {
+            ind_t *sample_ind = &args->inds[i];
+            sample_ind->is_prev_het_flipped = 0;
+        }
+        for (int i = 0; i < args->children.n; i++) {
+            int child_id = args->children.a[i];
+            ind_t *child_ind = &args->inds[child_id];
+            child_ind->ibd_father = 0;
+            child_ind->ibd_mother = 0;
+        }
+    }
+
+    // copy genotypes inside individual structure while propagating information across
+    // consecutive heterozygous sites
+    for (int i = 0; i < nsmpl; i++) {
+        ind_t *sample_ind = &args->inds[i];
+        sample_ind->gt[0] = args->arr[ploidy * i];
+        sample_ind->gt[1] = args->arr[ploidy * i + 1];
+        if (gt_is_het(sample_ind->gt) && gt_is_phased(sample_ind->gt) && sample_ind->is_prev_het_flipped)
+            flip_gt(sample_ind->gt);
+    }
+
+    // phase the families, which do not depend on each other, across the threads
+    if (args->q) {
+        for (int i = 0; i < args->n_jobs - 1; i++)
+            if (hts_tpool_dispatch(args->tpool, args->q, family_job_run, &args->jobs[i]) < 0)
+                error("Failed to dispatch the family jobs\n");
+        family_job_run(&args->jobs[args->n_jobs - 1]);
+        if (hts_tpool_process_flush(args->q) < 0) error("Failed to wait for the family jobs\n");
+    } else {
+        family_job_run(&args->jobs[0]);
+    }
 
     // copy individual structure back to genotypes and update is_prev_het_flipped values
     for (int i = 0; i < nsmpl; i++) {
@@ -419,6 +671,14 @@ void destroy(void) {
     for (int i = 0; i < bcf_hdr_nsamples(args->in_hdr); i++) ind_destroy(&args->inds[i]);
     free(args->inds);
     free(args->children.a);
+    for (int i = 0; i < args->n_families; i++) {
+        free(args->families[i].children.a);
+        free(args->families[i].inds.a);
+    }
+    free(args->families);
+    free(args->jobs);
+    if (args->q) hts_tpool_process_destroy(args->q);
+    if (args->tpool) hts_tpool_destroy(args->tpool);
     free(args->arr);
     free(args);
 }